@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# Opens and closes CHURN_CYCLES (a million, by default) connections to
+# R8_echo_server, with each of its allocators, and prints what loadgen
+# saw followed by what the server says it's holding afterwards.
+
+cd "$(dirname "$0")" || exit 1
+. ./lib.sh
+
+CYCLES=${CHURN_CYCLES:-1000000}
+CONNS=${CHURN_CONNS:-50}
+PORT=9877
+
+for alloc in libc pool; do
+	if [ $alloc = pool ]; then
+		flags=--pool
+	else
+		flags=
+	fi
+	start_server ../examples_R8/R8_echo_server $PORT $flags \
+	    >churn_$alloc.out 2>/dev/null
+	./loadgen --proto echo --port $PORT --churn --requests "$CYCLES" \
+	    --conns "$CONNS" --warmup 0 --label "$alloc"
+	# Let the server see the last connections go, then ask it.
+	sleep 1
+	kill -USR1 $pid
+	sleep 0.5
+	stop_server
+	cat churn_$alloc.out
+	rm -f churn_$alloc.out
+done
@@ -0,0 +1,102 @@
+#!/bin/sh
+#
+# Asks R10_static_server for a file of each of DELIVERY_SIZES over and
+# over, three times: with --copy-max and --mmap-max set so that it gets
+# copied, then mapped, then sent with sendfile().  For each run it prints
+# what loadgen saw, then a line with the server's CPU time per request.
+# Then, for each size, a line naming the way that got the most requests
+# through and the way that cost the server the least CPU per request, and
+# last, the sizes from which copies cost more than mmap() and mmap() more
+# than sendfile(), to compare with DELIVERY_COPY_MAX and DELIVERY_MMAP_MAX.
+# Over loopback, loadgen competes with the server for the CPU, so the
+# crossovers go by CPU time rather than by requests per second.
+# DELIVERY_CONNS (4), DELIVERY_DEPTH (1) and DELIVERY_DURATION (3) shape
+# the load.
+
+cd "$(dirname "$0")" || exit 1
+. ./lib.sh
+
+SIZES=${DELIVERY_SIZES:-"512 1024 2048 4096 8192 16384 65536 262144 1048576
+    4194304"}
+CONNS=${DELIVERY_CONNS:-4}
+DEPTH=${DELIVERY_DEPTH:-1}
+DURATION=${DELIVERY_DURATION:-3}
+SERVER=${SERVER:-$PWD/../examples_R10/R10_static_server}
+
+docroot=$(mktemp -d) || exit 1
+trap 'rm -rf "$docroot" delivery.json delivery.out' EXIT
+SERVER_DIR=$docroot
+
+: >delivery.out
+for size in $SIZES; do
+	head -c "$size" /dev/urandom >"$docroot/file.bin"
+	for mode in copy mmap sendfile; do
+		case $mode in
+		copy) flags="--copy-max $size --mmap-max $size" ;;
+		mmap) flags="--copy-max 0 --mmap-max $size" ;;
+		sendfile) flags="--copy-max 0 --mmap-max 0" ;;
+		esac
+		label=$mode-$size
+		start_server "$SERVER" $flags >/dev/null 2>&1
+		before=$(cpu_ticks)
+		./loadgen --path /file.bin --status 200 \
+		    --conns "$CONNS" --depth "$DEPTH" --warmup 0 \
+		    --duration "$DURATION" --label "$label" | tee delivery.json
+		after=$(cpu_ticks)
+		stop_server INT
+		requests=$(sed 's/.*"requests":\([0-9]*\).*/\1/' delivery.json)
+		rps=$(sed 's/.*"requests_per_s":\([0-9.]*\).*/\1/' delivery.json)
+		echo "$label $requests $((after - before))" |
+		    awk '{ printf "{\"label\":\"%s\",\"server_cpu_s\":%.2f," \
+			"\"server_cpu_us_per_request\":%.1f}\n", $1, $3 / 100,
+			$2 ? $3 * 10000 / $2 : 0 }'
+		echo "$size $mode $rps $requests $((after - before))" \
+		    >>delivery.out
+	done
+done
+
+# delivery.out has a line for each run: size, mode, requests per second,
+# requests, and server CPU ticks, with the three modes for each size in a
+# row.  A crossover is the size after the last one at which the cheaper
+# way still won, so that one noisy run doesn't move it; null means it
+# still won at the biggest size.
+awk '
+	BEGIN {
+		copy_won = mmap_won = 1
+	}
+	function cost(mode) {
+		return n[mode] ? t[mode] / n[mode] : 1e9
+	}
+	{
+		rps[$2] = $3
+		n[$2] = $4
+		t[$2] = $5
+	}
+	$2 == "sendfile" {
+		fastest = cheapest = "copy"
+		if (rps["mmap"] > rps[fastest])
+			fastest = "mmap"
+		if (rps["sendfile"] > rps[fastest])
+			fastest = "sendfile"
+		if (cost("mmap") < cost(cheapest))
+			cheapest = "mmap"
+		if (cost("sendfile") < cost(cheapest))
+			cheapest = "sendfile"
+		printf "{\"size\":%d,\"fastest\":\"%s\",\"cheapest\":\"%s\"}\n",
+		    $1, fastest, cheapest
+		if (copy_won)
+			copy_max = $1
+		if (mmap_won)
+			mmap_max = $1
+		copy_won = cost("copy") <= cost("mmap")
+		mmap_won = cost("mmap") <= cost("sendfile")
+		if (copy_won)
+			copy_max = "null"
+		if (mmap_won)
+			mmap_max = "null"
+	}
+	END {
+		printf "{\"copy_costlier_than_mmap_from\":%s," \
+		    "\"mmap_costlier_than_sendfile_from\":%s}\n",
+		    copy_max, mmap_max
+	}' delivery.out
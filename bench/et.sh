@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# Runs the tuned low-level rot13 server with level-triggered events, and
+# then with --et, under syscount.so, and prints what loadgen saw followed
+# by how many times the server called epoll_ctl(), epoll_wait(), recv()
+# and send(), and how much CPU time it used.  ET_SIZE (64), ET_DEPTH (1)
+# and ET_CONNS (10) shape the load.
+
+cd "$(dirname "$0")" || exit 1
+. ./lib.sh
+
+SIZE=${ET_SIZE:-64}
+DEPTH=${ET_DEPTH:-1}
+CONNS=${ET_CONNS:-10}
+DURATION=${ET_DURATION:-5}
+SERVER=${SERVER:-../examples_01/01_rot13_server_libevent_tuned}
+
+for mode in level edge; do
+	if [ $mode = edge ]; then
+		flags=--et
+	else
+		flags=
+	fi
+	start_server env LD_PRELOAD=./syscount.so "$SERVER" $flags \
+	    >/dev/null 2>et.out
+	before=$(cpu_ticks)
+	./loadgen --proto rot13 --conns "$CONNS" --depth "$DEPTH" \
+	    --size "$SIZE" --duration "$DURATION" --label "$mode"
+	after=$(cpu_ticks)
+	stop_server
+	grep '^{' et.out
+	echo "{\"server_cpu_s\":$(( (after - before) / 100 )).$(( \
+	    (after - before) % 100 / 10 ))$(( (after - before) % 10 ))}"
+	rm -f et.out
+done
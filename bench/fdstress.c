@@ -0,0 +1,189 @@
+/* Pushes an echo server past its file descriptor limit.  We open more
+ * connections than the server has descriptors for, send a line on each,
+ * and wait: each one gets echoed, gets closed by the server, or is still
+ * waiting when we give up.  Then we close them all, and check that the
+ * server takes new connections again.  The report is one line of JSON.
+ *
+ * Run the server with a low limit, as in "ulimit -n 64"; fdstress.sh
+ * does that, and also watches how much CPU the server burns meanwhile. */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PING "ping\n"
+#define PING_LEN 5
+
+enum state { WAITING, ECHOED, CLOSED, FAILED };
+
+struct client {
+	int fd;
+	enum state state;
+	bool sent;
+	size_t got;
+};
+
+static struct sockaddr_in addr;
+
+static long
+now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static int
+open_client(struct client *c)
+{
+	memset(c, 0, sizeof(*c));
+	if ((c->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	fcntl(c->fd, F_SETFL, O_NONBLOCK);
+	if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+	    errno != EINPROGRESS) {
+		close(c->fd);
+		c->fd = -1;
+		c->state = FAILED;
+	}
+	return 0;
+}
+
+/* Moves each client along until it's settled or 'msec' have passed. */
+static void
+run_clients(struct client *clients, int n, long msec)
+{
+	struct pollfd *pfds = calloc(n, sizeof(*pfds));
+	long deadline = now_msec() + msec;
+	int i, left;
+
+	if (!pfds) {
+		perror("calloc");
+		exit(1);
+	}
+	for (;;) {
+		left = 0;
+		for (i = 0; i < n; ++i) {
+			struct client *c = &clients[i];
+			pfds[i].fd = c->state == WAITING ? c->fd : -1;
+			pfds[i].events = c->sent ? POLLIN : POLLOUT;
+			pfds[i].revents = 0;
+			left += c->state == WAITING;
+		}
+		if (!left || now_msec() >= deadline)
+			break;
+		if (poll(pfds, n, deadline - now_msec()) < 0 && errno != EINTR) {
+			perror("poll");
+			exit(1);
+		}
+		for (i = 0; i < n; ++i) {
+			struct client *c = &clients[i];
+			char buf[64];
+			ssize_t r;
+
+			if (!pfds[i].revents)
+				continue;
+			if (!c->sent) {
+				/* Connected, or failed to. */
+				if (send(c->fd, PING, PING_LEN, MSG_NOSIGNAL) != PING_LEN)
+					c->state = FAILED;
+				c->sent = true;
+				continue;
+			}
+			r = recv(c->fd, buf, sizeof(buf), 0);
+			if (r > 0 && (c->got += r) >= PING_LEN)
+				c->state = ECHOED;
+			else if (r == 0 || (r < 0 && errno != EAGAIN))
+				c->state = CLOSED;
+		}
+	}
+	free(pfds);
+}
+
+static void
+count(const struct client *clients, int n, int totals[4])
+{
+	int i;
+
+	memset(totals, 0, 4 * sizeof(int));
+	for (i = 0; i < n; ++i)
+		++totals[clients[i].state];
+}
+
+static void
+close_clients(struct client *clients, int n)
+{
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		if (clients[i].fd >= 0)
+			close(clients[i].fd);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	int port = 9876, n = 200, n_after = 10;
+	double hold = 3;
+	struct client *clients;
+	int first[4], after[4];
+	int i;
+
+	for (i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--port") && i + 1 < argc) {
+			port = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--conns") && i + 1 < argc) {
+			n = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--hold") && i + 1 < argc) {
+			hold = atof(argv[++i]);
+		} else {
+			fprintf(stderr, "Usage: %s [--port PORT] [--conns N] "
+			    "[--hold SECONDS]\n", argv[0]);
+			return 1;
+		}
+	}
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (!(clients = calloc(n > n_after ? n : n_after, sizeof(*clients)))) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (open_client(&clients[i]) < 0) {
+			perror("socket");
+			return 1;
+		}
+	}
+	run_clients(clients, n, hold * 1000);
+	count(clients, n, first);
+	close_clients(clients, n);
+
+	/* Give the server a moment to notice, and to stop backing off. */
+	sleep(2);
+	for (i = 0; i < n_after; ++i)
+		open_client(&clients[i]);
+	run_clients(clients, n_after, 2000);
+	count(clients, n_after, after);
+	close_clients(clients, n_after);
+
+	printf("{\"conns\":%d,\"echoed\":%d,\"closed\":%d,\"waiting\":%d,"
+	    "\"failed\":%d,\"after\":{\"conns\":%d,\"echoed\":%d}}\n",
+	    n, first[ECHOED], first[CLOSED], first[WAITING], first[FAILED],
+	    n_after, after[ECHOED]);
+	free(clients);
+	return after[ECHOED] == n_after ? 0 : 1;
+}
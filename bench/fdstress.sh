@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# Runs R8_echo_server with only FD_LIMIT (64) file descriptors, throws
+# STRESS_CONNS (200) connections at it with fdstress, and prints what
+# fdstress saw, how much CPU the server used while it was out of
+# descriptors, and the server's own counters.  Arguments go to the
+# server, as in "./fdstress.sh --max-conns 40".
+
+cd "$(dirname "$0")" || exit 1
+. ./lib.sh
+
+FD_LIMIT=${FD_LIMIT:-64}
+CONNS=${STRESS_CONNS:-200}
+HOLD=3
+PORT=9879
+
+SERVER_FD_LIMIT=$FD_LIMIT
+start_server ../examples_R8/R8_echo_server $PORT "$@" \
+    >fdstress.out 2>/dev/null
+
+before=$(cpu_ticks)
+./fdstress --port $PORT --conns "$CONNS" --hold $HOLD
+status=$?
+after=$(cpu_ticks)
+echo "{\"server_cpu_percent\":$(( (after - before) * 100 / (100 * (HOLD + 4)) ))}"
+
+kill -USR1 $pid
+sleep 0.5
+stop_server
+cat fdstress.out
+rm -f fdstress.out
+exit $status
@@ -0,0 +1,105 @@
+/* Opens lots of connections to a server and leaves them idle, so that we
+ * can see what an idle connection costs it.  With --ping, each connection
+ * first sends one line and waits for the reply, so that the server has
+ * had to put some data somewhere for every one of them.
+ *
+ * Once they're all open we print one line of JSON, and then hold them
+ * until we're killed; idlemem.sh measures the server meanwhile.  The
+ * kernel gives out only so many local ports for each address, so we spread
+ * the connections across 127.0.0.1, 127.0.0.2, and so on. */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PING "ping\n"
+#define PING_LEN 5
+
+/* Well inside the default range of 28232 local ports. */
+#define CONNS_PER_ADDR 20000
+
+/* The example servers listen with a backlog of only 16, so we pause after
+ * each connection to let the server accept it; otherwise the kernel drops
+ * our SYNs, and each drop costs a second before the retry. */
+#define CONNECT_PAUSE_USEC 50
+
+static int
+open_conn(const struct sockaddr_in *to, int i, bool ping)
+{
+	struct sockaddr_in from;
+	char buf[PING_LEN];
+	size_t got = 0;
+	int fd;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	memset(&from, 0, sizeof(from));
+	from.sin_family = AF_INET;
+	from.sin_addr.s_addr = htonl(INADDR_LOOPBACK + i / CONNS_PER_ADDR);
+	if (bind(fd, (struct sockaddr *)&from, sizeof(from)) < 0 ||
+	    connect(fd, (struct sockaddr *)to, sizeof(*to)) < 0)
+		goto fail;
+	if (!ping) {
+		usleep(CONNECT_PAUSE_USEC);
+		return fd;
+	}
+	if (send(fd, PING, PING_LEN, 0) != PING_LEN)
+		goto fail;
+	while (got < PING_LEN) {
+		ssize_t r = recv(fd, buf + got, PING_LEN - got, 0);
+		if (r <= 0)
+			goto fail;
+		got += r;
+	}
+	return fd;
+fail:
+	close(fd);
+	return -1;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sockaddr_in to;
+	int port = 40713, n = 10000, opened = 0, i;
+	bool ping = false;
+
+	for (i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--port") && i + 1 < argc) {
+			port = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--conns") && i + 1 < argc) {
+			n = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--ping")) {
+			ping = true;
+		} else {
+			fprintf(stderr, "Usage: %s [--port PORT] [--conns N] "
+			    "[--ping]\n", argv[0]);
+			return 1;
+		}
+	}
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_port = htons(port);
+	to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (i = 0; i < n; ++i) {
+		if (open_conn(&to, i, ping) < 0) {
+			fprintf(stderr, "connection %d: %s\n", i, strerror(errno));
+			break;
+		}
+		++opened;
+	}
+	printf("{\"conns\":%d,\"opened\":%d,\"ping\":%s}\n", n, opened,
+	    ping ? "true" : "false");
+	fflush(stdout);
+	/* Our descriptors close when we die. */
+	for (;;)
+		pause();
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Opens IDLE_CONNS (1000, 10000, 100000 and 1000000) idle connections to
+# the tuned low-level rot13 server, first without sending anything and
+# then after one line each, and prints how much memory the server is
+# using for them.  Both this script and the server need a descriptor
+# limit above the number of connections; sizes we can't get that for are
+# skipped.
+
+cd "$(dirname "$0")" || exit 1
+. ./lib.sh
+
+SIZES=${IDLE_CONNS:-"1000 10000 100000 1000000"}
+SERVER=${SERVER:-../examples_01/01_rot13_server_libevent_tuned}
+
+for n in $SIZES; do
+	limit=$((n + 64))
+	if ! (ulimit -n $limit) 2>/dev/null; then
+		echo "{\"conns\":$n,\"skipped\":\"can't raise the descriptor" \
+		    "limit to $limit\"}"
+		continue
+	fi
+	for ping in false true; do
+		if [ $ping = true ]; then
+			flags=--ping
+		else
+			flags=
+		fi
+		SERVER_FD_LIMIT=$limit
+		start_server "$SERVER" >/dev/null 2>&1
+		rss0=$(status_kb VmRSS)
+		data0=$(status_kb VmData)
+
+		(ulimit -n $limit && exec ./idleconns --conns $n $flags) \
+		    >idlemem.out &
+		client=$!
+		while [ ! -s idlemem.out ] && kill -0 $client 2>/dev/null; do
+			sleep 0.2
+		done
+		# The last few connections may not be accepted yet.
+		want=$(sed 's/.*"opened":\([0-9]*\).*/\1/' idlemem.out)
+		tries=0
+		while [ $(ls /proc/$pid/fd | wc -l) -lt $want ] &&
+		    [ $tries -lt 50 ]; do
+			sleep 0.2
+			tries=$((tries + 1))
+		done
+		rss=$(status_kb VmRSS)
+		data=$(status_kb VmData)
+		fds=$(ls /proc/$pid/fd | wc -l)
+
+		echo "{\"conns\":$n,\"ping\":$ping,\"server_fds\":$fds," \
+		    "\"rss_kb\":$((rss - rss0)),\"data_kb\":$((data - data0))," \
+		    "\"rss_bytes_per_conn\":$(( (rss - rss0) * 1024 / want ))," \
+		    "\"client\":$(cat idlemem.out)}" | tr -d ' '
+		kill $client
+		wait $client 2>/dev/null
+		stop_server
+		rm -f idlemem.out
+	done
+done
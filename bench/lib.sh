@@ -0,0 +1,42 @@
+# Helpers for the benchmark scripts, which source this file once they
+# are in the bench directory.  The scripts that start one of the example
+# servers run SERVER if it is set, so that you can measure another build
+# of it.
+
+# Usage: start_server COMMAND [ARGS...]
+# Runs the server in the background, in SERVER_DIR if that is set and
+# with a descriptor limit of SERVER_FD_LIMIT if that is, and leaves its
+# process ID in pid.  Redirections on the call apply to the server.  It
+# gets half a second to start listening.
+start_server() {
+	(
+		if [ -n "$SERVER_DIR" ]; then
+			cd "$SERVER_DIR" || exit 1
+		fi
+		if [ -n "$SERVER_FD_LIMIT" ]; then
+			ulimit -n "$SERVER_FD_LIMIT" || exit 1
+		fi
+		exec "$@"
+	) &
+	pid=$!
+	sleep 0.5
+}
+
+# Usage: stop_server [SIGNAL]
+# Sends the server SIGNAL (TERM) and waits for it to go.
+stop_server() {
+	kill -"${1:-TERM}" $pid 2>/dev/null
+	wait $pid 2>/dev/null
+}
+
+# Prints the CPU time the server has used so far, user and system, in
+# clock ticks (hundredths of a second).
+cpu_ticks() {
+	awk '{ print $14 + $15 }' /proc/$pid/stat
+}
+
+# Usage: status_kb KEY
+# Prints one of the server's memory counters from /proc, such as VmRSS.
+status_kb() {
+	awk -v key="$1:" '$1 == key { print $2 }' /proc/$pid/status
+}
@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Sends short lines to the tuned bufferevent rot13 server as fast as it
+# will take them, with LINES_DEPTH (64) lines in flight on each of
+# LINES_CONNS (4) connections, and prints what loadgen saw, along with how
+# many lines the server handled for each second of CPU it used.
+# LINES_SIZES lists the line lengths to try, newline included.
+
+cd "$(dirname "$0")" || exit 1
+. ./lib.sh
+
+SIZES=${LINES_SIZES:-"8 16 64"}
+DEPTH=${LINES_DEPTH:-64}
+CONNS=${LINES_CONNS:-4}
+DURATION=${LINES_DURATION:-5}
+SERVER=${SERVER:-../examples_01/01_rot13_server_bufferevent_tuned}
+
+for size in $SIZES; do
+	start_server "$SERVER" >/dev/null 2>&1
+	before=$(cpu_ticks)
+	./loadgen --proto rot13 --conns "$CONNS" --depth "$DEPTH" \
+	    --size "$size" --warmup 0 --duration "$DURATION" \
+	    --label "lines-$size" >lines.out
+	after=$(cpu_ticks)
+	stop_server
+	requests=$(sed 's/.*"requests":\([0-9]*\).*/\1/' lines.out)
+	cat lines.out
+	awk -v size=$size -v r=$requests -v t=$((after - before)) 'BEGIN {
+		printf "{\"size\":%d,\"server_cpu_s\":%.2f,", size, t / 100
+		printf "\"lines_per_cpu_s\":%.0f}\n", t ? r * 100 / t : 0
+	}'
+	rm -f lines.out
+done
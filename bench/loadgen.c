@@ -0,0 +1,684 @@
+/* A load generator for the example servers.  It speaks keep-alive
+ * HTTP/1.1 to R10_static_server, the raw echo protocol of R8_echo_server
+ * (--proto echo), or the rot13 protocol of the chapter 1 servers (--proto
+ * rot13: a line in, the same line rot13'd out), over as many connections
+ * as you like, and prints what it saw as one line of JSON.
+ *
+ * With HTTP, every request is the same: --method (GET, or PUT
+ * when there's a body) on --path, with any --header lines, and a body of
+ * --size bytes.  A reply counts as good if its status is 2xx, or exactly
+ * --status when that's given.  mbit_per_s then counts request and reply
+ * bodies, not the headers.
+ *
+ * In closed-loop mode (the default), each connection keeps 'depth'
+ * requests in flight, and sends a new one whenever a reply comes back.
+ * In open-loop mode (--rate), requests go out on a fixed schedule however
+ * the server is keeping up, and each one's latency counts from when it
+ * was supposed to go out, so that a server can't hide its stalls by
+ * slowing us down too.
+ *
+ * With --churn, every connection closes after one reply, and a new one
+ * takes its place, so that each request also pays for a connect(); with
+ * --requests N, the run stops after N replies rather than after a fixed
+ * time. */
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* The rot13 servers give up on lines longer than this. */
+#define ROT13_MAX_LINE 16384
+
+/* The latency histogram, after HdrHistogram: values below 2^HIST_SUB_BITS
+ * nanoseconds get a bucket each, and every power of two above that is
+ * split into 2^(HIST_SUB_BITS-1) buckets, so any value is off by less than
+ * 1/64 of itself, and 64-bit values fit in a few thousand counters. */
+#define HIST_SUB_BITS 7
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_SIZE ((64 - HIST_SUB_BITS + 2) * HIST_HALF)
+
+struct histogram {
+	uint64_t counts[HIST_SIZE];
+	uint64_t n;
+	uint64_t min, max;
+	double sum;
+};
+
+enum protocol { PROTO_HTTP, PROTO_ECHO, PROTO_ROT13 };
+
+/* How many --header options we take, and how long an HTTP reply's head
+ * can be. */
+#define HTTP_MAX_HEADERS 8
+#define HTTP_MAX_HEAD 8192
+
+struct conn {
+	struct bufferevent *bev;
+	/* When each request in flight went out (or was meant to), oldest
+	 * first; the server answers in order. */
+	uint64_t *queue;
+	size_t queue_cap, queue_head, queue_len;
+	size_t partial; /* bytes of the current echo reply we have so far */
+	/* HTTP: the body of the current reply we have yet to see, or -1
+	 * while we're waiting for its head; and its status and length. */
+	int64_t body_left;
+	int status;
+	size_t body_len;
+	uint64_t connect_start;
+};
+
+static struct {
+	enum protocol proto;
+	const char *host;
+	int port;
+	int n_conns;
+	size_t size;
+	int depth;
+	double rate; /* requests per second; 0 for closed-loop */
+	double warmup, duration;
+	const char *label; /* copied into the report, to tell runs apart */
+	bool churn;
+	uint64_t requests; /* stop after this many; 0 to go by time */
+	const char *method, *path; /* HTTP only, like the rest */
+	const char *headers[HTTP_MAX_HEADERS];
+	int n_headers;
+	int status; /* the one we want; 0 for any 2xx */
+} opts = {PROTO_HTTP, "127.0.0.1", 0, 10, SIZE_MAX, 1, 0, 1, 10, NULL,
+	false, 0, NULL, "/", {NULL}, 0, 0};
+
+static struct {
+	struct event_base *base;
+	struct sockaddr_in addr;
+	struct conn *conns;
+	int n_connected;
+	bool started;
+	char *request; /* what we send */
+	size_t request_len;
+	char *body;    /* HTTP: what follows the request's head */
+	char *reply;   /* what we expect back */
+	char *scratch;
+	uint64_t measure_start, measure_end;
+	uint64_t next_send; /* open-loop only */
+	int next_conn;
+	struct event *tick;
+	struct histogram hist;
+	uint64_t completed;
+	uint64_t errors;
+	uint64_t bytes; /* request and reply payload, while measuring */
+	double elapsed; /* seconds measured */
+} run;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+hist_index(uint64_t v)
+{
+	int shift;
+
+	if (v < 2 * HIST_HALF)
+		return v;
+	/* Keep the top HIST_SUB_BITS-1 bits below the leading one. */
+	shift = 63 - __builtin_clzll(v) - (HIST_SUB_BITS - 1);
+	return (shift << (HIST_SUB_BITS - 1)) + (v >> shift);
+}
+
+/* The highest value that lands in bucket 'i'. */
+static uint64_t
+hist_value(int i)
+{
+	int shift;
+
+	if (i < 2 * HIST_HALF)
+		return i;
+	shift = (i >> (HIST_SUB_BITS - 1)) - 1;
+	return (((uint64_t)(i & (HIST_HALF - 1)) + HIST_HALF + 1) << shift) - 1;
+}
+
+static void
+hist_record(struct histogram *h, uint64_t v)
+{
+	++h->counts[hist_index(v)];
+	if (h->n == 0 || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	++h->n;
+	h->sum += v;
+}
+
+static uint64_t
+hist_percentile(const struct histogram *h, double p)
+{
+	uint64_t want = (uint64_t)(p / 100 * h->n + 0.5), seen = 0;
+	int i;
+
+	if (want == 0)
+		want = 1;
+	for (i = 0; i < HIST_SIZE; ++i) {
+		seen += h->counts[i];
+		if (seen >= want)
+			return hist_value(i) < h->max ? hist_value(i) : h->max;
+	}
+	return h->max;
+}
+
+static void
+queue_push(struct conn *c, uint64_t when)
+{
+	if (c->queue_len == c->queue_cap) {
+		size_t cap = c->queue_cap ? c->queue_cap * 2 : 16, i;
+		uint64_t *q = malloc(cap * sizeof(*q));
+		if (!q) {
+			perror("malloc");
+			exit(1);
+		}
+		for (i = 0; i < c->queue_len; ++i)
+			q[i] = c->queue[(c->queue_head + i) % c->queue_cap];
+		free(c->queue);
+		c->queue = q;
+		c->queue_cap = cap;
+		c->queue_head = 0;
+	}
+	c->queue[(c->queue_head + c->queue_len++) % c->queue_cap] = when;
+}
+
+static void read_cb(struct bufferevent *bev, void *ctx);
+static void event_cb(struct bufferevent *bev, short events, void *ctx);
+
+/* Opens a new connection for 'c', closing the old one if there was one. */
+static void
+connect_conn(struct conn *c)
+{
+	if (c->bev)
+		bufferevent_free(c->bev);
+	c->partial = 0;
+	c->body_left = -1;
+	c->connect_start = now_ns();
+	c->bev = bufferevent_socket_new(run.base, -1, BEV_OPT_CLOSE_ON_FREE);
+	if (!c->bev) {
+		fprintf(stderr, "Couldn't make a bufferevent\n");
+		exit(1);
+	}
+	bufferevent_setcb(c->bev, read_cb, NULL, event_cb, c);
+	bufferevent_enable(c->bev, EV_READ|EV_WRITE);
+	if (bufferevent_socket_connect(c->bev,
+		(struct sockaddr *)&run.addr, sizeof(run.addr)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+}
+
+static void
+send_request(struct conn *c, uint64_t when)
+{
+	struct evbuffer *output = bufferevent_get_output(c->bev);
+
+	evbuffer_add(output, run.request, run.request_len);
+	/* Every request sends the same body, so they can all share it. */
+	if (run.body && opts.size)
+		evbuffer_add_reference(output, run.body, opts.size, NULL, NULL);
+	queue_push(c, when);
+}
+
+static void
+reply_done(struct conn *c, uint64_t now, bool ok, size_t bytes)
+{
+	uint64_t sent;
+
+	if (c->queue_len == 0) {
+		/* A reply to nothing we asked. */
+		++run.errors;
+		return;
+	}
+	sent = c->queue[c->queue_head];
+	c->queue_head = (c->queue_head + 1) % c->queue_cap;
+	--c->queue_len;
+
+	if (!ok)
+		++run.errors;
+	if (now >= run.measure_start && now < run.measure_end) {
+		hist_record(&run.hist, now > sent ? now - sent : 0);
+		run.bytes += bytes;
+		if (++run.completed == opts.requests) {
+			run.measure_end = now;
+			event_base_loopbreak(run.base);
+		}
+	}
+	if (opts.rate > 0 || now >= run.measure_end)
+		return;
+	if (!opts.churn)
+		send_request(c, now);
+	else if (c->queue_len == 0)
+		connect_conn(c);
+}
+
+/* Reads the status and Content-Length out of the reply head in 'head'.
+ * Returns -1 if it isn't one. */
+static int
+http_parse_head(struct conn *c, char *head)
+{
+	char *line, *next;
+
+	if (strncmp(head, "HTTP/1.", 7) || !(line = strchr(head, ' ')))
+		return -1;
+	c->status = atoi(line + 1);
+	/* 204 and 304 replies have no body; the others all say how long
+	 * theirs is. */
+	c->body_len = 0;
+	for (line = strstr(head, "\r\n"); line; line = next) {
+		line += 2;
+		next = strstr(line, "\r\n");
+		if (!evutil_ascii_strncasecmp(line, "Content-Length:", 15))
+			c->body_len = strtoull(line + 15, NULL, 10);
+	}
+	return 0;
+}
+
+static void
+http_read(struct conn *c, struct evbuffer *input, uint64_t now)
+{
+	struct bufferevent *bev = c->bev;
+	char head[HTTP_MAX_HEAD + 1];
+
+	for (;;) {
+		size_t n;
+
+		if (c->body_left < 0) {
+			struct evbuffer_ptr end =
+			    evbuffer_search(input, "\r\n\r\n", 4, NULL);
+			if (end.pos < 0 || end.pos + 4 > HTTP_MAX_HEAD) {
+				if (evbuffer_get_length(input) <= HTTP_MAX_HEAD)
+					return;
+				fprintf(stderr, "reply head too long\n");
+				exit(1);
+			}
+			evbuffer_remove(input, head, end.pos + 4);
+			head[end.pos + 4] = '\0';
+			if (http_parse_head(c, head) < 0) {
+				fprintf(stderr, "not an HTTP reply\n");
+				exit(1);
+			}
+			c->body_left = c->body_len;
+		}
+		n = evbuffer_get_length(input);
+		if ((uint64_t)c->body_left < n)
+			n = c->body_left;
+		evbuffer_drain(input, n);
+		c->body_left -= n;
+		if (c->body_left > 0)
+			return;
+		c->body_left = -1;
+		reply_done(c, now, opts.status ? c->status == opts.status :
+		    c->status >= 200 && c->status < 300, opts.size + c->body_len);
+		if (c->bev != bev)
+			return;
+	}
+}
+
+static void
+read_cb(struct bufferevent *bev, void *ctx)
+{
+	struct conn *c = ctx;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	uint64_t now = now_ns();
+
+	if (opts.proto == PROTO_ECHO) {
+		/* The reply is just our bytes back, so count them. */
+		size_t len = evbuffer_get_length(input);
+		evbuffer_drain(input, len);
+		c->partial += len;
+		while (c->partial >= opts.size) {
+			c->partial -= opts.size;
+			reply_done(c, now, true, opts.size);
+			if (c->bev != bev)
+				return; /* --churn gave us a new connection */
+		}
+		return;
+	}
+	if (opts.proto == PROTO_HTTP) {
+		http_read(c, input, now);
+		return;
+	}
+
+	for (;;) {
+		struct evbuffer_ptr eol;
+		size_t eol_len;
+		bool ok;
+
+		eol = evbuffer_search_eol(input, NULL, &eol_len, EVBUFFER_EOL_LF);
+		if (eol.pos < 0)
+			break;
+		ok = (size_t)eol.pos + 1 == opts.size;
+		if (ok) {
+			evbuffer_remove(input, run.scratch, opts.size);
+			ok = !memcmp(run.scratch, run.reply, opts.size);
+		} else {
+			evbuffer_drain(input, eol.pos + 1);
+		}
+		reply_done(c, now, ok, opts.size);
+		if (c->bev != bev)
+			return;
+	}
+}
+
+static void
+tick_cb(evutil_socket_t fd, short what, void *arg)
+{
+	uint64_t now = now_ns(), step = 1e9 / opts.rate, wait;
+	struct timeval tv;
+
+	if (now >= run.measure_end) {
+		event_base_loopbreak(run.base);
+		return;
+	}
+	/* Whatever came due since the last tick, even if we're late. */
+	while (run.next_send <= now) {
+		struct conn *c = &run.conns[run.next_conn];
+		run.next_conn = (run.next_conn + 1) % opts.n_conns;
+		send_request(c, run.next_send);
+		run.next_send += step;
+	}
+	wait = (run.next_send - now) / 1000;
+	tv.tv_sec = wait / 1000000;
+	tv.tv_usec = wait % 1000000;
+	event_add(run.tick, &tv);
+}
+
+static void
+start(void)
+{
+	uint64_t now = now_ns();
+	int i, j;
+
+	run.started = true;
+	run.measure_start = now + opts.warmup * 1e9;
+	run.measure_end = run.measure_start + opts.duration * 1e9;
+	if (opts.requests) {
+		/* Until we've seen them all. */
+		run.measure_end = UINT64_MAX;
+		for (i = 0; i < opts.n_conns; ++i) {
+			for (j = 0; j < opts.depth; ++j)
+				send_request(&run.conns[i], now);
+		}
+	} else if (opts.rate > 0) {
+		run.next_send = now;
+		run.tick = evtimer_new(run.base, tick_cb, NULL);
+		tick_cb(-1, 0, NULL);
+	} else {
+		struct timeval end = {opts.warmup + opts.duration, 0};
+		end.tv_usec = (opts.warmup + opts.duration - end.tv_sec) * 1e6;
+		event_base_loopexit(run.base, &end);
+		for (i = 0; i < opts.n_conns; ++i) {
+			for (j = 0; j < opts.depth; ++j)
+				send_request(&run.conns[i], now);
+		}
+	}
+}
+
+static void
+event_cb(struct bufferevent *bev, short events, void *ctx)
+{
+	if (events & BEV_EVENT_CONNECTED) {
+		int one = 1;
+		setsockopt(bufferevent_getfd(bev), IPPROTO_TCP, TCP_NODELAY,
+		    &one, sizeof(one));
+		if (run.started) {
+			/* A new connection for --churn. */
+			struct conn *c = ctx;
+			int i;
+			for (i = 0; i < opts.depth; ++i)
+				send_request(c, c->connect_start);
+		} else if (++run.n_connected == opts.n_conns) {
+			/* Don't start the clock until everybody's here. */
+			start();
+		}
+		return;
+	}
+	if (events & BEV_EVENT_ERROR)
+		fprintf(stderr, "connection failed: %s\n",
+		    evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+	else
+		fprintf(stderr, "server closed the connection\n");
+	exit(1);
+}
+
+static void
+print_report(void)
+{
+	const struct histogram *h = &run.hist;
+	double us = 1e-3;
+
+	printf("{");
+	if (opts.label)
+		printf("\"label\":\"%s\",", opts.label);
+	printf("\"protocol\":\"%s\",\"host\":\"%s\",\"port\":%d,"
+	    "\"mode\":\"%s\",\"connections\":%d,\"size\":%zu,\"depth\":%d,",
+	    opts.proto == PROTO_ECHO ? "echo" :
+	    opts.proto == PROTO_HTTP ? "http" : "rot13", opts.host, opts.port,
+	    opts.rate > 0 ? "open" : opts.churn ? "churn" : "closed",
+	    opts.n_conns, opts.size,
+	    opts.rate > 0 ? 0 : opts.depth);
+	if (opts.rate > 0)
+		printf("\"rate\":%.0f,", opts.rate);
+	else
+		printf("\"rate\":null,");
+	printf("\"warmup_s\":%g,\"duration_s\":%g,\"requests\":%llu,"
+	    "\"errors\":%llu,\"requests_per_s\":%.1f,\"mbit_per_s\":%.2f,",
+	    opts.warmup, run.elapsed, (unsigned long long)run.completed,
+	    (unsigned long long)run.errors, run.completed / run.elapsed,
+	    run.bytes * 8 / run.elapsed / 1e6);
+	printf("\"latency_us\":{\"min\":%.1f,\"mean\":%.1f,\"p50\":%.1f,"
+	    "\"p90\":%.1f,\"p99\":%.1f,\"p99_9\":%.1f,\"max\":%.1f}}\n",
+	    h->min * us, h->n ? h->sum / h->n * us : 0,
+	    hist_percentile(h, 50) * us, hist_percentile(h, 90) * us,
+	    hist_percentile(h, 99) * us, hist_percentile(h, 99.9) * us,
+	    h->max * us);
+}
+
+/* Builds the head of our HTTP request, and the body that follows it. */
+static int
+make_http_request(void)
+{
+	struct evbuffer *head = evbuffer_new();
+	size_t i;
+	int n;
+
+	if (!head)
+		return -1;
+	if (!opts.method)
+		opts.method = opts.size ? "PUT" : "GET";
+	evbuffer_add_printf(head, "%s %s HTTP/1.1\r\nHost: %s\r\n",
+	    opts.method, opts.path, opts.host);
+	for (n = 0; n < opts.n_headers; ++n)
+		evbuffer_add_printf(head, "%s\r\n", opts.headers[n]);
+	if (opts.size || !strcmp(opts.method, "PUT") ||
+	    !strcmp(opts.method, "POST"))
+		evbuffer_add_printf(head, "Content-Length: %zu\r\n", opts.size);
+	evbuffer_add(head, "\r\n", 2);
+
+	run.request_len = evbuffer_get_length(head);
+	run.request = malloc(run.request_len);
+	if (run.request)
+		evbuffer_remove(head, run.request, run.request_len);
+	evbuffer_free(head);
+	if (opts.size && (run.body = malloc(opts.size))) {
+		for (i = 0; i < opts.size; ++i)
+			run.body[i] = 'a' + i % 26;
+	}
+	return run.request && (run.body || !opts.size) ? 0 : -1;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	    "Usage: %s [--proto http|echo|rot13] [--host ADDR] [--port PORT]\n"
+	    "       [--conns N] [--size BYTES] [--depth N] [--rate REQ/S]\n"
+	    "       [--warmup SECONDS] [--duration SECONDS] [--label NAME]\n"
+	    "       [--churn] [--requests N] [--method METHOD] [--path PATH]\n"
+	    "       [--header 'NAME: VALUE']... [--status CODE]\n",
+	    prog);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct event_config *cfg;
+	size_t i;
+	int n;
+
+	for (n = 1; n < argc; ++n) {
+		if (!strcmp(argv[n], "--proto") && n + 1 < argc) {
+			++n;
+			if (!strcmp(argv[n], "rot13"))
+				opts.proto = PROTO_ROT13;
+			else if (!strcmp(argv[n], "echo"))
+				opts.proto = PROTO_ECHO;
+			else if (!strcmp(argv[n], "http"))
+				opts.proto = PROTO_HTTP;
+			else
+				usage(argv[0]);
+		} else if (!strcmp(argv[n], "--host") && n + 1 < argc) {
+			opts.host = argv[++n];
+		} else if (!strcmp(argv[n], "--port") && n + 1 < argc) {
+			opts.port = atoi(argv[++n]);
+		} else if (!strcmp(argv[n], "--conns") && n + 1 < argc) {
+			opts.n_conns = atoi(argv[++n]);
+		} else if (!strcmp(argv[n], "--size") && n + 1 < argc) {
+			opts.size = strtoul(argv[++n], NULL, 10);
+		} else if (!strcmp(argv[n], "--depth") && n + 1 < argc) {
+			opts.depth = atoi(argv[++n]);
+		} else if (!strcmp(argv[n], "--rate") && n + 1 < argc) {
+			opts.rate = atof(argv[++n]);
+		} else if (!strcmp(argv[n], "--warmup") && n + 1 < argc) {
+			opts.warmup = atof(argv[++n]);
+		} else if (!strcmp(argv[n], "--duration") && n + 1 < argc) {
+			opts.duration = atof(argv[++n]);
+		} else if (!strcmp(argv[n], "--label") && n + 1 < argc) {
+			opts.label = argv[++n];
+		} else if (!strcmp(argv[n], "--churn")) {
+			opts.churn = true;
+		} else if (!strcmp(argv[n], "--requests") && n + 1 < argc) {
+			opts.requests = strtoull(argv[++n], NULL, 10);
+		} else if (!strcmp(argv[n], "--method") && n + 1 < argc) {
+			opts.method = argv[++n];
+		} else if (!strcmp(argv[n], "--path") && n + 1 < argc) {
+			opts.path = argv[++n];
+		} else if (!strcmp(argv[n], "--header") && n + 1 < argc &&
+		    opts.n_headers < HTTP_MAX_HEADERS) {
+			opts.headers[opts.n_headers++] = argv[++n];
+		} else if (!strcmp(argv[n], "--status") && n + 1 < argc) {
+			opts.status = atoi(argv[++n]);
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (!opts.port)
+		opts.port = opts.proto == PROTO_ECHO ? 9876 :
+		    opts.proto == PROTO_HTTP ? 8080 : 40713;
+	/* HTTP requests have no body unless we ask for one. */
+	if (opts.size == SIZE_MAX)
+		opts.size = opts.proto == PROTO_HTTP ? 0 : 64;
+	if (opts.n_conns < 1 || opts.depth < 1 ||
+	    (opts.size < 1 && opts.proto != PROTO_HTTP) ||
+	    opts.rate < 0 || opts.warmup < 0 || opts.duration <= 0 ||
+	    (opts.churn && opts.rate > 0))
+		usage(argv[0]);
+	if (opts.proto == PROTO_ROT13 &&
+	    (opts.size < 2 || opts.size > ROT13_MAX_LINE)) {
+		fprintf(stderr, "rot13 requests must be 2 to %d bytes long\n",
+		    ROT13_MAX_LINE);
+		return 1;
+	}
+
+	run.conns = calloc(opts.n_conns, sizeof(*run.conns));
+	if (!run.conns) {
+		perror("malloc");
+		return 1;
+	}
+	if (opts.proto == PROTO_HTTP) {
+		if (make_http_request() < 0) {
+			perror("malloc");
+			return 1;
+		}
+	} else {
+		/* Letters, so that rot13 changes every byte but the newline. */
+		run.request = malloc(opts.size);
+		run.request_len = opts.size;
+		run.reply = malloc(opts.size);
+		run.scratch = malloc(opts.size);
+		if (!run.request || !run.reply || !run.scratch) {
+			perror("malloc");
+			return 1;
+		}
+		for (i = 0; i < opts.size; ++i) {
+			run.request[i] = 'a' + i % 26;
+			run.reply[i] = 'a' + (i + 13) % 26;
+		}
+		if (opts.proto == PROTO_ROT13)
+			run.request[opts.size - 1] = run.reply[opts.size - 1] = '\n';
+	}
+
+	run.addr.sin_family = AF_INET;
+	run.addr.sin_port = htons(opts.port);
+	if (inet_pton(AF_INET, opts.host, &run.addr.sin_addr) != 1) {
+		fprintf(stderr, "%s is not an IPv4 address\n", opts.host);
+		return 1;
+	}
+
+	/* The open-loop schedule needs timers finer than a millisecond. */
+	if (!(cfg = event_config_new())) {
+		fprintf(stderr, "Couldn't make an event config\n");
+		return 1;
+	}
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_PRECISE_TIMER);
+	run.base = event_base_new_with_config(cfg);
+	event_config_free(cfg);
+	if (!run.base) {
+		fprintf(stderr, "Couldn't open event base\n");
+		return 1;
+	}
+	for (n = 0; n < opts.n_conns; ++n)
+		connect_conn(&run.conns[n]);
+
+	event_base_dispatch(run.base);
+	if (opts.requests)
+		run.elapsed = (run.measure_end - run.measure_start) / 1e9;
+	else
+		run.elapsed = opts.duration;
+	print_report();
+
+	for (n = 0; n < opts.n_conns; ++n) {
+		bufferevent_free(run.conns[n].bev);
+		free(run.conns[n].queue);
+	}
+	if (run.tick)
+		event_free(run.tick);
+	event_base_free(run.base);
+	free(run.conns);
+	free(run.request);
+	free(run.body);
+	free(run.reply);
+	free(run.scratch);
+	return 0;
+}
@@ -0,0 +1,181 @@
+/* Times R10_static_server's content type lookup: the perfect hash that
+ * guess_content_type() uses, against searching a table from the top as
+ * it used to.  The linear search gets the same types as the hash (those
+ * in /etc/mime.types, or the file named on the command line, plus the
+ * built-in ones), and then just the dozen built-in ones it used to have.
+ *
+ * First, the hash has to give the same answer as the linear search for
+ * every extension, in lower and upper case.  Then we look up a mix of
+ * paths, common extensions and missing ones, and print one line of JSON
+ * for each way of doing it.
+ *
+ * The hash is R10_mime.c, which the server uses too; the linear search is
+ * guess_content_type() as it was before that. */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <event2/util.h>
+
+#include "../examples_R10/R10_mime.h"
+
+static const char *paths[] = {
+	"/index.html", "/css/site.css", "/js/app.js", "/img/logo.png",
+	"/img/photo.JPG", "/docs/manual.pdf", "/src/main.c", "/feed.xml",
+	"/fonts/body.woff2", "/data/archive.tar.gz", "/README",
+	"/notes.unknown", "/video/intro.mp4", "/favicon.ico",
+};
+#define N_PATHS (sizeof(paths) / sizeof(paths[0]))
+
+static struct mime_type *linear_table;
+static unsigned n_linear;
+
+/* Somewhere to put the answers, so that the compiler can't skip the
+ * lookups. */
+static volatile size_t sink;
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* guess_content_type() as it is, with the perfect hash. */
+static const char *
+hash_content_type(const char *path)
+{
+	const char *last_period, *type;
+
+	last_period = strrchr(path, '.');
+	if (!last_period || strchr(last_period, '/'))
+		return "application/stream";
+	type = mime_types_lookup(last_period + 1);
+	return type ? type : "application/stream";
+}
+
+/* guess_content_type() as it was, searching 'table' from the top. */
+static const char *
+linear_content_type(const struct mime_type *table, const char *path)
+{
+	const char *last_period, *extension;
+	const struct mime_type *ent;
+
+	last_period = strrchr(path, '.');
+	if (!last_period || strchr(last_period, '/'))
+		return "application/stream";
+	extension = last_period + 1;
+	for (ent = table; ent->extension; ++ent) {
+		if (!evutil_ascii_strcasecmp(ent->extension, extension))
+			return ent->content_type;
+	}
+	return "application/stream";
+}
+
+static const char *
+full_linear(const char *path)
+{
+	return linear_content_type(linear_table, path);
+}
+
+static const char *
+builtin_linear(const char *path)
+{
+	return linear_content_type(mime_types_builtin, path);
+}
+
+static void
+count_type(const struct mime_type *type, void *arg)
+{
+	++n_linear;
+}
+
+static void
+copy_type(const struct mime_type *type, void *arg)
+{
+	linear_table[n_linear++] = *type;
+}
+
+/* Returns the number of extensions the two disagree about. */
+static int
+check(void)
+{
+	const struct mime_type *ent;
+	char path[64];
+	int bad = 0;
+	size_t i;
+
+	for (ent = linear_table; ent->extension; ++ent) {
+		snprintf(path, sizeof(path), "/x.%s", ent->extension);
+		if (strcmp(hash_content_type(path), full_linear(path)))
+			++bad;
+		for (i = 3; path[i]; ++i)
+			path[i] = toupper((unsigned char)path[i]);
+		if (strcmp(hash_content_type(path), full_linear(path)))
+			++bad;
+	}
+	for (i = 0; i < N_PATHS; ++i) {
+		if (strcmp(hash_content_type(paths[i]), full_linear(paths[i])))
+			++bad;
+	}
+	return bad;
+}
+
+static void
+bench(const char *name, const char *(*lookup)(const char *), unsigned n_types,
+	double seconds)
+{
+	unsigned long long n = 0;
+	double start, elapsed;
+	size_t sum = 0, i;
+
+	start = now_sec();
+	do {
+		for (i = 0; i < 100000; ++i)
+			sum += strlen(lookup(paths[i % N_PATHS]));
+		n += 100000;
+		elapsed = now_sec() - start;
+	} while (elapsed < seconds);
+	sink += sum;
+	printf("{\"impl\":\"%s\",\"types\":%u,\"ns_per_lookup\":%.1f}\n",
+		name, n_types, elapsed * 1e9 / n);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *filename = argc > 1 ? argv[1] : "/etc/mime.types";
+	double seconds = argc > 2 ? atof(argv[2]) : 0.5;
+	unsigned n_builtin;
+	int bad;
+
+	if (mime_types_init(filename) < 0) {
+		fprintf(stderr, "Couldn't build the content type table\n");
+		return 1;
+	}
+	/* The linear search gets everything that is in the hash. */
+	mime_types_foreach(count_type, NULL);
+	if (!(linear_table = calloc(n_linear + 1, sizeof(*linear_table)))) {
+		perror("calloc");
+		return 1;
+	}
+	n_linear = 0;
+	mime_types_foreach(copy_type, NULL);
+	for (n_builtin = 0; mime_types_builtin[n_builtin].extension; ++n_builtin)
+		;
+
+	if ((bad = check())) {
+		fprintf(stderr, "perfect hash: %d mismatches\n", bad);
+		return 1;
+	}
+	bench("perfect_hash", hash_content_type, n_linear, seconds);
+	bench("linear", full_linear, n_linear, seconds);
+	bench("linear_builtin", builtin_linear, n_builtin, seconds);
+	free(linear_table);
+	return 0;
+}
@@ -0,0 +1,64 @@
+#!/bin/sh
+#
+# Asks R10_static_server for one file over and over, first whole and then
+# in pieces with Range headers: one range at the start, one in the
+# middle, a suffix range, and 4 and 16 ranges at once, which come back as
+# multipart/byteranges.  For each, it prints what loadgen saw and how much
+# CPU time the server used.  RANGE_FILE_SIZE (16 MB) is the size of the
+# file, RANGE_BYTES (4096) the size of each range, and RANGE_CONNS (4),
+# RANGE_DEPTH (1) and RANGE_DURATION (5) shape the load.
+
+cd "$(dirname "$0")" || exit 1
+. ./lib.sh
+
+FILE_SIZE=${RANGE_FILE_SIZE:-16777216}
+BYTES=${RANGE_BYTES:-4096}
+CONNS=${RANGE_CONNS:-4}
+DEPTH=${RANGE_DEPTH:-1}
+DURATION=${RANGE_DURATION:-5}
+SERVER=${SERVER:-$PWD/../examples_R10/R10_static_server}
+
+docroot=$(mktemp -d) || exit 1
+trap 'rm -rf "$docroot"' EXIT
+head -c "$FILE_SIZE" /dev/urandom >"$docroot/file.bin"
+SERVER_DIR=$docroot
+
+# Usage: ranges N; prints a Range header asking for N ranges of BYTES
+# each, spread evenly across the file.
+ranges() {
+	awk -v n=$1 -v len=$BYTES -v size=$FILE_SIZE 'BEGIN {
+		printf "Range: bytes="
+		for (i = 0; i < n; ++i) {
+			first = int(size / n) * i
+			printf "%s%d-%d", i ? "," : "", first, first + len - 1
+		}
+		printf "\n"
+	}'
+}
+
+# Usage: run LABEL STATUS [RANGE HEADER]
+run() {
+	label=$1
+	status=$2
+	shift 2
+	start_server "$SERVER" >/dev/null 2>&1
+	before=$(cpu_ticks)
+	if [ $# -gt 0 ]; then
+		set -- --header "$1"
+	fi
+	./loadgen --path /file.bin --status "$status" "$@" \
+	    --conns "$CONNS" --depth "$DEPTH" --warmup 0 \
+	    --duration "$DURATION" --label "$label"
+	after=$(cpu_ticks)
+	stop_server INT
+	echo "{\"label\":\"$label\",\"server_cpu_s\":$(( \
+	    (after - before) / 100 )).$(( (after - before) % 100 / 10 ))$(( \
+	    (after - before) % 10 ))}"
+}
+
+run whole 200
+run first 206 "Range: bytes=0-$((BYTES - 1))"
+run middle 206 "Range: bytes=$((FILE_SIZE / 2))-$((FILE_SIZE / 2 + BYTES - 1))"
+run suffix 206 "Range: bytes=-$BYTES"
+run multi-4 206 "$(ranges 4)"
+run multi-16 206 "$(ranges 16)"
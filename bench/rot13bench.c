@@ -0,0 +1,121 @@
+/* Checks and times each version of rot13_block() from examples_01.
+ *
+ * First, every version this CPU can run has to give the same bytes as
+ * rot13_char() for every byte value, at every length up to a few vectors
+ * and at every alignment, both into another buffer and in place, without
+ * touching anything past the end.  Then we time each version on a few
+ * buffer sizes, and print one line of JSON for each. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../examples_01/01_rot13.h"
+
+static const char *names[] = { "avx2", "sse2", "scalar" };
+#define N_NAMES (sizeof(names) / sizeof(names[0]))
+
+#define MAX_LEN 200
+#define MAX_ALIGN 32
+#define CANARY 0x5a
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns the number of mismatches. */
+static int
+check(const char *name)
+{
+	static char src[MAX_ALIGN + MAX_LEN], dst[MAX_ALIGN + MAX_LEN + 1];
+	char want[MAX_LEN];
+	size_t len, align, i;
+	int start, bad = 0;
+
+	for (start = 0; start < 256; ++start) {
+		/* Every byte value turns up at every position of a vector
+		 * for some value of 'start'. */
+		for (i = 0; i < sizeof(src); ++i)
+			src[i] = (char)(start + i);
+		for (len = 0; len <= MAX_LEN; ++len) {
+			for (align = 0; align < MAX_ALIGN; ++align) {
+				const char *in = src + align;
+				for (i = 0; i < len; ++i)
+					want[i] = rot13_char(in[i]);
+
+				memset(dst, CANARY, sizeof(dst));
+				rot13_block(dst + align, in, len);
+				if (memcmp(dst + align, want, len) ||
+				    dst[align + len] != CANARY)
+					++bad;
+
+				memcpy(dst + align, in, len);
+				rot13_block(dst + align, dst + align, len);
+				if (memcmp(dst + align, want, len))
+					++bad;
+			}
+		}
+	}
+	if (bad)
+		fprintf(stderr, "%s: %d mismatches\n", name, bad);
+	return bad;
+}
+
+static void
+bench(const char *name, size_t size, double seconds)
+{
+	char *buf = malloc(size);
+	unsigned long long bytes = 0;
+	double start, elapsed;
+	size_t i;
+
+	if (!buf) {
+		perror("malloc");
+		exit(1);
+	}
+	/* Mostly letters, as a line of text would be. */
+	for (i = 0; i < size; ++i)
+		buf[i] = " etaoinshrdlucmfwypvbgkjqxzETAOIN.,\n"[i % 36];
+	start = now_sec();
+	do {
+		for (i = 0; i < 1000; ++i)
+			rot13_block(buf, buf, size);
+		bytes += 1000ULL * size;
+		elapsed = now_sec() - start;
+	} while (elapsed < seconds);
+	printf("{\"impl\":\"%s\",\"size\":%zu,\"mbyte_per_s\":%.0f}\n",
+	    name, size, bytes / elapsed / 1e6);
+	free(buf);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const size_t sizes[] = { 16, 64, 1024, 16384 };
+	double seconds = 0.5;
+	size_t n, s;
+	int failed = 0;
+
+	if (argc > 1)
+		seconds = atof(argv[1]);
+	printf("{\"default\":\"%s\"}\n", rot13_block_impl());
+	for (n = 0; n < N_NAMES; ++n) {
+		if (rot13_block_use(names[n]) < 0) {
+			printf("{\"impl\":\"%s\",\"skipped\":true}\n", names[n]);
+			continue;
+		}
+		if (check(names[n])) {
+			failed = 1;
+			continue;
+		}
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+			bench(names[n], sizes[s], seconds);
+	}
+	return failed;
+}
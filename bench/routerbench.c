@@ -0,0 +1,140 @@
+/* Times R10_router's lookup against what evhttp does for the callbacks
+ * given to evhttp_set_cb(): decode the path into a new string, then
+ * strcmp() it against each registered path in turn.  For 10, 100 and 500
+ * routes (exact paths, since that's all evhttp_set_cb() can do), we first
+ * check that both find the same route for every path, and then look up
+ * each of them, plus a path that matches nothing, and print one line of
+ * JSON for each way of doing it. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <event2/http.h>
+
+#include "../examples_R10/R10_router.h"
+
+#define MAX_ROUTES 500
+
+static const char *words[] = {
+	"users", "posts", "comments", "images", "orders", "items", "tags",
+	"search",
+};
+#define N_WORDS (sizeof(words) / sizeof(words[0]))
+
+static char paths[MAX_ROUTES + 1][64];
+static int n_routes;
+static struct router *router;
+
+/* Somewhere to put the answers, so that the compiler can't skip the
+ * lookups. */
+static volatile size_t sink;
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+dummy_cb(struct evhttp_request *req, const struct router_params *params,
+	void *arg)
+{
+}
+
+/* Both lookups return the route's number, counting from 1, or 0. */
+static int
+radix_lookup(const char *path)
+{
+	struct router_params params;
+	void *arg;
+
+	if (!router_lookup(router, EVHTTP_REQ_GET, path, &params, &arg))
+		return 0;
+	return (int)(intptr_t)arg;
+}
+
+/* What evhttp_dispatch_callback() does with its TAILQ of callbacks. */
+static int
+linear_lookup(const char *path)
+{
+	char *decoded;
+	int i, found = 0;
+
+	if (!(decoded = evhttp_uridecode(path, 0, NULL)))
+		return 0;
+	for (i = 0; i < n_routes; ++i) {
+		if (!strcmp(paths[i], decoded)) {
+			found = i + 1;
+			break;
+		}
+	}
+	free(decoded);
+	return found;
+}
+
+static void
+bench(const char *name, int (*lookup)(const char *), double seconds)
+{
+	unsigned long long n = 0;
+	double start, elapsed;
+	size_t sum = 0;
+	int i;
+
+	start = now_sec();
+	do {
+		for (i = 0; i <= n_routes; ++i)
+			sum += lookup(paths[i]);
+		n += n_routes + 1;
+		elapsed = now_sec() - start;
+	} while (elapsed < seconds);
+	sink += sum;
+	printf("{\"impl\":\"%s\",\"routes\":%d,\"ns_per_lookup\":%.1f}\n", name,
+		n_routes, elapsed * 1e9 / n);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const int sizes[] = {10, 100, MAX_ROUTES};
+	double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+	size_t s;
+	int i;
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+		n_routes = sizes[s];
+		if (!(router = router_new())) {
+			fprintf(stderr, "Couldn't make a router\n");
+			return 1;
+		}
+		for (i = 0; i < n_routes; ++i) {
+			snprintf(paths[i], sizeof(paths[i]), "/api/v%d/%s/item%d",
+				i % 3 + 1, words[i % N_WORDS], i);
+			if (router_add(router, EVHTTP_REQ_GET, paths[i], dummy_cb,
+					(void *)(intptr_t)(i + 1)) < 0) {
+				fprintf(stderr, "Couldn't add %s\n", paths[i]);
+				return 1;
+			}
+		}
+		/* The last path matches no route. */
+		snprintf(paths[n_routes], sizeof(paths[n_routes]),
+			"/api/v1/nothing/here");
+
+		for (i = 0; i <= n_routes; ++i) {
+			if (radix_lookup(paths[i]) != linear_lookup(paths[i])) {
+				fprintf(stderr, "%s: the router and the list disagree\n",
+					paths[i]);
+				return 1;
+			}
+		}
+		bench("radix", radix_lookup, seconds);
+		bench("linear", linear_lookup, seconds);
+		router_free(router);
+	}
+	return 0;
+}
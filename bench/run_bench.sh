@@ -0,0 +1,26 @@
+#!/bin/sh
+#
+# Runs loadgen against each of the example servers in turn, and prints
+# one JSON line per run.  BENCH_DURATION and BENCH_CONNS change how long
+# and how hard; anything in BENCH_ARGS goes to loadgen as it is.
+
+cd "$(dirname "$0")" || exit 1
+. ./lib.sh
+
+DURATION=${BENCH_DURATION:-5}
+CONNS=${BENCH_CONNS:-10}
+
+# Usage: bench PROTO SERVER [SERVER ARGS...]
+bench() {
+	proto=$1
+	shift
+	start_server "$@" >/dev/null 2>&1
+	./loadgen --proto "$proto" --conns "$CONNS" --duration "$DURATION" \
+	    --label "$(basename "$1")" $BENCH_ARGS
+	stop_server
+}
+
+for server in forking select_tuned libevent_tuned bufferevent_tuned uring; do
+	bench rot13 ../examples_01/01_rot13_server_$server
+done
+bench echo ../examples_R8/R8_echo_server
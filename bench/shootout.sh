@@ -0,0 +1,107 @@
+#!/bin/sh
+#
+# Compares the chapter 1 rot13 servers as the number of connections grows:
+# the forking one, the tuned select() one, the two tuned Libevent ones
+# with each backend in turn, and the io_uring one.  For each number of
+# connections in SHOOTOUT_CONNS, we open that many, and keep
+# SHOOTOUT_ACTIVE_PERCENT (10%) of them busy with loadgen while the rest
+# sit idle after one line each.  Each run adds a line to shootout.csv; at
+# the end we draw shootout_rps.svg and shootout_p99.svg from it.  A server
+# that dies during its run gets a note in the last column, and no numbers.
+# (The select() server switches to poll() once it has descriptors past
+# FD_SETSIZE; Libevent's own select backend doesn't, and a glibc built
+# with _FORTIFY_SOURCE aborts it.)
+#
+# Every size needs a descriptor limit above it, and the forking server
+# needs a process for each connection, so sizes we can't get the limit
+# for are skipped, as are forking runs above SHOOTOUT_FORK_MAX (5000).
+
+cd "$(dirname "$0")" || exit 1
+. ./lib.sh
+
+SIZES=${SHOOTOUT_CONNS:-"10 100 1000 10000 50000"}
+PERCENT=${SHOOTOUT_ACTIVE_PERCENT:-10}
+DURATION=${SHOOTOUT_DURATION:-5}
+FORK_MAX=${SHOOTOUT_FORK_MAX:-5000}
+BACKENDS=${SHOOTOUT_BACKENDS:-"select poll epoll"}
+CSV=shootout.csv
+
+# The server and its children, if it has any.
+ticks() {
+	cat /proc/[0-9]*/stat 2>/dev/null |
+	    awk -v p=$pid '$1 == p || $4 == p { t += $14 + $15 } END { print t }'
+}
+
+field() {
+	sed -n "s/.*\"$1\":\([0-9.]*\).*/\1/p" loadgen.out
+}
+
+# Usage: run NAME BACKEND N SERVER [SERVER ARGS...]
+run() {
+	name=$1
+	backend=$2
+	n=$3
+	shift 3
+	active=$((n * PERCENT / 100))
+	[ $active -lt 1 ] && active=1
+	idle=$((n - active))
+	limit=$((n + 64))
+
+	SERVER_FD_LIMIT=$limit
+	start_server "$@" >/dev/null 2>&1
+	: >idle.out
+	if [ $idle -gt 0 ]; then
+		(ulimit -n $limit &&
+		    exec ./idleconns --conns $idle --ping) >idle.out &
+		client=$!
+		while [ ! -s idle.out ] && kill -0 $client 2>/dev/null; do
+			sleep 0.2
+		done
+	fi
+	before=$(ticks)
+	(ulimit -n $limit && exec ./loadgen --proto rot13 --conns $active \
+	    --duration "$DURATION" --label "$name") >loadgen.out
+	after=$(ticks)
+	note=
+	if ! kill -0 $pid 2>/dev/null; then
+		note="server exited"
+		: >loadgen.out
+	fi
+	[ $idle -gt 0 ] && kill $client
+	stop_server
+	wait 2>/dev/null
+	# The forking server leaves its children behind.
+	pkill -P $pid 2>/dev/null
+
+	printf '%s,%s,%s,%s,%s,%s,%s,%s,%s,%s\n' $name $backend $n $active \
+	    "$(field requests_per_s)" "$(field p50)" "$(field p99)" \
+	    "$(field errors)" "$(awk -v t=$((after - before)) \
+	    'BEGIN { printf "%.2f", t / 100 }')" "$note" | tee -a $CSV
+	rm -f idle.out loadgen.out
+	sleep 1
+}
+
+echo "server,backend,conns,active,requests_per_s,p50_us,p99_us,errors," \
+    "server_cpu_s,note" | tr -d ' ' | tee $CSV
+for n in $SIZES; do
+	if ! (ulimit -n $((n + 64))) 2>/dev/null; then
+		echo "# $n: can't raise the descriptor limit to $((n + 64))" >&2
+		continue
+	fi
+	if [ $n -le $FORK_MAX ]; then
+		run forking fork $n ../examples_01/01_rot13_server_forking
+	fi
+	run select select $n ../examples_01/01_rot13_server_select_tuned
+	for b in $BACKENDS; do
+		run libevent $b $n \
+		    ../examples_01/01_rot13_server_libevent_tuned --backend $b
+		run bufferevent $b $n \
+		    ../examples_01/01_rot13_server_bufferevent_tuned --backend $b
+	done
+	run uring uring $n ../examples_01/01_rot13_server_uring
+done
+
+./shootout_chart.sh $CSV requests_per_s "Requests per second" \
+    >shootout_rps.svg
+./shootout_chart.sh $CSV p99_us "99th percentile latency (us)" \
+    >shootout_p99.svg
@@ -0,0 +1,91 @@
+#!/bin/sh
+#
+# Usage: shootout_chart.sh CSV COLUMN TITLE >chart.svg
+#
+# Draws one column of shootout.csv against the number of connections, on a
+# log scale, with a line for each server and backend.  It's plain awk, so
+# that we don't need a plotting package.
+
+[ $# -eq 3 ] || { echo "Usage: $0 CSV COLUMN TITLE" >&2; exit 1; }
+
+awk -F, -v column="$2" -v title="$3" '
+function px(n) { return 70 + (log(n) - lo) / (hi - lo + 1e-9) * 560 }
+function py(v) { return 420 - v / ymax * 360 }
+NR == 1 {
+	for (i = 1; i <= NF; ++i)
+		if ($i == column)
+			col = i
+	if (!col) {
+		print "no column " column > "/dev/stderr"
+		exit 1
+	}
+	next
+}
+/^#/ || $col == "" { next }
+{
+	label = ($1 == $2 || $2 == "fork") ? $1 : $1 "/" $2
+	if (!(label in seen)) {
+		seen[label] = 1
+		order[++n_series] = label
+	}
+	k = ++count[label]
+	xs[label, k] = $3
+	ys[label, k] = $col
+	if (!($3 in xseen)) {
+		xseen[$3] = 1
+		xticks[++n_x] = $3
+	}
+	if ($col + 0 > ymax)
+		ymax = $col + 0
+	if (lo == "" || log($3) < lo)
+		lo = log($3)
+	if (hi == "" || log($3) > hi)
+		hi = log($3)
+}
+END {
+	split("#1f77b4 #ff7f0e #2ca02c #d62728 #9467bd #8c564b #e377c2 " \
+	    "#7f7f7f #bcbd22 #17becf", colors, " ")
+	ymax = ymax ? ymax * 1.1 : 1
+	print "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"820\"" \
+	    " height=\"480\" font-family=\"sans-serif\" font-size=\"12\">"
+	print "<rect width=\"820\" height=\"480\" fill=\"white\"/>"
+	printf "<text x=\"350\" y=\"30\" text-anchor=\"middle\"" \
+	    " font-size=\"16\">%s</text>\n", title
+	print "<line x1=\"70\" y1=\"420\" x2=\"630\" y2=\"420\"" \
+	    " stroke=\"black\"/>"
+	print "<line x1=\"70\" y1=\"60\" x2=\"70\" y2=\"420\"" \
+	    " stroke=\"black\"/>"
+	for (i = 1; i <= n_x; ++i)
+		printf "<text x=\"%.1f\" y=\"438\" text-anchor=\"middle\">" \
+		    "%s</text>\n", px(xticks[i]), xticks[i]
+	print "<text x=\"350\" y=\"465\" text-anchor=\"middle\">" \
+	    "connections</text>"
+	for (i = 0; i <= 5; ++i) {
+		v = ymax * i / 5
+		printf "<text x=\"64\" y=\"%.1f\" text-anchor=\"end\">%s" \
+		    "</text>\n", py(v) + 4, (v >= 1000 ? sprintf("%.0fk", \
+		    v / 1000) : sprintf("%.0f", v))
+		printf "<line x1=\"70\" y1=\"%.1f\" x2=\"630\" y2=\"%.1f\"" \
+		    " stroke=\"#ddd\"/>\n", py(v), py(v)
+	}
+	for (s = 1; s <= n_series; ++s) {
+		label = order[s]
+		color = colors[(s - 1) % 10 + 1]
+		points = ""
+		for (k = 1; k <= count[label]; ++k)
+			points = points sprintf("%.1f,%.1f ",
+			    px(xs[label, k]), py(ys[label, k]))
+		printf "<polyline fill=\"none\" stroke=\"%s\"" \
+		    " stroke-width=\"2\" points=\"%s\"/>\n", color, points
+		for (k = 1; k <= count[label]; ++k)
+			printf "<circle cx=\"%.1f\" cy=\"%.1f\" r=\"3\"" \
+			    " fill=\"%s\"/>\n", px(xs[label, k]),
+			    py(ys[label, k]), color
+		printf "<line x1=\"650\" y1=\"%d\" x2=\"670\" y2=\"%d\"" \
+		    " stroke=\"%s\" stroke-width=\"2\"/>\n",
+		    60 + s * 18, 60 + s * 18, color
+		printf "<text x=\"676\" y=\"%d\">%s</text>\n",
+		    64 + s * 18, label
+	}
+	print "</svg>"
+}' "$1"
@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# Streams big messages through R8_echo_server, first with bufferevents and
+# then with --splice, and prints what loadgen saw, then one line with the
+# rate in Gbit/s and how many seconds of CPU time the server spent on
+# each GB it echoed.  SPLICE_CONNS lists the numbers of connections to try
+# ("1 8"); SPLICE_SIZE (256 KB) is the size of each message, and
+# SPLICE_DEPTH (4) and SPLICE_DURATION (5) do the rest.
+
+cd "$(dirname "$0")" || exit 1
+. ./lib.sh
+
+CONNS=${SPLICE_CONNS:-1 8}
+SIZE=${SPLICE_SIZE:-262144}
+DEPTH=${SPLICE_DEPTH:-4}
+DURATION=${SPLICE_DURATION:-5}
+PORT=9878
+
+for conns in $CONNS; do
+	for mode in bufferevent splice; do
+		if [ $mode = splice ]; then
+			flags=--splice
+		else
+			flags=
+		fi
+		label=$mode-c$conns
+		start_server ../examples_R8/R8_echo_server $PORT $flags \
+		    >/dev/null 2>&1
+		before=$(cpu_ticks)
+		./loadgen --proto echo --port $PORT --conns "$conns" \
+		    --depth "$DEPTH" --size "$SIZE" --warmup 0 \
+		    --duration "$DURATION" --label "$label" | tee splice.json
+		after=$(cpu_ticks)
+		stop_server
+		requests=$(sed 's/.*"requests":\([0-9]*\).*/\1/' splice.json)
+		mbit=$(sed 's/.*"mbit_per_s":\([0-9.]*\).*/\1/' splice.json)
+		echo "$label $mbit $requests $((after - before))" |
+		    awk -v size="$SIZE" '{ gb = $3 * size / 1e9
+			printf "{\"label\":\"%s\",\"gbit_per_s\":%.2f," \
+			"\"server_cpu_s\":%.2f,\"server_cpu_s_per_gb\":%.3f}\n",
+			$1, $2 / 1000, $4 / 100, gb ? $4 / 100 / gb : 0 }'
+		rm -f splice.json
+	done
+done
@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# PUTs files of each of UPLOAD_SIZES (4 KB, 1 MB, 64 MB and 1 GB) to
+# R10_static_server --uploads over and over, and prints what loadgen
+# saw, then one line with the upload rate in MB/s and the server's peak
+# RSS (VmHWM), next to its RSS before the first upload.  Each size gets a
+# fresh server, so that the peak is that size's alone.  UPLOAD_CONNS (1)
+# and UPLOAD_DURATION (5) shape the load; loadgen keeps a copy of the body
+# in memory, so leave room for it.  The files go in a temporary directory
+# under TMPDIR.
+
+cd "$(dirname "$0")" || exit 1
+. ./lib.sh
+
+SIZES=${UPLOAD_SIZES:-"4096 1048576 67108864 1073741824"}
+CONNS=${UPLOAD_CONNS:-1}
+DURATION=${UPLOAD_DURATION:-5}
+PORT=8080
+SERVER=${SERVER:-$PWD/../examples_R10/R10_static_server}
+
+docroot=$(mktemp -d) || exit 1
+trap 'rm -rf "$docroot"' EXIT
+SERVER_DIR=$docroot
+
+for size in $SIZES; do
+	label=put-$size
+	start_server "$SERVER" --uploads >/dev/null 2>&1
+	rss0=$(status_kb VmRSS)
+	# Every connection writes the same file, so that the disk only
+	# ever holds one copy of it per connection still uploading.
+	./loadgen --port $PORT --path /upload.bin \
+	    --size "$size" --conns "$CONNS" --warmup 0 \
+	    --duration "$DURATION" --label "$label" | tee upload.json
+	hwm=$(status_kb VmHWM)
+	stop_server INT
+	mbit=$(sed 's/.*"mbit_per_s":\([0-9.]*\).*/\1/' upload.json)
+	echo "$label $mbit $rss0 $hwm" |
+	    awk '{ printf "{\"label\":\"%s\",\"mbyte_per_s\":%.1f," \
+		"\"server_rss_before_kb\":%d,\"server_vmhwm_kb\":%d}\n",
+		$1, $2 / 8, $3, $4 }'
+	rm -f upload.json
+done
@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Runs the tuned bufferevent rot13 server and the io_uring one under
+# syscount.so, and prints what loadgen saw, then the server's counts, and
+# then one line with how many of those system calls it made per request
+# and how much CPU time it used.  URING_LOADS lists the loads to try as
+# CONNS:DEPTH pairs ("10:1 16:8"); URING_SIZE (64) and URING_DURATION (5)
+# do the rest.
+
+cd "$(dirname "$0")" || exit 1
+. ./lib.sh
+
+LOADS=${URING_LOADS:-10:1 16:8}
+SIZE=${URING_SIZE:-64}
+DURATION=${URING_DURATION:-5}
+
+# Adds up every count in syscount.so's line of JSON.
+total_calls() {
+	grep '^{' uring.out | tr '{},' '\n\n\n' |
+	    awk -F: 'NF == 2 { n += $2 } END { print n + 0 }'
+}
+
+for load in $LOADS; do
+	conns=${load%:*}
+	depth=${load#*:}
+	for server in bufferevent_tuned uring; do
+		label=$server-c$conns-d$depth
+		start_server env LD_PRELOAD=./syscount.so \
+		    ../examples_01/01_rot13_server_$server >/dev/null 2>uring.out
+		before=$(cpu_ticks)
+		# No warmup, so that the server's counts cover just the
+		# requests loadgen counts.
+		./loadgen --proto rot13 --conns "$conns" --depth "$depth" \
+		    --size "$SIZE" --warmup 0 --duration "$DURATION" \
+		    --label "$label" | tee uring.json
+		after=$(cpu_ticks)
+		stop_server
+		grep '^{' uring.out
+		requests=$(sed 's/.*"requests":\([0-9]*\).*/\1/' uring.json)
+		echo "$label $requests $(total_calls) $((after - before))" |
+		    awk '{ printf "{\"label\":\"%s\",\"syscalls_per_request\":" \
+			"%.2f,\"server_cpu_s\":%.2f}\n", $1,
+			$2 ? $3 / $2 : 0, $4 / 100 }'
+		rm -f uring.out uring.json
+	done
+done
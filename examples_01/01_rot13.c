@@ -0,0 +1,162 @@
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ROT13_X86
+#endif
+
+#include "01_rot13.h"
+
+char
+rot13_char(char c)
+{
+    /* We don't want to use isalpha here; setting the locale would change
+     * which characters are considered alphabetical. */
+    if ((c >= 'a' && c <= 'm') || (c >= 'A' && c <= 'M'))
+        return c + 13;
+    else if ((c >= 'n' && c <= 'z') || (c >= 'N' && c <= 'Z'))
+        return c - 13;
+    else
+        return c;
+}
+
+static void
+rot13_block_scalar(char *dst, const char *src, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i)
+        dst[i] = rot13_char(src[i]);
+}
+
+#ifdef ROT13_X86
+/* The vector versions work without any branches.  Setting the 0x20 bit
+ * turns every capital letter into its small one, and nothing else into a
+ * letter; bytes from 0x80 up are negative, so the signed comparisons
+ * leave them alone.  Every letter then moves 13 forward if it's before
+ * 'n', and 13 back if it isn't; everything else moves 0. */
+
+__attribute__((target("sse2")))
+static void
+rot13_block_sse2(char *dst, const char *src, size_t n)
+{
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i before_a = _mm_set1_epi8('a' - 1);
+    const __m128i after_z = _mm_set1_epi8('z' + 1);
+    const __m128i before_n = _mm_set1_epi8('n' - 1);
+    const __m128i thirteen = _mm_set1_epi8(13);
+    const __m128i twenty_six = _mm_set1_epi8(26);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i lower = _mm_or_si128(v, case_bit);
+        __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, before_a),
+                                       _mm_cmpgt_epi8(after_z, lower));
+        __m128i back = _mm_and_si128(_mm_cmpgt_epi8(lower, before_n),
+                                     twenty_six);
+        __m128i delta = _mm_and_si128(letter, _mm_sub_epi8(thirteen, back));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi8(v, delta));
+    }
+    rot13_block_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void
+rot13_block_avx2(char *dst, const char *src, size_t n)
+{
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    const __m256i before_a = _mm256_set1_epi8('a' - 1);
+    const __m256i after_z = _mm256_set1_epi8('z' + 1);
+    const __m256i before_n = _mm256_set1_epi8('n' - 1);
+    const __m256i thirteen = _mm256_set1_epi8(13);
+    const __m256i twenty_six = _mm256_set1_epi8(26);
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i lower = _mm256_or_si256(v, case_bit);
+        __m256i letter = _mm256_and_si256(
+            _mm256_cmpgt_epi8(lower, before_a),
+            _mm256_cmpgt_epi8(after_z, lower));
+        __m256i back = _mm256_and_si256(_mm256_cmpgt_epi8(lower, before_n),
+                                        twenty_six);
+        __m256i delta = _mm256_and_si256(letter,
+                                         _mm256_sub_epi8(thirteen, back));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi8(v, delta));
+    }
+    /* The last few bytes take one 16-byte step, at most, and then some
+     * single ones. */
+    rot13_block_sse2(dst + i, src + i, n - i);
+}
+#endif
+
+struct rot13_version {
+    const char *name;
+    void (*fn)(char *, const char *, size_t);
+};
+
+/* Best first. */
+static const struct rot13_version versions[] = {
+#ifdef ROT13_X86
+    { "avx2", rot13_block_avx2 },
+    { "sse2", rot13_block_sse2 },
+#endif
+    { "scalar", rot13_block_scalar },
+};
+#define N_VERSIONS (sizeof(versions) / sizeof(versions[0]))
+
+static const struct rot13_version *chosen;
+
+static int
+cpu_can_run(const char *name)
+{
+#ifdef ROT13_X86
+    __builtin_cpu_init();
+    if (!strcmp(name, "avx2"))
+        return __builtin_cpu_supports("avx2");
+    if (!strcmp(name, "sse2"))
+        return __builtin_cpu_supports("sse2");
+#endif
+    return !strcmp(name, "scalar");
+}
+
+static const struct rot13_version *
+choose(void)
+{
+    size_t i;
+    for (i = 0; i < N_VERSIONS; ++i) {
+        if (cpu_can_run(versions[i].name))
+            return &versions[i];
+    }
+    return &versions[N_VERSIONS - 1];
+}
+
+void
+rot13_block(char *dst, const char *src, size_t n)
+{
+    /* We ask the CPU once, the first time through. */
+    if (!chosen)
+        chosen = choose();
+    chosen->fn(dst, src, n);
+}
+
+const char *
+rot13_block_impl(void)
+{
+    if (!chosen)
+        chosen = choose();
+    return chosen->name;
+}
+
+int
+rot13_block_use(const char *name)
+{
+    size_t i;
+    for (i = 0; i < N_VERSIONS; ++i) {
+        if (!strcmp(versions[i].name, name) && cpu_can_run(name)) {
+            chosen = &versions[i];
+            return 0;
+        }
+    }
+    return -1;
+}
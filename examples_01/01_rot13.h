@@ -0,0 +1,23 @@
+#ifndef ROT13_H_INCLUDED_
+#define ROT13_H_INCLUDED_
+
+#include <stddef.h>
+
+/* ROT13 of a single character. */
+char rot13_char(char c);
+
+/* Puts the ROT13 of the 'n' bytes at 'src' into 'dst'.  'dst' may be
+ * 'src', but the two mustn't overlap otherwise.  This does the same as
+ * calling rot13_char() on every byte, only many bytes at a time, with the
+ * widest vector instructions the CPU has. */
+void rot13_block(char *dst, const char *src, size_t n);
+
+/* Which version of rot13_block() we're using: "avx2", "sse2", or
+ * "scalar". */
+const char *rot13_block_impl(void);
+
+/* Makes rot13_block() use the version called 'name'; returns -1 if the
+ * CPU can't run it.  For benchmarks and tests. */
+int rot13_block_use(const char *name);
+
+#endif
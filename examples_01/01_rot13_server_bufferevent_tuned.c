@@ -0,0 +1,290 @@
+/* The ROT13 server from 01_rot13_server_bufferevent.c, with the changes a
+ * real one would need; 01_intro.txt describes them.  This is the
+ * version the benchmarks in bench/ run. */
+
+/* For sockaddr_in */
+#include <netinet/in.h>
+/* For socket functions */
+#include <sys/socket.h>
+/* For fcntl */
+#include <fcntl.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include <assert.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+/* For rot13_block */
+#include "01_rot13.h"
+
+#define MAX_LINE 16384
+
+void do_read(evutil_socket_t fd, short events, void *arg);
+void do_write(evutil_socket_t fd, short events, void *arg);
+
+/* How many pieces of the input we look at for each batch. */
+#define MAX_IOVECS 16
+
+/* Moves up to 'len' bytes from the front of 'input' to the end of 'output',
+ * ROT13ing them as they go: straight from the input's chunks into space we
+ * reserve at the end of the output, with no copy in between.  Returns the
+ * number of bytes moved, which is less than 'len' only if the data is
+ * spread across more than MAX_IOVECS chunks, or -1 on error. */
+ssize_t
+rot13_move(struct evbuffer *input, struct evbuffer *output, size_t len)
+{
+    struct evbuffer_iovec in[MAX_IOVECS], out[2];
+    size_t in_off = 0, out_off = 0, covered = 0, left;
+    int n_in, i, j;
+
+    n_in = evbuffer_peek(input, len, NULL, in, MAX_IOVECS);
+    if (n_in > MAX_IOVECS)
+        n_in = MAX_IOVECS;
+    for (i = 0; i < n_in && covered < len; ++i)
+        covered += in[i].iov_len;
+    if (covered > len)
+        covered = len;
+    if (evbuffer_reserve_space(output, covered, out, 2) < 0)
+        return -1;
+
+    i = j = 0;
+    for (left = covered; left; ) {
+        size_t k = in[i].iov_len - in_off;
+        if (k > out[j].iov_len - out_off)
+            k = out[j].iov_len - out_off;
+        if (k > left)
+            k = left;
+        rot13_block((char *)out[j].iov_base + out_off,
+                    (const char *)in[i].iov_base + in_off, k);
+        in_off += k;
+        out_off += k;
+        left -= k;
+        if (in_off == in[i].iov_len) {
+            ++i;
+            in_off = 0;
+        }
+        if (out_off == out[j].iov_len) {
+            ++j;
+            out_off = 0;
+        }
+    }
+    if (out_off) {
+        out[j].iov_len = out_off;
+        ++j;
+    }
+    if (evbuffer_commit_space(output, out, j) < 0)
+        return -1;
+    evbuffer_drain(input, covered);
+    return covered;
+}
+
+void
+readcb(struct bufferevent *bev, void *ctx)
+{
+    struct evbuffer *input, *output;
+    struct evbuffer_ptr eol;
+    size_t eol_len, batch = 0;
+    ssize_t moved;
+    int too_long = 0;
+    input = bufferevent_get_input(bev);
+    output = bufferevent_get_output(bev);
+
+    /* ROT13 leaves the newlines alone, so all the complete lines we have
+     * can go out as one batch.  Find where the last of them ends. */
+    eol = evbuffer_search_eol(input, NULL, &eol_len, EVBUFFER_EOL_LF);
+    while (eol.pos != -1) {
+        batch = eol.pos + eol_len;
+        if (evbuffer_ptr_set(input, &eol, batch, EVBUFFER_PTR_SET) < 0)
+            break;
+        eol = evbuffer_search_eol(input, &eol, &eol_len, EVBUFFER_EOL_LF);
+    }
+
+    if (evbuffer_get_length(input) - batch >= MAX_LINE) {
+        /* Too long; just process what there is and go on so that the buffer
+         * doesn't grow infinitely long. */
+        batch = evbuffer_get_length(input);
+        too_long = 1;
+    }
+
+    while (batch) {
+        if ((moved = rot13_move(input, output, batch)) < 0) {
+            bufferevent_free(bev);
+            return;
+        }
+        batch -= moved;
+    }
+    if (too_long)
+        evbuffer_add(output, "\n", 1);
+}
+
+void
+errorcb(struct bufferevent *bev, short error, void *ctx)
+{
+    if (error & BEV_EVENT_EOF) {
+        /* connection has been closed, do any clean up here */
+        /* ... */
+    } else if (error & BEV_EVENT_ERROR) {
+        /* check errno to see what error occurred */
+        /* ... */
+    } else if (error & BEV_EVENT_TIMEOUT) {
+        /* must be a timeout event handle, handle it */
+        /* ... */
+    }
+    bufferevent_free(bev);
+}
+
+/* Out of file descriptors, we give up a spare one to accept and close
+ * whatever is waiting, and stop listening for a while, just as in
+ * 01_rot13_server_libevent_tuned.c. */
+#define ACCEPT_BACKOFF_MIN_MSEC 10
+#define ACCEPT_BACKOFF_MAX_MSEC 1000
+
+int spare_fd = -1;
+int backoff_msec = ACCEPT_BACKOFF_MIN_MSEC;
+
+void
+shed_connections(int listener)
+{
+    int fd;
+    if (spare_fd < 0)
+        return;
+    close(spare_fd);
+    while ((fd = accept(listener, NULL, NULL)) >= 0)
+        close(fd);
+    spare_fd = open("/dev/null", O_RDONLY);
+}
+
+void
+resume_accept(evutil_socket_t fd, short events, void *arg)
+{
+    struct event *listener_event = arg;
+    event_add(listener_event, NULL);
+}
+
+void
+do_accept(evutil_socket_t listener, short event, void *arg)
+{
+    struct event *listener_event = arg;
+    struct event_base *base = event_get_base(listener_event);
+    struct sockaddr_storage ss;
+    socklen_t slen = sizeof(ss);
+    int fd = accept(listener, (struct sockaddr*)&ss, &slen);
+    if (fd < 0 && (errno == EMFILE || errno == ENFILE)) {
+        struct timeval tv = { backoff_msec / 1000, backoff_msec % 1000 * 1000 };
+        shed_connections(listener);
+        event_del(listener_event);
+        event_base_once(base, -1, EV_TIMEOUT, resume_accept, listener_event,
+            &tv);
+        if (backoff_msec < ACCEPT_BACKOFF_MAX_MSEC)
+            backoff_msec *= 2;
+    } else if (fd < 0) {
+        perror("accept");
+    } else {
+        struct bufferevent *bev;
+        backoff_msec = ACCEPT_BACKOFF_MIN_MSEC;
+        evutil_make_socket_nonblocking(fd);
+        bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+        bufferevent_setcb(bev, readcb, NULL, errorcb, NULL);
+        bufferevent_setwatermark(bev, EV_READ, 0, MAX_LINE);
+        bufferevent_enable(bev, EV_READ|EV_WRITE);
+    }
+}
+
+/* With --backend, we use only the backend called 'backend' ("epoll",
+ * "poll", "select", and so on), by telling Libevent to avoid all the
+ * others.  That way we can compare them. */
+const char *backend = NULL;
+
+struct event_base *
+new_base(void)
+{
+    struct event_config *cfg;
+    struct event_base *base;
+    const char **methods;
+    int i;
+
+    if (!backend)
+        return event_base_new();
+
+    cfg = event_config_new();
+    if (!cfg)
+        return NULL;
+    methods = event_get_supported_methods();
+    for (i = 0; methods[i]; ++i) {
+        if (strcmp(methods[i], backend))
+            event_config_avoid_method(cfg, methods[i]);
+    }
+    base = event_base_new_with_config(cfg);
+    event_config_free(cfg);
+    if (!base)
+        fprintf(stderr, "Can't use the %s backend.\n", backend);
+    return base;
+}
+
+void
+run(void)
+{
+    evutil_socket_t listener;
+    struct sockaddr_in sin;
+    struct event_base *base;
+    struct event *listener_event;
+
+    base = new_base();
+    if (!base)
+        return; /*XXXerr*/
+
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = 0;
+    sin.sin_port = htons(40713);
+
+    spare_fd = open("/dev/null", O_RDONLY);
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    evutil_make_socket_nonblocking(listener);
+
+#ifndef WIN32
+    {
+        int one = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+#endif
+
+    if (bind(listener, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+        perror("bind");
+        return;
+    }
+
+    if (listen(listener, 16)<0) {
+        perror("listen");
+        return;
+    }
+
+    listener_event = event_new(base, listener, EV_READ|EV_PERSIST, do_accept,
+        event_self_cbarg());
+    /*XXX check it */
+    event_add(listener_event, NULL);
+
+    event_base_dispatch(base);
+}
+
+int
+main(int c, char **v)
+{
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    if (c == 3 && !strcmp(v[1], "--backend")) {
+        backend = v[2];
+    } else if (c != 1) {
+        fprintf(stderr, "Usage: %s [--backend METHOD]\n", v[0]);
+        return 1;
+    }
+
+    run();
+    return 0;
+}
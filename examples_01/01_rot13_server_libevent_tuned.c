@@ -0,0 +1,405 @@
+/* The ROT13 server from 01_rot13_server_libevent.c, with the changes a
+ * real one would need; 01_intro.txt describes them.  This is the
+ * version the benchmarks in bench/ run. */
+
+/* For sockaddr_in */
+#include <netinet/in.h>
+/* For socket functions */
+#include <sys/socket.h>
+/* For fcntl */
+#include <fcntl.h>
+
+#include <event2/event.h>
+/* For struct event, so that we can put events inside our own structures */
+#include <event2/event_struct.h>
+
+#include <assert.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+/* For rot13_block */
+#include "01_rot13.h"
+
+#define MAX_LINE 16384
+/* How much we ask recv() for at once. */
+#define READ_SIZE 65536
+
+void do_read(evutil_socket_t fd, short events, void *arg);
+void do_write(evutil_socket_t fd, short events, void *arg);
+
+/* With --et, our events are edge-triggered: Libevent tells us only when a
+ * socket *becomes* readable or writable, and it never has to tell the
+ * kernel again after the first time.  That means we must read until recv()
+ * says EAGAIN, as we always do anyway.  It also means we can try sending
+ * a reply as soon as we have it, and only wait for the write event once
+ * send() has said EAGAIN, rather than adding the write event for every
+ * line and deleting it again after. */
+int edge_triggered = 0;
+
+/* Most connections, most of the time, have nothing in flight.  So a
+ * connection only borrows a line buffer when some data arrives for it, and
+ * gives it back once it has written everything out.  We keep a few spare
+ * buffers around so that we aren't calling malloc() for every line. */
+#define MAX_SPARE_BUFFERS 64
+
+struct line_buffer {
+    struct line_buffer *next; /* while it's spare */
+    char data[MAX_LINE];
+};
+
+struct line_buffer *spare_buffers = NULL;
+int n_spare_buffers = 0;
+
+/* The events live inside the state itself, so each connection takes just
+ * one allocation.  See event_assign() in the reference for the catch. */
+struct fd_state {
+    struct event read_event;
+    struct event write_event;
+
+    struct line_buffer *buffer; /* NULL when we're holding no data */
+    size_t buffer_used;
+
+    size_t n_written;
+    size_t write_upto;
+    int write_blocked; /* until the write event says we can send again */
+
+    struct fd_state *next_free;
+};
+
+/* States come from slabs of this many at once, and go on a free list when
+ * their connections close. */
+#define STATES_PER_SLAB 256
+
+struct fd_state *free_states = NULL;
+
+struct line_buffer *
+get_buffer(void)
+{
+    struct line_buffer *b = spare_buffers;
+    if (b) {
+        spare_buffers = b->next;
+        --n_spare_buffers;
+        return b;
+    }
+    return malloc(sizeof(struct line_buffer));
+}
+
+void
+put_buffer(struct line_buffer *b)
+{
+    if (n_spare_buffers >= MAX_SPARE_BUFFERS) {
+        free(b);
+        return;
+    }
+    b->next = spare_buffers;
+    spare_buffers = b;
+    ++n_spare_buffers;
+}
+
+struct fd_state *
+alloc_fd_state(struct event_base *base, evutil_socket_t fd)
+{
+    struct fd_state *state;
+    short et = edge_triggered ? EV_ET : 0;
+
+    if (!free_states) {
+        struct fd_state *slab =
+            calloc(STATES_PER_SLAB, sizeof(struct fd_state));
+        int i;
+        if (!slab)
+            return NULL;
+        for (i = 0; i < STATES_PER_SLAB; ++i) {
+            slab[i].next_free = free_states;
+            free_states = &slab[i];
+        }
+    }
+    state = free_states;
+
+    if (event_assign(&state->read_event, base, fd, EV_READ|EV_PERSIST|et,
+            do_read, state) < 0 ||
+        event_assign(&state->write_event, base, fd, EV_WRITE|EV_PERSIST|et,
+            do_write, state) < 0)
+        return NULL;
+
+    free_states = state->next_free;
+    state->buffer = NULL;
+    state->buffer_used = state->n_written = state->write_upto = 0;
+    state->write_blocked = 0;
+    return state;
+}
+
+void
+free_fd_state(struct fd_state *state)
+{
+    event_del(&state->read_event);
+    event_del(&state->write_event);
+    evutil_closesocket(event_get_fd(&state->read_event));
+    if (state->buffer)
+        put_buffer(state->buffer);
+    state->next_free = free_states;
+    free_states = state;
+}
+
+/* Sends as much as we can of the lines we've finished.  Returns 0 if we
+ * sent them all, 1 if the socket is full, and -1 on error. */
+int
+write_some(evutil_socket_t fd, struct fd_state *state)
+{
+    while (state->n_written < state->write_upto) {
+        ssize_t result = send(fd, state->buffer->data + state->n_written,
+                              state->write_upto - state->n_written, 0);
+        if (result < 0) {
+            if (errno != EAGAIN) // XXX use evutil macro
+                return -1;
+            state->write_blocked = 1;
+            return 1;
+        }
+        assert(result != 0);
+
+        state->n_written += result;
+    }
+
+    if (state->buffer && state->n_written == state->buffer_used) {
+        state->n_written = state->write_upto = state->buffer_used = 0;
+        put_buffer(state->buffer);
+        state->buffer = NULL;
+    }
+    return 0;
+}
+
+void
+do_read(evutil_socket_t fd, short events, void *arg)
+{
+    struct fd_state *state = arg;
+    static char buf[READ_SIZE];
+    int i;
+    size_t n;
+    ssize_t result;
+    while (1) {
+        result = recv(fd, buf, sizeof(buf), 0);
+        if (result <= 0)
+            break;
+
+        if (!state->buffer && !(state->buffer = get_buffer())) {
+            free_fd_state(state);
+            return;
+        }
+
+        /* Keep as much as fits, and send it all up to the last newline. */
+        n = MAX_LINE - state->buffer_used;
+        if (n > (size_t)result)
+            n = result;
+        rot13_block(state->buffer->data + state->buffer_used, buf, n);
+        for (i = result; i > 0 && buf[i-1] != '\n'; --i)
+            ;
+        if (i > 0)
+            state->write_upto = state->buffer_used + ((size_t)i < n ? i : n);
+        state->buffer_used += n;
+
+        if (i > 0 && !edge_triggered) {
+            event_add(&state->write_event, NULL);
+        } else if (i > 0 && !state->write_blocked) {
+            int r = write_some(fd, state);
+            if (r < 0) {
+                free_fd_state(state);
+                return;
+            }
+            if (r > 0 && !event_pending(&state->write_event, EV_WRITE, NULL))
+                event_add(&state->write_event, NULL);
+        }
+    }
+
+    if (result == 0) {
+        free_fd_state(state);
+    } else if (result < 0) {
+        if (errno == EAGAIN) // XXXX use evutil macro
+            return;
+        perror("recv");
+        free_fd_state(state);
+    }
+}
+
+void
+do_write(evutil_socket_t fd, short events, void *arg)
+{
+    struct fd_state *state = arg;
+    int r;
+
+    state->write_blocked = 0;
+    r = write_some(fd, state);
+
+    if (r < 0)
+        free_fd_state(state);
+    else if (r == 0 && !edge_triggered)
+        event_del(&state->write_event);
+}
+
+/* When we run out of file descriptors, the connection we couldn't accept
+ * keeps the listener readable, and we would be called again right away,
+ * forever.  So we keep a spare descriptor to give up at that point: with
+ * it, we accept whatever is waiting, and close it at once.  Then we stop
+ * listening for a little while, longer each time it happens again. */
+#define ACCEPT_BACKOFF_MIN_MSEC 10
+#define ACCEPT_BACKOFF_MAX_MSEC 1000
+
+int spare_fd = -1;
+int backoff_msec = ACCEPT_BACKOFF_MIN_MSEC;
+
+void
+shed_connections(int listener)
+{
+    int fd;
+    if (spare_fd < 0)
+        return;
+    close(spare_fd);
+    while ((fd = accept(listener, NULL, NULL)) >= 0)
+        close(fd);
+    spare_fd = open("/dev/null", O_RDONLY);
+}
+
+void
+resume_accept(evutil_socket_t fd, short events, void *arg)
+{
+    struct event *listener_event = arg;
+    event_add(listener_event, NULL);
+}
+
+void
+do_accept(evutil_socket_t listener, short event, void *arg)
+{
+    struct event *listener_event = arg;
+    struct event_base *base = event_get_base(listener_event);
+    struct sockaddr_storage ss;
+    socklen_t slen = sizeof(ss);
+    int fd = accept(listener, (struct sockaddr*)&ss, &slen);
+    if (fd < 0 && (errno == EMFILE || errno == ENFILE)) {
+        struct timeval tv = { backoff_msec / 1000, backoff_msec % 1000 * 1000 };
+        shed_connections(listener);
+        event_del(listener_event);
+        event_base_once(base, -1, EV_TIMEOUT, resume_accept, listener_event,
+            &tv);
+        if (backoff_msec < ACCEPT_BACKOFF_MAX_MSEC)
+            backoff_msec *= 2;
+    } else if (fd < 0) { // XXXX eagain??
+        perror("accept");
+    } else {
+        struct fd_state *state;
+        backoff_msec = ACCEPT_BACKOFF_MIN_MSEC;
+        evutil_make_socket_nonblocking(fd);
+        state = alloc_fd_state(base, fd);
+        if (!state) {
+            evutil_closesocket(fd);
+            return;
+        }
+        event_add(&state->read_event, NULL);
+    }
+}
+
+/* With --backend, we use only the backend called 'backend' ("epoll",
+ * "poll", "select", and so on), by telling Libevent to avoid all the
+ * others.  That way we can compare them. */
+const char *backend = NULL;
+
+struct event_base *
+new_base(void)
+{
+    struct event_config *cfg;
+    struct event_base *base;
+    const char **methods;
+    int i;
+
+    if (!backend)
+        return event_base_new();
+
+    cfg = event_config_new();
+    if (!cfg)
+        return NULL;
+    methods = event_get_supported_methods();
+    for (i = 0; methods[i]; ++i) {
+        if (strcmp(methods[i], backend))
+            event_config_avoid_method(cfg, methods[i]);
+    }
+    base = event_base_new_with_config(cfg);
+    event_config_free(cfg);
+    if (!base)
+        fprintf(stderr, "Can't use the %s backend.\n", backend);
+    return base;
+}
+
+void
+run(void)
+{
+    evutil_socket_t listener;
+    struct sockaddr_in sin;
+    struct event_base *base;
+    struct event *listener_event;
+
+    base = new_base();
+    if (!base)
+        return; /*XXXerr*/
+
+    if (edge_triggered &&
+        !(event_base_get_features(base) & EV_FEATURE_ET)) {
+        fprintf(stderr, "The %s backend can't do edge-triggered events.\n",
+            event_base_get_method(base));
+        edge_triggered = 0;
+    }
+
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = 0;
+    sin.sin_port = htons(40713);
+
+    spare_fd = open("/dev/null", O_RDONLY);
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    evutil_make_socket_nonblocking(listener);
+
+#ifndef WIN32
+    {
+        int one = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+#endif
+
+    if (bind(listener, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+        perror("bind");
+        return;
+    }
+
+    if (listen(listener, 16)<0) {
+        perror("listen");
+        return;
+    }
+
+    listener_event = event_new(base, listener, EV_READ|EV_PERSIST, do_accept,
+        event_self_cbarg());
+    /*XXX check it */
+    event_add(listener_event, NULL);
+
+    event_base_dispatch(base);
+}
+
+int
+main(int c, char **v)
+{
+    int i;
+
+    for (i = 1; i < c; ++i) {
+        if (!strcmp(v[i], "--et")) {
+            edge_triggered = 1;
+        } else if (!strcmp(v[i], "--backend") && i + 1 < c) {
+            backend = v[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--et] [--backend METHOD]\n", v[0]);
+            return 1;
+        }
+    }
+
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    run();
+    return 0;
+}
@@ -0,0 +1,332 @@
+/* The ROT13 server from 01_rot13_server_select.c, with the changes a
+ * real one would need; 01_intro.txt describes them.  This is the
+ * version the benchmarks in bench/ run. */
+
+/* For sockaddr_in */
+#include <netinet/in.h>
+/* For socket functions */
+#include <sys/socket.h>
+/* For fcntl */
+#include <fcntl.h>
+/* for select */
+#include <sys/select.h>
+/* for gettimeofday */
+#include <sys/time.h>
+/* for poll */
+#include <poll.h>
+
+#include <assert.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+/* For rot13_block */
+#include "01_rot13.h"
+
+#define MAX_LINE 16384
+
+/* When we run out of file descriptors, the connection we couldn't accept
+ * keeps the listener readable, and select() would return right away,
+ * forever.  So we keep a spare descriptor to give up at that point: with
+ * it, we accept whatever is waiting, and close it at once.  Then we leave
+ * the listener out of the select() for a little while, longer each time
+ * it happens again. */
+#define ACCEPT_BACKOFF_MIN_MSEC 10
+#define ACCEPT_BACKOFF_MAX_MSEC 1000
+
+int spare_fd = -1;
+
+void
+shed_connections(int listener)
+{
+    int fd;
+    if (spare_fd < 0)
+        return;
+    close(spare_fd);
+    while ((fd = accept(listener, NULL, NULL)) >= 0)
+        close(fd);
+    spare_fd = open("/dev/null", O_RDONLY);
+}
+
+struct fd_state {
+    char buffer[MAX_LINE];
+    size_t buffer_used;
+
+    int writing;
+    size_t n_written;
+    size_t write_upto;
+};
+
+struct fd_state *
+alloc_fd_state(void)
+{
+    struct fd_state *state = malloc(sizeof(struct fd_state));
+    if (!state)
+        return NULL;
+    state->buffer_used = state->n_written = state->writing =
+        state->write_upto = 0;
+    return state;
+}
+
+void
+free_fd_state(struct fd_state *state)
+{
+    free(state);
+}
+
+void
+make_nonblocking(int fd)
+{
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+}
+
+int
+do_read(int fd, struct fd_state *state)
+{
+    char buf[1024];
+    int i;
+    size_t n;
+    ssize_t result;
+    while (1) {
+        result = recv(fd, buf, sizeof(buf), 0);
+        if (result <= 0)
+            break;
+
+        /* Keep as much as fits, and send it all up to the last newline. */
+        n = sizeof(state->buffer) - state->buffer_used;
+        if (n > (size_t)result)
+            n = result;
+        rot13_block(state->buffer + state->buffer_used, buf, n);
+        for (i = result; i > 0 && buf[i-1] != '\n'; --i)
+            ;
+        if (i > 0) {
+            state->writing = 1;
+            state->write_upto = state->buffer_used + ((size_t)i < n ? i : n);
+        }
+        state->buffer_used += n;
+    }
+
+    if (result == 0) {
+        return 1;
+    } else if (result < 0) {
+        if (errno == EAGAIN)
+            return 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+do_write(int fd, struct fd_state *state)
+{
+    while (state->n_written < state->write_upto) {
+        ssize_t result = send(fd, state->buffer + state->n_written,
+                              state->write_upto - state->n_written, 0);
+        if (result < 0) {
+            if (errno == EAGAIN)
+                return 0;
+            return -1;
+        }
+        assert(result != 0);
+
+        state->n_written += result;
+    }
+
+    if (state->n_written == state->buffer_used)
+        state->n_written = state->write_upto = state->buffer_used = 0;
+
+    state->writing = 0;
+
+    return 0;
+}
+
+/* select() can only watch descriptors below FD_SETSIZE.  Rather than
+ * turn away connections that get bigger ones, we keep the descriptors we
+ * want to watch in an array of struct pollfd, and hand them to poll()
+ * instead as soon as one of them is too big for select(). */
+int
+wait_with_select(struct pollfd *fds, int n_fds, int maxfd,
+                 struct timeval *timeout)
+{
+    fd_set readset, writeset, exset;
+    int i, r;
+
+    FD_ZERO(&readset);
+    FD_ZERO(&writeset);
+    FD_ZERO(&exset);
+
+    for (i = 0; i < n_fds; ++i) {
+        FD_SET(fds[i].fd, &readset);
+        if (fds[i].events & POLLOUT)
+            FD_SET(fds[i].fd, &writeset);
+    }
+
+    r = select(maxfd+1, &readset, &writeset, &exset, timeout);
+    if (r < 0)
+        return r;
+
+    for (i = 0; i < n_fds; ++i) {
+        fds[i].revents = 0;
+        if (FD_ISSET(fds[i].fd, &readset))
+            fds[i].revents |= POLLIN;
+        if (FD_ISSET(fds[i].fd, &writeset))
+            fds[i].revents |= POLLOUT;
+    }
+    return r;
+}
+
+int
+wait_with_poll(struct pollfd *fds, int n_fds, struct timeval *timeout)
+{
+    int msec = -1;
+    if (timeout)
+        msec = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+    return poll(fds, n_fds, msec);
+}
+
+void
+run(void)
+{
+    int listener;
+    struct fd_state **state = NULL;
+    struct pollfd *fds = NULL;
+    int n_state = 0;
+    struct sockaddr_in sin;
+    int i, n_fds, maxfd, r;
+    struct timeval now, timeout, resume_at = { 0, 0 };
+    int backoff_msec = ACCEPT_BACKOFF_MIN_MSEC;
+
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = 0;
+    sin.sin_port = htons(40713);
+
+    spare_fd = open("/dev/null", O_RDONLY);
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    make_nonblocking(listener);
+
+#ifndef WIN32
+    {
+        int one = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+#endif
+
+    if (bind(listener, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+        perror("bind");
+        return;
+    }
+
+    if (listen(listener, 16)<0) {
+        perror("listen");
+        return;
+    }
+
+    /* One entry for each connection, and one for the listener. */
+    fds = malloc(sizeof(struct pollfd));
+    assert(fds);/*XXX*/
+
+    while (1) {
+        maxfd = listener;
+        n_fds = 0;
+
+        if (timerisset(&resume_at)) {
+            gettimeofday(&now, NULL);
+            if (timercmp(&now, &resume_at, <))
+                timersub(&resume_at, &now, &timeout);
+            else
+                timerclear(&resume_at);
+        }
+        if (!timerisset(&resume_at)) {
+            fds[n_fds].fd = listener;
+            fds[n_fds++].events = POLLIN;
+        }
+
+        for (i=0; i < n_state; ++i) {
+            if (state[i]) {
+                if (i > maxfd)
+                    maxfd = i;
+                fds[n_fds].fd = i;
+                fds[n_fds++].events =
+                    state[i]->writing ? POLLIN|POLLOUT : POLLIN;
+            }
+        }
+
+        if (maxfd < FD_SETSIZE)
+            r = wait_with_select(fds, n_fds, maxfd,
+                                 timerisset(&resume_at) ? &timeout : NULL);
+        else
+            r = wait_with_poll(fds, n_fds,
+                               timerisset(&resume_at) ? &timeout : NULL);
+        if (r < 0) {
+            perror(maxfd < FD_SETSIZE ? "select" : "poll");
+            return;
+        }
+
+        for (i=0; i < n_fds; ++i) {
+            int fd = fds[i].fd;
+            short revents = fds[i].revents;
+            r = 0;
+
+            if (fd == listener) {
+                if (revents & POLLIN) {
+                    struct sockaddr_storage ss;
+                    socklen_t slen = sizeof(ss);
+                    fd = accept(listener, (struct sockaddr*)&ss, &slen);
+                    if (fd < 0 && (errno == EMFILE || errno == ENFILE)) {
+                        shed_connections(listener);
+                        gettimeofday(&now, NULL);
+                        timeout.tv_sec = backoff_msec / 1000;
+                        timeout.tv_usec = backoff_msec % 1000 * 1000;
+                        timeradd(&now, &timeout, &resume_at);
+                        if (backoff_msec < ACCEPT_BACKOFF_MAX_MSEC)
+                            backoff_msec *= 2;
+                    } else if (fd < 0) {
+                        perror("accept");
+                    } else {
+                        backoff_msec = ACCEPT_BACKOFF_MIN_MSEC;
+                        make_nonblocking(fd);
+                        if (fd >= n_state) {
+                            /* Make room for this descriptor, and then
+                             * some, in both arrays. */
+                            int n = fd < 64 ? 64 : fd * 2;
+                            state = realloc(state, n * sizeof(*state));
+                            fds = realloc(fds, (n+1) * sizeof(*fds));
+                            assert(state && fds);/*XXX*/
+                            memset(state + n_state, 0,
+                                   (n - n_state) * sizeof(*state));
+                            n_state = n;
+                        }
+                        state[fd] = alloc_fd_state();
+                        assert(state[fd]);/*XXX*/
+                    }
+                }
+                continue;
+            }
+
+            if (revents & (POLLIN|POLLERR|POLLHUP)) {
+                r = do_read(fd, state[fd]);
+            }
+            if (r == 0 && (revents & POLLOUT)) {
+                r = do_write(fd, state[fd]);
+            }
+            if (r) {
+                free_fd_state(state[fd]);
+                state[fd] = NULL;
+                close(fd);
+            }
+        }
+    }
+}
+
+int
+main(int c, char **v)
+{
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    run();
+    return 0;
+}
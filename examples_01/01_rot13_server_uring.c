@@ -0,0 +1,678 @@
+/* For sockaddr_in */
+#include <netinet/in.h>
+/* For socket functions */
+#include <sys/socket.h>
+/* For fcntl */
+#include <fcntl.h>
+/* For mmap */
+#include <sys/mman.h>
+/* For syscall and the __NR_io_uring_* numbers; we don't need liburing */
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+/* For rot13_block */
+#include "01_rot13.h"
+
+/* Linux's io_uring works the other way around from everything else in
+ * this chapter.  Instead of asking the kernel which sockets are ready and
+ * then calling recv() and send() on them ourselves, we put requests
+ * ("receive on this socket", "send these bytes") in a ring of memory that
+ * we share with the kernel, and it puts a completion in a second ring
+ * once each request is done.  One io_uring_enter() call hands over
+ * everything we've queued and waits for completions, however many
+ * sockets are involved.
+ *
+ * We talk to the kernel directly here, so that nothing is hidden; real
+ * programs will want liburing instead. */
+
+/* Needs to be a power of 2, like the ring below it. */
+#define MAX_LINE 16384
+
+/* How many requests we can queue before we have to hand them over. */
+#define RING_ENTRIES 256
+
+/* We don't give the kernel a buffer for each recv.  Instead, it picks
+ * buffers out of this pool as data arrives, and tells us which one it
+ * used; we give each one back as soon as we've copied the data out.  So an
+ * idle connection holds no receive buffer at all. */
+#define N_RECV_BUFS 256
+#define RECV_BUF_SIZE 4096
+#define RECV_GROUP 0
+
+/* The kind of request, kept in the low bits of each request's user_data;
+ * the rest is the connection it's for. */
+#define OP_ACCEPT 1
+#define OP_RECV 2
+#define OP_SEND 3
+#define OP_TIMEOUT 4
+#define OP_CANCEL 5
+#define OP_MASK 7
+
+struct ring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned to_submit;
+
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+struct conn {
+    int fd;
+    int n_pending; /* requests the kernel still has for this connection */
+    int receiving; /* whether one of those is our recv request */
+    int sending; /* how many of them are sends */
+    int closing;
+
+    /* Receive buffers with data we had no room for yet, oldest first, or
+     * -1.  See got_data(). */
+    int held_first, held_last;
+
+    /* Whether we're waiting for the pool to have a buffer again, and our
+     * neighbours in the list of connections that are. */
+    int starved;
+    struct conn *starved_prev, *starved_next;
+
+    /* We keep our replies in a ring of MAX_LINE bytes until they're sent.
+     * 'head', 'upto' and 'tail' count bytes since the connection opened:
+     * we've sent everything before 'head', we can send everything before
+     * 'upto', and we've stored everything before 'tail'. */
+    size_t head, upto, tail;
+    char out[MAX_LINE];
+};
+
+struct ring ring;
+struct io_uring_buf_ring *recv_ring;
+unsigned short recv_ring_tail;
+char *recv_bufs;
+/* How many buffers the pool has, as far as the completions we've seen go. */
+unsigned free_recv_bufs;
+
+/* Connections whose recv ran out of buffers, in the order they did.
+ * Asking again straight away would just run out again, over and over, so
+ * they wait here until the pool has buffers again; see wake_starved(). */
+struct conn *starved_first, *starved_last;
+
+/* For each receive buffer a connection is holding: the next one it holds,
+ * and where the data we haven't used yet starts and how long it is. */
+int held_next[N_RECV_BUFS];
+size_t held_off[N_RECV_BUFS];
+size_t held_len[N_RECV_BUFS];
+
+int
+ring_init(struct ring *r, unsigned entries)
+{
+    struct io_uring_params p;
+    size_t size, cq_size;
+    char *sq;
+
+    memset(&p, 0, sizeof(p));
+    /* Only this thread uses the ring, and it only wants to hear about
+     * completions when it asks; telling the kernel so saves it some work. */
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    }
+    if (r->fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    /* Both rings live in one mapping; the requests themselves in another. */
+    size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > size)
+        size = cq_size;
+    sq = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+        r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        return -1;
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd,
+        IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        return -1;
+
+    r->sq_entries = p.sq_entries;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->to_submit = 0;
+    r->cq_head = (unsigned *)(sq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(sq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(sq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+    return 0;
+}
+
+/* Hands the kernel everything we've queued, and if 'wait' is set, waits
+ * until at least one completion is ready. */
+int
+ring_enter(struct ring *r, int wait)
+{
+    int n;
+    do {
+        n = syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait ? 1 : 0,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0)
+        r->to_submit -= n;
+    return n;
+}
+
+/* Makes sure there's room to queue 'n' more requests, handing over what
+ * we've queued if there isn't. */
+void
+ring_make_room(struct ring *r, unsigned n)
+{
+    if (r->sq_entries - (*r->sq_tail -
+            __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)) < n)
+        ring_enter(r, 0);
+}
+
+/* Returns an empty request for the caller to fill in.  The kernel looks at
+ * it only during our next ring_enter(), so it's fine that we publish it
+ * before it's filled in. */
+struct io_uring_sqe *
+get_sqe(struct ring *r)
+{
+    unsigned tail, i;
+    struct io_uring_sqe *sqe;
+
+    ring_make_room(r, 1);
+    tail = *r->sq_tail;
+    i = tail & *r->sq_mask;
+    sqe = &r->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[i] = i;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++r->to_submit;
+    return sqe;
+}
+
+void
+give_back_recv_buf(unsigned short bid)
+{
+    struct io_uring_buf *b = &recv_ring->bufs[recv_ring_tail &
+        (N_RECV_BUFS - 1)];
+    b->addr = (uintptr_t)(recv_bufs + (size_t)bid * RECV_BUF_SIZE);
+    b->len = RECV_BUF_SIZE;
+    b->bid = bid;
+    ++recv_ring_tail;
+    __atomic_store_n(&recv_ring->tail, recv_ring_tail, __ATOMIC_RELEASE);
+    ++free_recv_bufs;
+}
+
+/* Registers the pool of receive buffers with the kernel.  The list of free
+ * buffers is itself a ring that we share with it. */
+int
+setup_recv_bufs(struct ring *r)
+{
+    struct io_uring_buf_reg reg;
+    unsigned short i;
+
+    recv_ring = mmap(NULL, N_RECV_BUFS * sizeof(struct io_uring_buf),
+        PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (recv_ring == MAP_FAILED)
+        return -1;
+    recv_bufs = malloc((size_t)N_RECV_BUFS * RECV_BUF_SIZE);
+    if (!recv_bufs)
+        return -1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)recv_ring;
+    reg.ring_entries = N_RECV_BUFS;
+    reg.bgid = RECV_GROUP;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+            &reg, 1) < 0)
+        return -1;
+
+    for (i = 0; i < N_RECV_BUFS; ++i)
+        give_back_recv_buf(i);
+    return 0;
+}
+
+/* One accept request keeps accepting until something goes wrong. */
+void
+queue_accept(int listener)
+{
+    struct io_uring_sqe *sqe = get_sqe(&ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = OP_ACCEPT;
+}
+
+/* Likewise, one recv request keeps receiving into buffers from the pool,
+ * for as long as the connection lasts, or until the pool runs dry. */
+void
+queue_recv(struct conn *c)
+{
+    struct io_uring_sqe *sqe = get_sqe(&ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_GROUP;
+    sqe->user_data = (uintptr_t)c | OP_RECV;
+    ++c->n_pending;
+    c->receiving = 1;
+}
+
+void
+add_starved(struct conn *c)
+{
+    c->starved = 1;
+    c->starved_next = NULL;
+    c->starved_prev = starved_last;
+    if (starved_last)
+        starved_last->starved_next = c;
+    else
+        starved_first = c;
+    starved_last = c;
+}
+
+void
+remove_starved(struct conn *c)
+{
+    if (c->starved_prev)
+        c->starved_prev->starved_next = c->starved_next;
+    else
+        starved_first = c->starved_next;
+    if (c->starved_next)
+        c->starved_next->starved_prev = c->starved_prev;
+    else
+        starved_last = c->starved_prev;
+    c->starved = 0;
+}
+
+/* Lets the connections that have waited longest ask again, one for each
+ * buffer the pool has now.  We do this once we've seen every completion
+ * we have, so that the count isn't counting buffers the kernel has
+ * already used. */
+void
+wake_starved(void)
+{
+    unsigned n = free_recv_bufs;
+
+    while (starved_first && n > 0) {
+        struct conn *c = starved_first;
+        remove_starved(c);
+        if (!c->closing) {
+            queue_recv(c);
+            --n;
+        }
+    }
+}
+
+void
+cancel_recv(struct conn *c)
+{
+    struct io_uring_sqe *sqe = get_sqe(&ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t)c | OP_RECV;
+    sqe->user_data = OP_CANCEL;
+}
+
+struct io_uring_sqe *
+queue_send(struct conn *c, const char *data, size_t len)
+{
+    struct io_uring_sqe *sqe = get_sqe(&ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (uintptr_t)data;
+    sqe->len = len;
+    /* With MSG_WAITALL, the kernel keeps at it until the whole lot has
+     * gone, instead of telling us about a short send. */
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)c | OP_SEND;
+    ++c->n_pending;
+    ++c->sending;
+    return sqe;
+}
+
+/* Sends every finished line we have.  When they run past the end of the
+ * ring, that takes two sends; we link them, so that the kernel won't start
+ * the second until the first is done, and mark the first with MSG_MORE,
+ * so that TCP doesn't send its tail as a small packet of its own.  The
+ * kernel only links requests that it gets in the same ring_enter(), so
+ * we make room for both first. */
+void
+start_sending(struct conn *c)
+{
+    size_t len = c->upto - c->head;
+    size_t start = c->head & (MAX_LINE - 1);
+    size_t first = len < MAX_LINE - start ? len : MAX_LINE - start;
+    struct io_uring_sqe *sqe;
+
+    if (first < len)
+        ring_make_room(&ring, 2);
+    sqe = queue_send(c, c->out + start, first);
+    if (first < len) {
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe->msg_flags |= MSG_MORE;
+        queue_send(c, c->out, len - first);
+    }
+}
+
+/* Returns how many of the 'n' bytes at 'data' we've dealt with.
+ *
+ * The kernel goes on receiving while our sends are under way, so data can
+ * turn up faster than we can send it.  When it does, we take only what
+ * fits, and leave the rest for when the sends have made room.  Only a
+ * line too long for the whole ring gets cut short, as in the other
+ * servers: that's when nothing is waiting to be sent, and no newline
+ * fits either. */
+size_t
+got_data(struct conn *c, const char *data, size_t n)
+{
+    size_t space = MAX_LINE - (c->tail - c->head);
+    size_t keep, start, first, i;
+
+    if (n > space && (c->upto > c->head || memchr(data, '\n', space)))
+        n = space;
+    keep = n < space ? n : space;
+    start = c->tail & (MAX_LINE - 1);
+    first = keep < MAX_LINE - start ? keep : MAX_LINE - start;
+
+    rot13_block(c->out + start, data, first);
+    rot13_block(c->out, data + first, keep - first);
+
+    /* As in the other servers, we reply to everything up to the last
+     * newline we have room for. */
+    for (i = n; i > 0 && data[i - 1] != '\n'; --i)
+        ;
+    if (i > 0)
+        c->upto = c->tail + (i < keep ? i : keep);
+    c->tail += keep;
+
+    if (!c->sending && c->upto > c->head)
+        start_sending(c);
+    return n;
+}
+
+void
+hold_recv_buf(struct conn *c, int bid, size_t off, size_t len)
+{
+    held_next[bid] = -1;
+    held_off[bid] = off;
+    held_len[bid] = len;
+    if (c->held_last >= 0)
+        held_next[c->held_last] = bid;
+    else
+        c->held_first = bid;
+    c->held_last = bid;
+}
+
+/* Uses up as much held data as we now have room for.  Once it's all gone,
+ * we start receiving again, unless we're waiting for the pool to have a
+ * buffer. */
+void
+use_held_data(struct conn *c)
+{
+    while (c->held_first >= 0) {
+        int bid = c->held_first;
+        size_t n = got_data(c, recv_bufs + (size_t)bid * RECV_BUF_SIZE +
+            held_off[bid], held_len[bid]);
+        if (n < held_len[bid]) {
+            held_off[bid] += n;
+            held_len[bid] -= n;
+            return;
+        }
+        c->held_first = held_next[bid];
+        give_back_recv_buf(bid);
+    }
+    c->held_last = -1;
+    if (!c->receiving && !c->starved)
+        queue_recv(c);
+}
+
+/* Frees the connection once the kernel is done with it. */
+void
+maybe_free_conn(struct conn *c)
+{
+    if (c->closing && !c->n_pending) {
+        if (c->starved)
+            remove_starved(c);
+        while (c->held_first >= 0) {
+            int bid = c->held_first;
+            c->held_first = held_next[bid];
+            give_back_recv_buf(bid);
+        }
+        close(c->fd);
+        free(c);
+    }
+}
+
+void
+do_recv(struct conn *c, int res, unsigned flags)
+{
+    if (!(flags & IORING_CQE_F_MORE)) {
+        --c->n_pending;
+        c->receiving = 0;
+    }
+
+    if (res > 0) {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        size_t n = 0;
+        --free_recv_bufs;
+        if (c->held_first < 0 && !c->closing)
+            n = got_data(c, recv_bufs + (size_t)bid * RECV_BUF_SIZE, res);
+        if (n == (size_t)res || c->closing) {
+            give_back_recv_buf(bid);
+        } else {
+            /* Stop receiving until our sends have made room. */
+            if (c->held_first < 0 && c->receiving)
+                cancel_recv(c);
+            hold_recv_buf(c, bid, n, res - n);
+        }
+    } else if (res == -ENOBUFS) {
+        /* The pool ran dry; wait for it to fill up again. */
+        if (!c->receiving && !c->closing && c->held_first < 0)
+            add_starved(c);
+    } else if (res == -ECANCELED) {
+        /* We asked to stop. */
+    } else {
+        c->closing = 1;
+    }
+
+    if (!c->receiving && !c->closing && c->held_first < 0 && !c->starved)
+        queue_recv(c);
+    maybe_free_conn(c);
+}
+
+void
+do_send(struct conn *c, int res)
+{
+    --c->n_pending;
+    --c->sending;
+
+    if (res > 0) {
+        c->head += res;
+    } else if (res < 0 && res != -ECANCELED && !c->closing) {
+        /* The peer is gone.  Shutting the socket down ends our recv
+         * request too, so that we can free the connection. */
+        c->closing = 1;
+        shutdown(c->fd, SHUT_RDWR);
+    }
+    /* A send we linked after a short one gets -ECANCELED; we'll send what
+     * it had again from here. */
+    if (!c->sending && !c->closing) {
+        use_held_data(c);
+        if (!c->sending && c->upto > c->head)
+            start_sending(c);
+    }
+    maybe_free_conn(c);
+}
+
+/* When we run out of file descriptors, we use a spare one to accept and
+ * close whatever is waiting, as the libevent server does, and then stop
+ * accepting for a little while, longer each time it happens again. */
+#define ACCEPT_BACKOFF_MIN_MSEC 10
+#define ACCEPT_BACKOFF_MAX_MSEC 1000
+
+int spare_fd = -1;
+int backoff_msec = ACCEPT_BACKOFF_MIN_MSEC;
+/* The kernel reads this when it starts the timeout, not when we queue it,
+ * so it can't live on the stack. */
+struct __kernel_timespec backoff_ts;
+
+void
+shed_connections(int listener)
+{
+    int fd;
+    int flags = fcntl(listener, F_GETFL);
+    if (spare_fd < 0)
+        return;
+    close(spare_fd);
+    fcntl(listener, F_SETFL, flags | O_NONBLOCK);
+    while ((fd = accept(listener, NULL, NULL)) >= 0)
+        close(fd);
+    fcntl(listener, F_SETFL, flags);
+    spare_fd = open("/dev/null", O_RDONLY);
+}
+
+void
+do_accept(int listener, int res, unsigned flags)
+{
+    struct conn *c;
+
+    if (res == -EMFILE || res == -ENFILE) {
+        struct io_uring_sqe *sqe;
+        shed_connections(listener);
+        backoff_ts.tv_sec = backoff_msec / 1000;
+        backoff_ts.tv_nsec = backoff_msec % 1000 * 1000000L;
+        sqe = get_sqe(&ring);
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (uintptr_t)&backoff_ts;
+        sqe->len = 1;
+        sqe->user_data = OP_TIMEOUT;
+        if (backoff_msec < ACCEPT_BACKOFF_MAX_MSEC)
+            backoff_msec *= 2;
+        return;
+    }
+
+    if (res < 0) {
+        errno = -res;
+        perror("accept");
+    } else {
+        backoff_msec = ACCEPT_BACKOFF_MIN_MSEC;
+        c = malloc(sizeof(struct conn));
+        if (!c) {
+            close(res);
+        } else {
+            c->fd = res;
+            c->n_pending = c->receiving = c->sending = c->closing = 0;
+            c->held_first = c->held_last = -1;
+            c->starved = 0;
+            c->head = c->upto = c->tail = 0;
+            queue_recv(c);
+        }
+    }
+    if (!(flags & IORING_CQE_F_MORE))
+        queue_accept(listener);
+}
+
+void
+run(void)
+{
+    int listener;
+    struct sockaddr_in sin;
+
+    if (ring_init(&ring, RING_ENTRIES) < 0) {
+        perror("io_uring_setup");
+        return;
+    }
+    if (setup_recv_bufs(&ring) < 0) {
+        perror("io_uring_register");
+        return;
+    }
+
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = 0;
+    sin.sin_port = htons(40713);
+
+    spare_fd = open("/dev/null", O_RDONLY);
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+
+    {
+        int one = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+
+    if (bind(listener, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+        perror("bind");
+        return;
+    }
+
+    if (listen(listener, 16)<0) {
+        perror("listen");
+        return;
+    }
+
+    queue_accept(listener);
+
+    while (1) {
+        unsigned head, tail;
+
+        if (ring_enter(&ring, 1) < 0 && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            return;
+        }
+
+        head = *ring.cq_head;
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            struct conn *c = (struct conn *)(uintptr_t)(data & ~OP_MASK);
+
+            /* Hand the slot back before we queue anything new. */
+            __atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+
+            switch (data & OP_MASK) {
+            case OP_ACCEPT:
+                do_accept(listener, res, flags);
+                break;
+            case OP_TIMEOUT:
+                queue_accept(listener);
+                break;
+            case OP_RECV:
+                do_recv(c, res, flags);
+                break;
+            case OP_SEND:
+                do_send(c, res);
+                break;
+            case OP_CANCEL:
+                break;
+            }
+        }
+        wake_starved();
+    }
+}
+
+int
+main(int c, char **v)
+{
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    run();
+    return 0;
+}
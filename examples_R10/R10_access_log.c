@@ -0,0 +1,332 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "R10_access_log.h"
+
+/* Records per ring; a power of two. */
+#define ACCESS_LOG_RING_SIZE 4096
+/* The writer thread writes this much at a time, or whatever it has when
+ * the rings run dry, and then looks again after ACCESS_LOG_IDLE_MS. */
+#define ACCESS_LOG_BATCH (256 * 1024)
+#define ACCESS_LOG_IDLE_MS 10
+#define ACCESS_LOG_TEXT 200
+
+/* One log line, before formatting: formatting it is the writer thread's
+ * job, not the server thread's. */
+struct log_record {
+	struct timeval when;
+	ev_int64_t bytes; /* -1 if we don't know */
+	ev_uint32_t latency_us;
+	short status;	/* 0 for a message */
+	short severity; /* of a message */
+	char method[8];
+	char text[ACCESS_LOG_TEXT]; /* the URI, or the message */
+};
+
+/* A bounded queue after Dmitry Vyukov's: each slot has a sequence number
+ * that says whether it's free for the producer at that position or ready
+ * for the consumer, so producers only contend on 'head', and never wait
+ * for anybody.  The request rings have a single producer, but the message
+ * ring can have several. */
+struct log_slot {
+	atomic_size_t seq;
+	struct log_record rec;
+};
+
+struct log_ring {
+	atomic_size_t head; /* next position to write */
+	char pad1[64 - sizeof(atomic_size_t)];
+	size_t tail; /* next position to read; only the writer uses it */
+	char pad2[64 - sizeof(size_t)];
+	atomic_ulong dropped;
+	unsigned long dropped_reported;
+	struct log_slot slots[ACCESS_LOG_RING_SIZE];
+};
+
+static struct {
+	int fd;
+	bool close_fd;
+	int n_rings; /* the last one is for messages */
+	struct log_ring *rings;
+	pthread_t thread;
+	atomic_bool stopping;
+	bool running;
+} access_log = {-1};
+
+static void
+ring_init(struct log_ring *ring)
+{
+	size_t i;
+
+	atomic_init(&ring->head, 0);
+	ring->tail = 0;
+	atomic_init(&ring->dropped, 0);
+	ring->dropped_reported = 0;
+	for (i = 0; i < ACCESS_LOG_RING_SIZE; ++i)
+		atomic_init(&ring->slots[i].seq, i);
+}
+
+static void
+ring_push(struct log_ring *ring, const struct log_record *rec)
+{
+	size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	struct log_slot *slot;
+
+	for (;;) {
+		slot = &ring->slots[pos & (ACCESS_LOG_RING_SIZE - 1)];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		ev_intptr_t diff = (ev_intptr_t)seq - (ev_intptr_t)pos;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring->head, &pos,
+					pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			/* Full: the writer hasn't got here yet. */
+			atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+			return;
+		} else {
+			pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		}
+	}
+	slot->rec = *rec;
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+static bool
+ring_pop(struct log_ring *ring, struct log_record *rec)
+{
+	struct log_slot *slot =
+		&ring->slots[ring->tail & (ACCESS_LOG_RING_SIZE - 1)];
+
+	if (atomic_load_explicit(&slot->seq, memory_order_acquire) !=
+		ring->tail + 1)
+		return false;
+	*rec = slot->rec;
+	atomic_store_explicit(
+		&slot->seq, ring->tail + ACCESS_LOG_RING_SIZE, memory_order_release);
+	++ring->tail;
+	return true;
+}
+
+/* Appends 'text' as the inside of a JSON string. */
+static size_t
+json_escape(char *out, const char *text)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t n = 0;
+
+	for (; *text; ++text) {
+		unsigned char c = *text;
+		if (c == '"' || c == '\\') {
+			out[n++] = '\\';
+			out[n++] = c;
+		} else if (c < 0x20) {
+			memcpy(out + n, "\\u00", 4);
+			out[n + 4] = hex[c >> 4];
+			out[n + 5] = hex[c & 15];
+			n += 6;
+		} else {
+			out[n++] = c;
+		}
+	}
+	return n;
+}
+
+static size_t
+format_record(char *out, const struct log_record *rec)
+{
+	static const char *severities[] = {"debug", "msg", "warn", "error"};
+	struct tm tm;
+	char when[32];
+	size_t n;
+
+	gmtime_r(&rec->when.tv_sec, &tm);
+	strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+	n = sprintf(out, "{\"time\":\"%s.%06ldZ\",", when, (long)rec->when.tv_usec);
+	if (rec->status) {
+		n += sprintf(out + n, "\"method\":\"%s\",\"uri\":\"", rec->method);
+		n += json_escape(out + n, rec->text);
+		n += sprintf(out + n, "\",\"status\":%d,", rec->status);
+		if (rec->bytes >= 0)
+			n += sprintf(out + n, "\"bytes\":%lld,", (long long)rec->bytes);
+		else
+			n += sprintf(out + n, "\"bytes\":null,");
+		n += sprintf(out + n, "\"latency_us\":%u}\n", rec->latency_us);
+	} else {
+		n += sprintf(out + n, "\"level\":\"%s\",\"message\":\"",
+			severities[rec->severity & 3]);
+		n += json_escape(out + n, rec->text);
+		n += sprintf(out + n, "\"}\n");
+	}
+	return n;
+}
+
+static void
+write_all(const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(access_log.fd, buf, len);
+		if (n <= 0)
+			return; /* nowhere to complain to */
+		buf += n;
+		len -= n;
+	}
+}
+
+static void *
+access_log_run(void *arg)
+{
+	/* Room for a full batch, plus a line or two more. */
+	char *buf = malloc(ACCESS_LOG_BATCH + 4096);
+	struct timespec idle = {0, ACCESS_LOG_IDLE_MS * 1000000L};
+	struct log_record rec;
+	size_t used = 0;
+	bool stopping, got;
+	int i;
+
+	if (!buf)
+		return NULL;
+	do {
+		/* Check first, so that the last pass gets everything logged
+		 * before access_log_stop(). */
+		stopping = atomic_load(&access_log.stopping);
+		got = false;
+		for (i = 0; i < access_log.n_rings; ++i) {
+			struct log_ring *ring = &access_log.rings[i];
+			unsigned long dropped;
+
+			while (ring_pop(ring, &rec)) {
+				got = true;
+				used += format_record(buf + used, &rec);
+				if (used >= ACCESS_LOG_BATCH) {
+					write_all(buf, used);
+					used = 0;
+				}
+			}
+			dropped =
+				atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+			if (dropped != ring->dropped_reported) {
+				used += sprintf(buf + used, "{\"ring\":%d,\"dropped\":%lu}\n",
+					i, dropped - ring->dropped_reported);
+				ring->dropped_reported = dropped;
+				/* The slack only has room for one line past the batch. */
+				if (used >= ACCESS_LOG_BATCH) {
+					write_all(buf, used);
+					used = 0;
+				}
+			}
+		}
+		if (used && (!got || stopping)) {
+			write_all(buf, used);
+			used = 0;
+		}
+		if (!got && !stopping)
+			nanosleep(&idle, NULL);
+	} while (!stopping);
+
+	free(buf);
+	return NULL;
+}
+
+static void
+libevent_log_cb(int severity, const char *msg)
+{
+	struct log_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	evutil_gettimeofday(&rec.when, NULL);
+	rec.severity = severity;
+	snprintf(rec.text, sizeof(rec.text), "%s", msg);
+	ring_push(&access_log.rings[access_log.n_rings - 1], &rec);
+}
+
+int
+access_log_start(const char *filename, int n_rings)
+{
+	int i;
+
+	if (!strcmp(filename, "-")) {
+		access_log.fd = STDOUT_FILENO;
+	} else {
+		access_log.fd =
+			open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (access_log.fd < 0)
+			return -1;
+		access_log.close_fd = true;
+	}
+	access_log.n_rings = n_rings + 1;
+	if (!(access_log.rings =
+				malloc(access_log.n_rings * sizeof(*access_log.rings))))
+		return -1;
+	for (i = 0; i < access_log.n_rings; ++i)
+		ring_init(&access_log.rings[i]);
+	atomic_init(&access_log.stopping, false);
+	if (pthread_create(&access_log.thread, NULL, access_log_run, NULL) != 0)
+		return -1;
+	access_log.running = true;
+	event_set_log_callback(libevent_log_cb);
+	return 0;
+}
+
+void
+access_log_stop(void)
+{
+	if (!access_log.running)
+		return;
+	event_set_log_callback(NULL);
+	atomic_store(&access_log.stopping, true);
+	pthread_join(access_log.thread, NULL);
+	access_log.running = false;
+	if (access_log.close_fd)
+		close(access_log.fd);
+	free(access_log.rings);
+	access_log.rings = NULL;
+}
+
+void
+access_log_request(int ring, const struct timeval *when, const char *method,
+	const char *uri, int status, ev_int64_t bytes, ev_uint32_t latency_us)
+{
+	struct log_record rec;
+
+	rec.when = *when;
+	rec.bytes = bytes;
+	rec.latency_us = latency_us;
+	rec.status = status;
+	rec.severity = 0;
+	snprintf(rec.method, sizeof(rec.method), "%s", method);
+	snprintf(rec.text, sizeof(rec.text), "%s", uri);
+	ring_push(&access_log.rings[ring], &rec);
+}
+
+void
+access_log_message(const char *fmt, ...)
+{
+	struct log_record rec;
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (!access_log.running) {
+		vfprintf(stderr, fmt, ap);
+		fputc('\n', stderr);
+		va_end(ap);
+		return;
+	}
+	memset(&rec, 0, sizeof(rec));
+	evutil_gettimeofday(&rec.when, NULL);
+	rec.severity = EVENT_LOG_MSG;
+	vsnprintf(rec.text, sizeof(rec.text), fmt, ap);
+	va_end(ap);
+	ring_push(&access_log.rings[access_log.n_rings - 1], &rec);
+}
@@ -0,0 +1,32 @@
+#ifndef R10_ACCESS_LOG_H_INCLUDED_
+#define R10_ACCESS_LOG_H_INCLUDED_
+
+#include <event2/util.h>
+
+/* An access log that never blocks the thread writing to it.  Each server
+ * thread puts its records into a ring of its own; a background thread
+ * takes them out and writes them to the file as JSON lines, many at a
+ * time.  When a ring is full, records are dropped and counted. */
+
+/* Opens 'filename' ("-" for stdout) and starts the writer thread, with
+ * one ring for each of 'n_rings' server threads, and one more for
+ * messages, which also gets what Libevent itself logs. */
+int access_log_start(const char *filename, int n_rings);
+
+/* Writes out whatever is left, and stops the writer thread.  Nothing may
+ * be logged any more after this. */
+void access_log_stop(void);
+
+/* Only the thread that owns ring 'ring' may call this. */
+void access_log_request(int ring, const struct timeval *when,
+	const char *method, const char *uri, int status, ev_int64_t bytes,
+	ev_uint32_t latency_us);
+
+/* Any thread can call this; with no log started, it goes to stderr. */
+void access_log_message(const char *fmt, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 1, 2)))
+#endif
+	;
+
+#endif
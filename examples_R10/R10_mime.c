@@ -0,0 +1,304 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "R10_mime.h"
+
+const struct mime_type mime_types_builtin[] = {
+	{"txt", "text/plain"},
+	{"c", "text/plain"},
+	{"h", "text/plain"},
+	{"html", "text/html"},
+	{"htm", "text/htm"},
+	{"css", "text/css"},
+	{"gif", "image/gif"},
+	{"jpg", "image/jpeg"},
+	{"jpeg", "image/jpeg"},
+	{"png", "image/png"},
+	{"pdf", "application/pdf"},
+	{"ps", "application/postscript"},
+	{NULL, NULL},
+};
+
+/* The table is a perfect hash ("hash and displace"): the extensions are
+ * spread over a few buckets, and each bucket gets a displacement that
+ * sends each of its extensions to a slot no other extension uses.  So a
+ * lookup costs two hashes and one string comparison, however many types
+ * we know about. */
+static struct {
+	struct mime_type *entries; /* while we are still loading */
+	unsigned n_entries, n_alloc;
+
+	struct mime_type *slots; /* n_slots of them, a power of two */
+	unsigned n_slots;
+	unsigned *displacements; /* one per bucket */
+	unsigned n_buckets;
+} mime_types;
+
+static unsigned
+mime_hash(const char *extension, unsigned seed)
+{
+	/* FNV-1a, followed by a finalizer so that the low bits depend on all
+	 * of the input */
+	unsigned h = 2166136261u ^ (seed * 0x9e3779b9u);
+	while (*extension) {
+		h ^= (unsigned char)*extension++;
+		h *= 16777619u;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+/* Frees a content type that mime_types_load() allocated, once no
+ * extension has it any more. */
+static void
+mime_types_release(const char *content_type)
+{
+	const struct mime_type *ent;
+	unsigned i;
+
+	for (i = 0; i < mime_types.n_entries; ++i) {
+		if (mime_types.entries[i].content_type == content_type)
+			return;
+	}
+	for (ent = &mime_types_builtin[0]; ent->extension; ++ent) {
+		if (ent->content_type == content_type)
+			return;
+	}
+	free((char *)content_type);
+}
+
+/* Add (or replace) the type for an extension.  The strings must stay
+ * around; extensions must be lowercase.  Returns 1 if the extension was
+ * already there, in which case the table keeps its own copy of it. */
+static int
+mime_types_add(const char *extension, const char *content_type)
+{
+	const char *old;
+	unsigned i;
+
+	for (i = 0; i < mime_types.n_entries; ++i) {
+		if (!strcmp(mime_types.entries[i].extension, extension)) {
+			old = mime_types.entries[i].content_type;
+			mime_types.entries[i].content_type = content_type;
+			mime_types_release(old);
+			return 1;
+		}
+	}
+	if (mime_types.n_entries == mime_types.n_alloc) {
+		unsigned n = mime_types.n_alloc ? mime_types.n_alloc * 2 : 64;
+		struct mime_type *p = realloc(mime_types.entries, n * sizeof(*p));
+		if (!p)
+			return -1;
+		mime_types.entries = p;
+		mime_types.n_alloc = n;
+	}
+	mime_types.entries[mime_types.n_entries].extension = extension;
+	mime_types.entries[mime_types.n_entries++].content_type = content_type;
+	return 0;
+}
+
+/* Load a file in the format of /etc/mime.types: a type on each line,
+ * followed by its extensions.  Returns -1 with errno set if the file
+ * can't be read, or if we run out of memory. */
+static int
+mime_types_load(const char *filename)
+{
+	char line[1024];
+	FILE *f;
+	int r = 0;
+
+	if (!(f = fopen(filename, "r")))
+		return -1;
+	while (r == 0 && fgets(line, sizeof(line), f)) {
+		char *save = NULL, *type, *ext;
+		bool used = false;
+
+		if (line[0] == '#')
+			continue;
+		if (!(type = strtok_r(line, " \t\r\n", &save)))
+			continue;
+		if (!(type = strdup(type))) {
+			r = -1;
+			break;
+		}
+		while ((ext = strtok_r(NULL, " \t\r\n", &save))) {
+			char *p;
+			int added;
+
+			if (!(ext = strdup(ext))) {
+				r = -1;
+				break;
+			}
+			for (p = ext; *p; ++p)
+				*p = tolower((unsigned char)*p);
+			if ((added = mime_types_add(ext, type)) != 0)
+				free(ext);
+			if (added < 0) {
+				r = -1;
+				break;
+			}
+			used = true;
+		}
+		/* A type with no extensions is no use to us. */
+		if (!used)
+			free(type);
+	}
+	fclose(f);
+	if (r < 0)
+		errno = ENOMEM;
+	return r;
+}
+
+/* Only used while sorting buckets by size in mime_types_build(). */
+static const unsigned *mime_bucket_start;
+
+static int
+mime_bucket_cmp(const void *a, const void *b)
+{
+	unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+	unsigned x_size = mime_bucket_start[x + 1] - mime_bucket_start[x];
+	unsigned y_size = mime_bucket_start[y + 1] - mime_bucket_start[y];
+
+	return (x_size < y_size) - (x_size > y_size);
+}
+
+/* Turn the entries we have loaded into the perfect hash table. */
+static int
+mime_types_build(void)
+{
+	unsigned n = mime_types.n_entries, n_buckets;
+	unsigned *start = NULL, *members = NULL, *order = NULL, *slot_of = NULL;
+	unsigned i, j, k, d;
+	int r = -1;
+
+	for (mime_types.n_slots = 16; mime_types.n_slots < n + n / 4;)
+		mime_types.n_slots *= 2;
+	n_buckets = mime_types.n_buckets = n / 4 + 1;
+	mime_types.slots = calloc(mime_types.n_slots, sizeof(struct mime_type));
+	mime_types.displacements = calloc(n_buckets, sizeof(unsigned));
+	start = calloc(n_buckets + 1, sizeof(unsigned));
+	members = calloc(n + 1, sizeof(unsigned));
+	order = calloc(n_buckets, sizeof(unsigned));
+	slot_of = calloc(n + 1, sizeof(unsigned));
+	if (!mime_types.slots || !mime_types.displacements || !start ||
+		!members || !order || !slot_of)
+		goto done;
+
+	/* Group the entries by bucket: bucket b has members[start[b]] up to
+	 * members[start[b + 1]]. */
+	for (i = 0; i < n; ++i) {
+		slot_of[i] =
+			mime_hash(mime_types.entries[i].extension, 0) % n_buckets;
+		++start[slot_of[i] + 1];
+	}
+	for (i = 0; i < n_buckets; ++i)
+		start[i + 1] += start[i];
+	for (i = 0; i < n; ++i)
+		members[order[slot_of[i]]++ + start[slot_of[i]]] = i;
+
+	/* Place the biggest buckets first, while there's the most room. */
+	for (i = 0; i < n_buckets; ++i)
+		order[i] = i;
+	mime_bucket_start = start;
+	qsort(order, n_buckets, sizeof(unsigned), mime_bucket_cmp);
+
+	for (i = 0; i < n_buckets; ++i) {
+		unsigned b = order[i];
+		unsigned first = start[b], last = start[b + 1];
+
+		/* Try displacements until every extension in the bucket lands on
+		 * a free slot, and on a different one from the others. */
+		for (d = 1; d < (1u << 20); ++d) {
+			for (j = first; j < last; ++j) {
+				unsigned slot =
+					mime_hash(mime_types.entries[members[j]].extension, d) &
+					(mime_types.n_slots - 1);
+				if (mime_types.slots[slot].extension)
+					break;
+				for (k = first; k < j && slot_of[k] != slot; ++k)
+					;
+				if (k < j)
+					break;
+				slot_of[j] = slot;
+			}
+			if (j == last)
+				break;
+		}
+		if (d == (1u << 20))
+			goto done;
+		mime_types.displacements[b] = d;
+		for (j = first; j < last; ++j)
+			mime_types.slots[slot_of[j]] = mime_types.entries[members[j]];
+	}
+	r = 0;
+
+done:
+	free(start);
+	free(members);
+	free(order);
+	free(slot_of);
+	free(mime_types.entries);
+	mime_types.entries = NULL;
+	return r;
+}
+
+int
+mime_types_init(const char *filename)
+{
+	const struct mime_type *ent;
+
+	if (mime_types_load(filename ? filename : "/etc/mime.types") < 0) {
+		if (errno == ENOMEM)
+			return -1;
+		if (filename)
+			fprintf(stderr,
+				"Couldn't read '%s'; using built-in types only\n", filename);
+	}
+	for (ent = &mime_types_builtin[0]; ent->extension; ++ent) {
+		if (mime_types_add(ent->extension, ent->content_type) < 0)
+			return -1;
+	}
+	return mime_types_build();
+}
+
+const char *
+mime_types_lookup(const char *extension)
+{
+	const struct mime_type *ent;
+	char lower[32];
+	unsigned bucket, slot;
+	size_t i, len;
+
+	if ((len = strlen(extension)) >= sizeof(lower) || !mime_types.n_slots)
+		return NULL;
+	for (i = 0; i <= len; ++i)
+		lower[i] = tolower((unsigned char)extension[i]);
+
+	bucket = mime_hash(lower, 0) % mime_types.n_buckets;
+	slot = mime_hash(lower, mime_types.displacements[bucket]) &
+		   (mime_types.n_slots - 1);
+	ent = &mime_types.slots[slot];
+	if (ent->extension && !strcmp(ent->extension, lower))
+		return ent->content_type;
+	return NULL;
+}
+
+void
+mime_types_foreach(
+	void (*cb)(const struct mime_type *type, void *arg), void *arg)
+{
+	unsigned i;
+
+	for (i = 0; i < mime_types.n_slots; ++i) {
+		if (mime_types.slots[i].extension)
+			cb(&mime_types.slots[i], arg);
+	}
+}
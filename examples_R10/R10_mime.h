@@ -0,0 +1,30 @@
+#ifndef R10_MIME_H_INCLUDED_
+#define R10_MIME_H_INCLUDED_
+
+/* Content types by file extension.  mime_types_init() loads them once, at
+ * startup, into a perfect hash; after that the table never changes, so
+ * any number of threads can look things up in it. */
+
+struct mime_type {
+	const char *extension; /* lowercase */
+	const char *content_type;
+};
+
+/* The types we know about without a mime.types file, ending with a NULL
+ * extension. */
+extern const struct mime_type mime_types_builtin[];
+
+/* Loads the mime.types file 'filename' (or /etc/mime.types, if there is
+ * one), adds mime_types_builtin, which has the last word, and builds the
+ * table.  A file that can't be read is complained about and skipped.
+ * Returns -1 if we ran out of memory. */
+int mime_types_init(const char *filename);
+
+/* Returns the content type for 'extension', in any case, or NULL. */
+const char *mime_types_lookup(const char *extension);
+
+/* Calls 'cb' for every type in the table, in no particular order. */
+void mime_types_foreach(
+	void (*cb)(const struct mime_type *type, void *arg), void *arg);
+
+#endif
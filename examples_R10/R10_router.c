@@ -0,0 +1,402 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <event2/http.h>
+
+#include "R10_router.h"
+
+/* evhttp_cmd_type has one bit per method. */
+#define ROUTER_N_METHODS 16
+
+/* A compressed radix tree: each node matches a run of literal text, and
+ * its literal children start with different bytes, so at most one of them
+ * can match.  A node can also have one child for a ":name" parameter and
+ * one for a "*name" catch-all, which are tried in that order when the
+ * literal child doesn't lead to a route. */
+struct route_node {
+	char *label; /* the literal text this node matches */
+	size_t label_len;
+	struct route_node **children;
+	int n_children;
+	struct route_node *param;
+	struct route_node *catchall;
+	char *name; /* of the parameter, for param and catchall nodes */
+	unsigned methods;
+	struct {
+		router_cb cb;
+		void *arg;
+	} handlers[ROUTER_N_METHODS];
+};
+
+struct router {
+	struct route_node *root;
+	void (*fallback)(struct evhttp_request *, void *);
+	void *fallback_arg;
+};
+
+static const struct {
+	unsigned method;
+	const char *name;
+} method_names[] = {
+	{EVHTTP_REQ_GET, "GET"},
+	{EVHTTP_REQ_HEAD, "HEAD"},
+	{EVHTTP_REQ_POST, "POST"},
+	{EVHTTP_REQ_PUT, "PUT"},
+	{EVHTTP_REQ_DELETE, "DELETE"},
+	{EVHTTP_REQ_OPTIONS, "OPTIONS"},
+	{EVHTTP_REQ_TRACE, "TRACE"},
+	{EVHTTP_REQ_CONNECT, "CONNECT"},
+	{EVHTTP_REQ_PATCH, "PATCH"},
+};
+
+static struct route_node *
+node_new(const char *label, size_t len)
+{
+	struct route_node *node;
+
+	if (!(node = calloc(1, sizeof(*node))))
+		return NULL;
+	if (!(node->label = malloc(len + 1))) {
+		free(node);
+		return NULL;
+	}
+	memcpy(node->label, label, len);
+	node->label[len] = '\0';
+	node->label_len = len;
+	return node;
+}
+
+static void
+node_free(struct route_node *node)
+{
+	int i;
+
+	if (!node)
+		return;
+	for (i = 0; i < node->n_children; ++i)
+		node_free(node->children[i]);
+	node_free(node->param);
+	node_free(node->catchall);
+	free(node->children);
+	free(node->label);
+	free(node->name);
+	free(node);
+}
+
+static struct route_node *
+node_find_child(const struct route_node *node, char first)
+{
+	int i;
+
+	for (i = 0; i < node->n_children; ++i) {
+		if (node->children[i]->label[0] == first)
+			return node->children[i];
+	}
+	return NULL;
+}
+
+static int
+node_add_child(struct route_node *node, struct route_node *child)
+{
+	struct route_node **children;
+
+	children = realloc(
+		node->children, (node->n_children + 1) * sizeof(*children));
+	if (!children)
+		return -1;
+	children[node->n_children++] = child;
+	node->children = children;
+	return 0;
+}
+
+/* Makes 'node' match only the first 'at' bytes of its label, with a new
+ * child for the rest that takes over everything below it. */
+static int
+node_split(struct route_node *node, size_t at)
+{
+	struct route_node *rest;
+
+	if (!(rest = node_new(node->label + at, node->label_len - at)))
+		return -1;
+	rest->children = node->children;
+	rest->n_children = node->n_children;
+	rest->param = node->param;
+	rest->catchall = node->catchall;
+	rest->methods = node->methods;
+	memcpy(rest->handlers, node->handlers, sizeof(rest->handlers));
+
+	if (!(node->children = malloc(sizeof(*node->children)))) {
+		node->children = rest->children;
+		rest->children = NULL;
+		rest->n_children = 0;
+		rest->param = rest->catchall = NULL;
+		node_free(rest);
+		return -1;
+	}
+	node->children[0] = rest;
+	node->n_children = 1;
+	node->param = node->catchall = NULL;
+	node->methods = 0;
+	memset(node->handlers, 0, sizeof(node->handlers));
+	node->label[at] = '\0';
+	node->label_len = at;
+	return 0;
+}
+
+struct router *
+router_new(void)
+{
+	struct router *router;
+
+	if (!(router = calloc(1, sizeof(*router))))
+		return NULL;
+	if (!(router->root = node_new("", 0))) {
+		free(router);
+		return NULL;
+	}
+	return router;
+}
+
+void
+router_free(struct router *router)
+{
+	node_free(router->root);
+	free(router);
+}
+
+int
+router_add(struct router *router, unsigned methods, const char *pattern,
+	router_cb cb, void *arg)
+{
+	struct route_node *node = router->root, *child, **slot;
+	const char *p = pattern;
+	size_t len, common;
+	int i;
+
+	while (*p) {
+		if (*p == ':' || *p == '*') {
+			/* A parameter: the rest of the segment, or of the path. */
+			len = *p == ':' ? strcspn(p + 1, "/") : strlen(p + 1);
+			if (len == 0 || (*p == '*' && strchr(p + 1, '/')))
+				return -1;
+			slot = *p == ':' ? &node->param : &node->catchall;
+			if (*slot) {
+				/* Both routes have to call it the same. */
+				if (strlen((*slot)->name) != len ||
+					memcmp((*slot)->name, p + 1, len))
+					return -1;
+			} else {
+				/* Name it before linking it in, so that a failure
+				 * leaves no nameless node behind. */
+				if (!(child = node_new("", 0)))
+					return -1;
+				if (!(child->name = strndup(p + 1, len))) {
+					node_free(child);
+					return -1;
+				}
+				*slot = child;
+			}
+			node = *slot;
+			p += 1 + len;
+			continue;
+		}
+
+		/* Literal text, up to the next parameter. */
+		len = strcspn(p, ":*");
+		while (len > 0) {
+			if (!(child = node_find_child(node, *p))) {
+				if (!(child = node_new(p, len)) ||
+					node_add_child(node, child) < 0) {
+					node_free(child);
+					return -1;
+				}
+				node = child;
+				p += len;
+				break;
+			}
+			for (common = 0; common < len && common < child->label_len &&
+							 p[common] == child->label[common];
+				 ++common)
+				;
+			if (common < child->label_len && node_split(child, common) < 0)
+				return -1;
+			node = child;
+			p += common;
+			len -= common;
+		}
+	}
+
+	for (i = 0; i < ROUTER_N_METHODS; ++i) {
+		if ((methods & (1u << i)) && node->handlers[i].cb)
+			return -1;
+	}
+	for (i = 0; i < ROUTER_N_METHODS; ++i) {
+		if (methods & (1u << i)) {
+			node->handlers[i].cb = cb;
+			node->handlers[i].arg = arg;
+		}
+	}
+	node->methods |= methods;
+	return 0;
+}
+
+void
+router_set_fallback(struct router *router,
+	void (*cb)(struct evhttp_request *, void *), void *arg)
+{
+	router->fallback = cb;
+	router->fallback_arg = arg;
+}
+
+const char *
+router_param(const struct router_params *params, const char *name, size_t *len)
+{
+	int i;
+
+	for (i = 0; i < params->n; ++i) {
+		if (!strcmp(params->p[i].name, name)) {
+			*len = params->p[i].len;
+			return params->p[i].value;
+		}
+	}
+	return NULL;
+}
+
+static void
+push_param(struct router_params *params, const struct route_node *node,
+	const char *value, size_t len)
+{
+	params->p[params->n].name = node->name;
+	params->p[params->n].value = value;
+	params->p[params->n].len = len;
+	++params->n;
+}
+
+/* Finds the node for the rest of a path, of which 'node' has matched
+ * everything before 'path'.  Literal text beats a parameter, and a
+ * parameter beats a catch-all. */
+static struct route_node *
+node_match(struct route_node *node, const char *path, size_t len,
+	struct router_params *params)
+{
+	struct route_node *child, *found;
+	size_t seg;
+	int n = params->n;
+
+	if (len == 0) {
+		if (node->methods)
+			return node;
+	} else if ((child = node_find_child(node, *path)) != NULL &&
+			   child->label_len <= len &&
+			   !memcmp(child->label, path, child->label_len)) {
+		found = node_match(
+			child, path + child->label_len, len - child->label_len, params);
+		if (found)
+			return found;
+	}
+
+	if (node->param && len > 0 && n < ROUTER_MAX_PARAMS) {
+		const char *slash = memchr(path, '/', len);
+		seg = slash ? (size_t)(slash - path) : len;
+		if (seg > 0) {
+			push_param(params, node->param, path, seg);
+			found = node_match(node->param, path + seg, len - seg, params);
+			if (found)
+				return found;
+			params->n = n;
+		}
+	}
+
+	if (node->catchall && node->catchall->methods && n < ROUTER_MAX_PARAMS) {
+		push_param(params, node->catchall, path, len);
+		return node->catchall;
+	}
+	return NULL;
+}
+
+const char *
+router_method_name(enum evhttp_cmd_type method)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(method_names) / sizeof(method_names[0]); ++i) {
+		if (method_names[i].method == method)
+			return method_names[i].name;
+	}
+	return "?";
+}
+
+/* Which of the node's handlers takes 'method', or -1 if none does. */
+static int
+node_handler(const struct route_node *node, unsigned method)
+{
+	if (method == EVHTTP_REQ_HEAD && !(node->methods & EVHTTP_REQ_HEAD))
+		method = EVHTTP_REQ_GET;
+	return node->methods & method ? ffs(method) - 1 : -1;
+}
+
+static void
+send_method_not_allowed(struct evhttp_request *req, unsigned methods)
+{
+	char allow[128] = "";
+	size_t i;
+
+	if (methods & EVHTTP_REQ_GET)
+		methods |= EVHTTP_REQ_HEAD;
+	for (i = 0; i < sizeof(method_names) / sizeof(method_names[0]); ++i) {
+		if (methods & method_names[i].method) {
+			if (allow[0])
+				strcat(allow, ", ");
+			strcat(allow, method_names[i].name);
+		}
+	}
+	/* Not evhttp_send_error(): that throws away our headers. */
+	evhttp_add_header(evhttp_request_get_output_headers(req), "Allow", allow);
+	evhttp_send_reply(req, 405, "Method Not Allowed", NULL);
+}
+
+void
+router_dispatch(struct evhttp_request *req, void *arg)
+{
+	struct router *router = arg;
+	struct router_params params;
+	struct route_node *node;
+	const char *path;
+	int i;
+
+	/* evhttp has already split up the URI, so this is no extra work. */
+	path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
+	if (!path || !*path)
+		path = "/";
+
+	params.n = 0;
+	if (!(node = node_match(router->root, path, strlen(path), &params))) {
+		if (router->fallback)
+			router->fallback(req, router->fallback_arg);
+		else
+			evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+		return;
+	}
+
+	if ((i = node_handler(node, evhttp_request_get_command(req))) < 0) {
+		send_method_not_allowed(req, node->methods);
+		return;
+	}
+	node->handlers[i].cb(req, &params, node->handlers[i].arg);
+}
+
+router_cb
+router_lookup(struct router *router, enum evhttp_cmd_type method,
+	const char *path, struct router_params *params, void **arg)
+{
+	struct route_node *node;
+	int i;
+
+	params->n = 0;
+	if (!(node = node_match(router->root, path, strlen(path), params)) ||
+		(i = node_handler(node, method)) < 0)
+		return NULL;
+	*arg = node->handlers[i].arg;
+	return node->handlers[i].cb;
+}
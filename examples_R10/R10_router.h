@@ -0,0 +1,64 @@
+#ifndef R10_ROUTER_H_INCLUDED_
+#define R10_ROUTER_H_INCLUDED_
+
+#include <stddef.h>
+#include <event2/http.h>
+
+/* A request router for evhttp.  Routes are patterns like "/users/:id", or
+ * a prefix followed by "*path", with a handler for each method;
+ * router_dispatch() goes into evhttp_set_gencb().  Looking up a request
+ * allocates nothing. */
+
+#define ROUTER_MAX_PARAMS 8
+
+struct router;
+
+/* The parts of the path that matched ":name" and "*name".  The values are
+ * still URI-encoded, and point into the request's URI, so they are good
+ * until the request is done. */
+struct router_params {
+	int n;
+	struct {
+		const char *name;
+		const char *value;
+		size_t len;
+	} p[ROUTER_MAX_PARAMS];
+};
+
+typedef void (*router_cb)(
+	struct evhttp_request *req, const struct router_params *params, void *arg);
+
+struct router *router_new(void);
+void router_free(struct router *router);
+
+/* Calls 'cb' for requests whose path matches 'pattern', for each method in
+ * 'methods' (EVHTTP_REQ_GET | EVHTTP_REQ_POST, and so on).  A GET handler
+ * also gets HEAD requests, unless HEAD has one of its own.  In 'pattern',
+ * ":name" matches one path segment, and "*name", which has to come last,
+ * matches the rest of the path.  Returns -1 if the route clashes with one
+ * we already have. */
+int router_add(struct router *router, unsigned methods, const char *pattern,
+	router_cb cb, void *arg);
+
+/* Requests that match no route go to 'cb'; without one, they get a 404. */
+void router_set_fallback(struct router *router,
+	void (*cb)(struct evhttp_request *, void *), void *arg);
+
+/* Returns the value of the parameter 'name' and sets *len, or returns
+ * NULL. */
+const char *router_param(
+	const struct router_params *params, const char *name, size_t *len);
+
+/* "GET" for EVHTTP_REQ_GET, and so on. */
+const char *router_method_name(enum evhttp_cmd_type method);
+
+/* The evhttp generic callback; 'arg' is the router. */
+void router_dispatch(struct evhttp_request *req, void *arg);
+
+/* Finds the route router_dispatch() would take for 'method' on 'path',
+ * which must not be empty.  Returns its handler and sets *arg and
+ * 'params', or returns NULL if no route takes the request. */
+router_cb router_lookup(struct router *router, enum evhttp_cmd_type method,
+	const char *path, struct router_params *params, void **arg);
+
+#endif
@@ -1,46 +1,75 @@
+#define _GNU_SOURCE /* for strptime(), timegm(), nftw() and CPU affinity */
+#include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include <event2/buffer.h>
+#include <event2/bufferevent.h>
 #include <event2/event.h>
 #include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+
+#include "R10_access_log.h"
+#include "R10_mime.h"
+#include "R10_router.h"
 
 #define BOOTSTRAP_CDN "https://cdn.jsdelivr.net/npm/bootstrap@5.1.3/dist"
 #define BOOTSTRAP_JS BOOTSTRAP_CDN "/js"
 #define BOOTSTRAP_CSS BOOTSTRAP_CDN "/css"
 
-static const struct table_entry {
-	const char *extension;
-	const char *content_type;
-} content_type_table[] = {
-	{"txt", "text/plain"},
-	{"c", "text/plain"},
-	{"h", "text/plain"},
-	{"html", "text/html"},
-	{"htm", "text/htm"},
-	{"css", "text/css"},
-	{"gif", "image/gif"},
-	{"jpg", "image/jpeg"},
-	{"jpeg", "image/jpeg"},
-	{"png", "image/png"},
-	{"pdf", "application/pdf"},
-	{"ps", "application/postscript"},
-	{NULL, NULL},
-};
+/* Number of hash buckets and maximum number of open files kept by the
+ * metadata cache. */
+#define FILE_CACHE_BUCKETS 1024
+#define FILE_CACHE_MAX_ENTRIES 4096
+/* Without inotify, re-stat() a cached file at most this often (seconds). */
+#define FILE_CACHE_REVALIDATE 1
+/* All the copies of small files together have to fit in this. */
+#define FILE_CACHE_MEMORY_BUDGET (64 * 1024 * 1024)
+/* How the contents of a file get to the client depends on its size; see
+ * "--copy-max" and "--mmap-max".  Over loopback, copies stopped paying off
+ * somewhere above 4k, and mmap() had nothing on sendfile() any more by
+ * 256k. */
+#define DELIVERY_COPY_MAX (4 * 1024)
+#define DELIVERY_MMAP_MAX (256 * 1024)
+/* Requests for more ranges than this get the whole file instead. */
+#define MAX_RANGES 16
+/* Directory listings are read this many entries at a time, and we stop
+ * reading while more than LISTING_WATERMARK bytes wait to be sent.
+ * Listings up to LISTING_CACHE_MAX_SIZE bytes are kept in the cache. */
+#define LISTING_BATCH 256
+#define LISTING_WATERMARK (64 * 1024)
+#define LISTING_CACHE_MAX_SIZE (1024 * 1024)
 
 static void
-add_content_length(struct evhttp_request *req, unsigned len)
+add_content_length(struct evhttp_request *req, ev_uint64_t len)
 {
 	char buf[128];
 
-	snprintf(buf, sizeof(buf), "%u", len);
+	snprintf(buf, sizeof(buf), "%llu", (unsigned long long)len);
 	evhttp_add_header(
 		evhttp_request_get_output_headers(req), "Content-Length", buf);
 }
@@ -83,248 +112,2824 @@ path_join(char *destination, const char *path1, const char *path2)
 static const char *
 guess_content_type(const char *path)
 {
-	const char *last_period, *extension;
-	const struct table_entry *ent;
+	const char *last_period, *type;
+
 	last_period = strrchr(path, '.');
 	if (!last_period || strchr(last_period, '/'))
 		goto not_found; /* no exension */
-	extension = last_period + 1;
-	for (ent = &content_type_table[0]; ent->extension; ++ent) {
-		if (!evutil_ascii_strcasecmp(ent->extension, extension))
-			return ent->content_type;
-	}
+	if ((type = mime_types_lookup(last_period + 1)) != NULL)
+		return type;
 
 not_found:
 	return "application/stream";
 }
 
+/* Precompressed variants of a file that we know how to serve: "foo.css.br"
+ * is sent for "foo.css" with "Content-Encoding: br", and so on.  With
+ * --precompress, the commands are run at startup to make any that are
+ * missing. */
+static const struct content_encoding {
+	const char *name;  /* in Accept-Encoding and Content-Encoding */
+	const char *alias; /* also accepted in Accept-Encoding */
+	const char *suffix;
+	const char *compress[6]; /* turns "foo" into "foo<suffix>" */
+} content_encodings[] = {
+	{"br", NULL, ".br", {"brotli", "-k", "-f", "-q", "11", NULL}},
+	{"zstd", NULL, ".zst", {"zstd", "-q", "-k", "-f", "-19", NULL}},
+	{"gzip", "x-gzip", ".gz", {"gzip", "-k", "-f", "-n", "-9", NULL}},
+};
+#define N_ENCODINGS (int)(sizeof(content_encodings) / sizeof(content_encodings[0]))
+
+static bool
+token_is(const char *start, const char *end, const char *word)
+{
+	size_t len = end - start;
+
+	return word && strlen(word) == len &&
+		   !evutil_ascii_strncasecmp(start, word, len);
+}
+
+/* Return the set of content_encodings that an Accept-Encoding header
+ * allows, as a bitmask. */
+static unsigned
+parse_accept_encoding(const char *value)
+{
+	unsigned accepted = 0, listed = 0;
+	bool star = false;
+	const char *p = value;
+	int i;
+
+	if (!p)
+		return 0;
+	while (*p) {
+		const char *name, *end;
+		bool refused = false;
+
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			++p;
+		name = p;
+		while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+			++p;
+		end = p;
+		/* Look for a "q=0" among the parameters. */
+		while (*p && *p != ',') {
+			if (*p == ';') {
+				++p;
+				while (*p == ' ' || *p == '\t')
+					++p;
+				if ((*p == 'q' || *p == 'Q') && p[1] == '=')
+					refused = strtod(p + 2, NULL) <= 0;
+			} else {
+				++p;
+			}
+		}
+		if (end == name)
+			continue;
+
+		if (end - name == 1 && *name == '*') {
+			star = !refused;
+			continue;
+		}
+		for (i = 0; i < N_ENCODINGS; ++i) {
+			if (token_is(name, end, content_encodings[i].name) ||
+				token_is(name, end, content_encodings[i].alias)) {
+				listed |= 1u << i;
+				if (!refused)
+					accepted |= 1u << i;
+			}
+		}
+	}
+	/* "*" covers everything that wasn't mentioned by name. */
+	if (star)
+		accepted |= ((1u << N_ENCODINGS) - 1) & ~listed;
+	return accepted;
+}
+
+/* For sending files of up to delivery.copy_max bytes, a copy of the file
+ * is cheapest: the body goes into the same write() as the headers, and
+ * there's no bookkeeping.  Up to delivery.mmap_max, we map the file
+ * instead, and every reply refers to the mapping.  Bigger files go out
+ * with sendfile().  (A mapped file that someone truncates while we're
+ * sending it kills us with SIGBUS, so replace files with rename() rather
+ * than rewriting them in place.) */
+static struct {
+	size_t copy_max;
+	size_t mmap_max;
+} delivery = {DELIVERY_COPY_MAX, DELIVERY_MMAP_MAX};
+
+/* The contents of a small file, shared by the cache and by every reply
+ * that is still sending it.  Like the huge_resource example in the evbuffer
+ * chapter, it goes away when the last reference is dropped.  Each server
+ * thread has its own cache, so the count needs no locking. */
+struct file_blob {
+	int reference_count;
+	size_t len;
+	char *data; /* points at buf, or at an mmap() of the file */
+	bool mapped;
+	char buf[];
+};
+
 static void
-send_file_to_user(struct evhttp_request *req, void *arg)
+file_blob_unref(struct file_blob *blob)
 {
-	struct evbuffer *evb = NULL;
-	struct evhttp_uri *decoded = NULL;
+	if (--blob->reference_count == 0) {
+		if (blob->mapped)
+			munmap(blob->data, blob->len);
+		free(blob);
+	}
+}
+
+static void
+file_blob_cleanup(const void *data, size_t len, void *arg)
+{
+	file_blob_unref(arg);
+}
+
+/* Everything we learned about a request path the last time we resolved it:
+ * the file it maps to, its metadata, how to label it, and an open file
+ * segment we can hand to evbuffer_add_file_segment() over and over. */
+struct file_cache_entry {
+	LIST_ENTRY(file_cache_entry) hash_next;
+	TAILQ_ENTRY(file_cache_entry) lru_next;
+	char *key;		 /* decoded request path */
+	char *real_path; /* what realpath() gave us */
 	struct stat st;
-	int fd = -1;
-	const char *static_dir = ".";
+	const char *content_type;
+	const char *encoding; /* Content-Encoding, or NULL */
+	/* Which precompressed variants existed, and which of them the client
+	 * accepted, when we picked this one.  See file_cache_lookup(). */
+	unsigned available, accepted;
+	bool directory;					   /* a rendered directory listing */
+	struct file_blob *blob;			   /* set for small and medium files */
+	const char *data;				   /* bundle files up to mmap_max */
+	struct evbuffer_file_segment *seg; /* set for everything else */
+	int wd;							   /* inotify watch on the parent dir */
+	time_t validated;
+	/* Validators for conditional requests, formatted once. */
+	char etag[64];
+	char last_modified[32];
+};
 
-	enum evhttp_cmd_type cmd = evhttp_request_get_command(req);
-	if (cmd != EVHTTP_REQ_GET && cmd != EVHTTP_REQ_HEAD) {
-		return;
-	}
+LIST_HEAD(file_cache_bucket, file_cache_entry);
+TAILQ_HEAD(file_cache_lru, file_cache_entry);
 
-	/* Decode the URI */
-	decoded = evhttp_uri_parse(evhttp_request_get_uri(req));
-	if (!decoded) {
-		evhttp_send_error(req, HTTP_BADREQUEST, 0);
-		return;
+struct file_cache {
+	struct event_base *base;
+	struct file_cache_bucket buckets[FILE_CACHE_BUCKETS];
+	struct file_cache_lru lru; /* most recently used first */
+	unsigned n_entries;
+	size_t blob_bytes; /* memory held by all the blobs */
+	unsigned long hits, misses, evictions;
+	int inotify_fd;
+	struct event *inotify_event;
+};
+
+static unsigned
+file_cache_hash(const char *key)
+{
+	/* FNV-1a */
+	unsigned h = 2166136261u;
+	while (*key) {
+		h ^= (unsigned char)*key++;
+		h *= 16777619u;
 	}
+	return h % FILE_CACHE_BUCKETS;
+}
 
-	/* Let's see what path the user asked for. */
-	const char *path = evhttp_uri_get_path(decoded);
-	if (!path)
-		path = "/";
+static void
+file_cache_entry_free(struct file_cache_entry *ent)
+{
+	if (ent->blob)
+		file_blob_unref(ent->blob);
+	/* Replies that are still being sent hold their own reference to the
+	 * segment, so the file stays open until the last of them is done. */
+	if (ent->seg)
+		evbuffer_file_segment_free(ent->seg);
+	free(ent->key);
+	free(ent->real_path);
+	free(ent);
+}
 
-	/* We need to decode it, to see what path the user really wanted. */
-	char *decoded_path = evhttp_uridecode(path, 0, NULL);
-	if (decoded_path == NULL)
-		goto err;
+static void
+file_cache_remove(struct file_cache *cache, struct file_cache_entry *ent)
+{
+	LIST_REMOVE(ent, hash_next);
+	TAILQ_REMOVE(&cache->lru, ent, lru_next);
+	--cache->n_entries;
 
-	/* Don't allow any ".."s in the path, to avoid exposing stuff outside
-	 * of the docroot.  This test is both overzealous and underzealous:
-	 * it forbids aceptable paths like "/this/one..here", but it doesn't
-	 * do anything to prevent symlink following." */
-	if (strstr(decoded_path, ".."))
-		goto err;
+	if (ent->blob && !ent->blob->mapped)
+		cache->blob_bytes -= ent->blob->len;
+	file_cache_entry_free(ent);
+}
 
-	char whole_path[PATH_MAX] = {0};
-	const char *type = NULL;
-	path_join(whole_path, static_dir, decoded_path);
-	char *real_file = realpath(whole_path, NULL);
-	if (real_file) {
-		strncpy(whole_path, real_file, sizeof(whole_path));
-		free(real_file);
-	} else {
-		/* check also if is there gz-ready static version */
-		type = guess_content_type(whole_path);
-
-		char gz_path[PATH_MAX + 3] = {0};
-		snprintf(gz_path, sizeof(gz_path), "%s.gz", whole_path);
-		char *real_file = realpath(gz_path, NULL);
-		if (real_file) {
-			evhttp_add_header(evhttp_request_get_output_headers(req),
-				"Content-Encoding", "gzip");
-			strncpy(whole_path, real_file, sizeof(whole_path));
-			free(real_file);
-		} else {
-			fprintf(stderr, "File '%s' not found\n", whole_path);
-			evhttp_send_error(req, HTTP_NOTFOUND, NULL);
-			goto done;
+static void
+file_cache_flush(struct file_cache *cache)
+{
+	while (!TAILQ_EMPTY(&cache->lru))
+		file_cache_remove(cache, TAILQ_FIRST(&cache->lru));
+}
+
+#ifdef __linux__
+static void
+file_cache_inotify_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct file_cache *cache = arg;
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		char *p;
+		for (p = buf; p < buf + n;) {
+			const struct inotify_event *ev = (void *)p;
+			struct file_cache_entry *ent, *next;
+
+			p += sizeof(struct inotify_event) + ev->len;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				file_cache_flush(cache);
+				continue;
+			}
+			/* Something in a directory changed: forget everything we
+			 * know about files in it.  This also catches "foo" showing
+			 * up next to a "foo.gz" we have been serving. */
+			for (ent = TAILQ_FIRST(&cache->lru); ent; ent = next) {
+				next = TAILQ_NEXT(ent, lru_next);
+				if (ent->wd == ev->wd)
+					file_cache_remove(cache, ent);
+			}
 		}
 	}
+}
+#endif
 
-	if (stat(whole_path, &st) < 0) {
-		goto err;
+static struct file_cache *
+file_cache_new(struct event_base *base)
+{
+	struct file_cache *cache;
+	int i;
+
+	if (!(cache = calloc(1, sizeof(*cache))))
+		return NULL;
+	cache->base = base;
+	for (i = 0; i < FILE_CACHE_BUCKETS; ++i)
+		LIST_INIT(&cache->buckets[i]);
+	TAILQ_INIT(&cache->lru);
+	cache->inotify_fd = -1;
+
+#ifdef __linux__
+	cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (cache->inotify_fd >= 0) {
+		cache->inotify_event = event_new(base, cache->inotify_fd,
+			EV_READ | EV_PERSIST, file_cache_inotify_cb, cache);
+		event_add(cache->inotify_event, NULL);
+	} else {
+		perror("inotify_init1");
 	}
+#endif
+	return cache;
+}
 
-	if ((evb = evbuffer_new()) == NULL) {
-		evhttp_send_error(req, HTTP_INTERNAL, 0);
-		goto cleanup;
+static void
+file_cache_free(struct file_cache *cache)
+{
+	file_cache_flush(cache);
+	if (cache->inotify_event)
+		event_free(cache->inotify_event);
+	if (cache->inotify_fd >= 0)
+		close(cache->inotify_fd);
+	free(cache);
+}
+
+static void
+file_cache_format_stats(struct file_cache *cache, struct evbuffer *out)
+{
+	evbuffer_add_printf(out,
+		"file cache: %lu hits, %lu misses, %lu evictions, "
+		"%u entries, %zu/%u bytes in memory\n",
+		cache->hits, cache->misses, cache->evictions, cache->n_entries,
+		cache->blob_bytes, FILE_CACHE_MEMORY_BUDGET);
+}
+
+static void
+file_cache_print_stats(struct file_cache *cache)
+{
+	struct evbuffer *out;
+
+	if (!(out = evbuffer_new()))
+		return;
+	file_cache_format_stats(cache, out);
+	evbuffer_write(out, STDOUT_FILENO);
+	evbuffer_free(out);
+}
+
+/* Return the cached entry for "key" that suits a client accepting the
+ * "encodings", or NULL if we have to go to the filesystem. */
+static struct file_cache_entry *
+file_cache_lookup(
+	struct file_cache *cache, const char *key, unsigned encodings)
+{
+	struct file_cache_bucket *bucket =
+		&cache->buckets[file_cache_hash(key)];
+	struct file_cache_entry *ent;
+
+	/* A path can have one entry for each set of precompressed variants a
+	 * client might accept.  For a file without variants, any client will
+	 * do. */
+	LIST_FOREACH(ent, bucket, hash_next) {
+		if (!strcmp(ent->key, key) &&
+			(encodings & ent->available) == ent->accepted)
+			break;
+	}
+	if (!ent) {
+		++cache->misses;
+		return NULL;
 	}
 
-	bool dir_mode = false;
+	if (ent->wd < 0) {
+		/* No inotify: fall back to checking the mtime now and then. */
+		struct timeval now;
+		struct stat st;
 
-	if (S_ISDIR(st.st_mode)) {
-		/* Check if there is index.html file */
-		char index_file[PATH_MAX + 11];
-		snprintf(index_file, sizeof(index_file), "%s/index.html", whole_path);
+		event_base_gettimeofday_cached(cache->base, &now);
+		if (now.tv_sec - ent->validated >= FILE_CACHE_REVALIDATE) {
+			if (stat(ent->real_path, &st) < 0 ||
+				st.st_mtime != ent->st.st_mtime ||
+				st.st_size != ent->st.st_size ||
+				st.st_ino != ent->st.st_ino) {
+				file_cache_remove(cache, ent);
+				++cache->misses;
+				return NULL;
+			}
+			ent->validated = now.tv_sec;
+		}
+	}
 
-		if (stat(index_file, &st) < 0)
-			dir_mode = true;
-		else
-			strcpy(whole_path, index_file);
+	++cache->hits;
+	TAILQ_REMOVE(&cache->lru, ent, lru_next);
+	TAILQ_INSERT_HEAD(&cache->lru, ent, lru_next);
+	return ent;
+}
+
+static void
+format_http_date(char *buf, size_t buflen, time_t t)
+{
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	strftime(buf, buflen, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/* Allocate a blob with room for "len" bytes, not yet filled in, or return
+ * NULL. */
+static struct file_blob *
+file_blob_new(size_t len)
+{
+	struct file_blob *blob;
+
+	if (!(blob = malloc(sizeof(*blob) + len)))
+		return NULL;
+	blob->reference_count = 1;
+	blob->len = len;
+	blob->data = blob->buf;
+	blob->mapped = false;
+	return blob;
+}
+
+/* Read all "len" bytes of "fd" into a new blob, or return NULL. */
+static struct file_blob *
+file_blob_load(int fd, size_t len)
+{
+	struct file_blob *blob;
+	size_t got = 0;
+
+	if (!(blob = file_blob_new(len)))
+		return NULL;
+	while (got < len) {
+		ssize_t n = pread(fd, blob->data + got, len - got, got);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			free(blob);
+			return NULL;
+		}
+		got += n;
+	}
+	return blob;
+}
+
+/* Map the first "len" bytes of "fd" into a new blob, or return NULL.  The
+ * mapping lasts until the last reference goes, even if "fd" is closed. */
+static struct file_blob *
+file_blob_map(int fd, size_t len)
+{
+	struct file_blob *blob;
+	void *map;
+
+	if ((map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		return NULL;
+	if (!(blob = malloc(sizeof(*blob)))) {
+		munmap(map, len);
+		return NULL;
 	}
+	blob->reference_count = 1;
+	blob->len = len;
+	blob->data = map;
+	blob->mapped = true;
+	return blob;
+}
+
+/* Fill in the ETag and Last-Modified header values from ent->st. */
+static void
+file_cache_entry_set_validators(struct file_cache_entry *ent)
+{
+	/* The ETag changes whenever the file is replaced (new inode), grows or
+	 * shrinks, or is modified in place (new mtime). */
+	snprintf(ent->etag, sizeof(ent->etag), "\"%llx-%llx-%llx\"",
+		(unsigned long long)ent->st.st_ino, (unsigned long long)ent->st.st_size,
+		(unsigned long long)ent->st.st_mtime);
+	format_http_date(
+		ent->last_modified, sizeof(ent->last_modified), ent->st.st_mtime);
+}
+
+/* Make a cache entry for "real_path", without its contents. */
+static struct file_cache_entry *
+file_cache_entry_alloc(const char *key, const char *real_path,
+	const struct stat *st, const char *content_type, const char *encoding)
+{
+	struct file_cache_entry *ent;
 
-	if (dir_mode) {
-		DIR *d;
-		struct dirent *ent;
+	if (!(ent = calloc(1, sizeof(*ent))))
+		return NULL;
+	ent->key = strdup(key);
+	ent->real_path = strdup(real_path);
+	if (!ent->key || !ent->real_path) {
+		free(ent->key);
+		free(ent->real_path);
+		free(ent);
+		return NULL;
+	}
+	ent->st = *st;
+	ent->content_type = content_type;
+	ent->encoding = encoding;
+	ent->wd = -1;
+	file_cache_entry_set_validators(ent);
+	return ent;
+}
 
-		const char *trailing_slash = "";
+/* Open "real_path" (whose metadata is "st") so that it can be served for
+ * "key".  Small files are read into memory right away; bigger ones are
+ * kept open for sendfile.  This does blocking I/O, so it runs on the
+ * filesystem threads; file_cache_insert() then hands the result to the
+ * cache.  Returns NULL and sets errno if the file can't be opened. */
+static struct file_cache_entry *
+file_cache_entry_new(const char *key, const char *real_path,
+	const struct stat *st, const char *content_type, const char *encoding)
+{
+	struct file_cache_entry *ent;
+	int fd = -1;
 
-		if (!strlen(path) || path[strlen(path) - 1] != '/')
-			trailing_slash = "/";
-		if (!(d = opendir(whole_path))) {
+	if (!(ent = file_cache_entry_alloc(
+			  key, real_path, st, content_type, encoding)))
+		return NULL;
+	if (st->st_size != 0) {
+		if ((fd = open(real_path, O_RDONLY | O_CLOEXEC)) == -1)
 			goto err;
+		if ((size_t)st->st_size <= delivery.copy_max)
+			ent->blob = file_blob_load(fd, st->st_size);
+		else if ((size_t)st->st_size <= delivery.mmap_max)
+			ent->blob = file_blob_map(fd, st->st_size);
+		if (ent->blob) {
+			close(fd);
+		} else {
+			ent->seg = evbuffer_file_segment_new(
+				fd, 0, st->st_size,
+				EVBUF_FS_CLOSE_ON_FREE | EVBUF_FS_DISABLE_LOCKING);
+			if (!ent->seg) {
+				close(fd);
+				goto err;
+			}
 		}
+	}
+	return ent;
 
-		evbuffer_add_printf(evb,
-			"<!DOCTYPE html>\n"
-			"<html lang=\"en\">"
-			"<head>\n"
-			"<meta name=\"viewport\" "
-			"content=\"width=device-width,initial-scale=1\">\n"
-			"<title>%s</title>\n"
-			"<link rel=\"shortcut icon\" href=\"/favicon.png\">\n"
-			"<link rel=\"stylesheet\" href=\"" BOOTSTRAP_CSS
-			"/bootstrap.min.css\">\n"
-			"<script src=\"" BOOTSTRAP_JS
-			"/bootstrap.bundle.min.js\"></script>\n"
-			"<base href='%s%s'>\n"
-			"</head>\n"
-			"<body id=\"top\">\n"
-			"<nav class=\"navbar navbar-expand-lg navbar-dark sticky-top\">\n"
-			"<div class=\"container\">\n"
-			"</div>\n"
-			"</nav>\n"
-			"<main>\n"
-			"<div class=\"container p-3\">\n"
-			"<h2>%s</h2>\n"
-			"<ul class=\"list-unstyled my-3\">\n",
-			decoded_path, /* XXX html-escape this. */
-			path,		  /* XXX html-escape this? */
-			trailing_slash, decoded_path /* XXX html-escape this */);
-		while ((ent = readdir(d))) {
-			const char *name = ent->d_name;
-			// ignore '.' directory entries
-			if (strcmp(name, ".") == 0)
-				continue;
-			// show '..' only for subdirs
-			if (strcmp(path, "/") == 0 && strcmp(name, "..") == 0)
-				continue;
-			evbuffer_add_printf(evb, "<li><a href=\"%s\">%s</a>\n", name,
-				name); /* XXX escape this */
+err:
+	file_cache_entry_free(ent);
+	return NULL;
+}
+
+/* Remember "ent" under its key, replacing anything already there (two
+ * requests for the same file can miss at the same time).  Returns false,
+ * and leaves "ent" to the caller, if the file changed while we were
+ * reading it. */
+static bool
+file_cache_insert(struct file_cache *cache, struct file_cache_entry *ent)
+{
+	struct file_cache_bucket *bucket =
+		&cache->buckets[file_cache_hash(ent->key)];
+	struct file_cache_entry *old;
+	struct timeval now;
+
+#ifdef __linux__
+	if (cache->inotify_fd >= 0) {
+		char dir[PATH_MAX];
+		char *slash;
+		struct stat st;
+
+		/* A listing depends on the directory itself; a file on the
+		 * directory it is in. */
+		snprintf(dir, sizeof(dir), "%s", ent->real_path);
+		if (!ent->directory && (slash = strrchr(dir, DIR_SEPARATOR)) != NULL)
+			*(slash == dir ? slash + 1 : slash) = '\0';
+		ent->wd = inotify_add_watch(cache->inotify_fd, dir,
+			IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+				IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |
+				IN_MOVE_SELF);
+		/* The watch only tells us about changes from now on, and the
+		 * file could have been replaced since we stat()ed it on the
+		 * filesystem thread.  If it was, this reply can still use what
+		 * we read, but the cache mustn't keep it. */
+		if (ent->wd >= 0 &&
+			(stat(ent->real_path, &st) < 0 || st.st_ino != ent->st.st_ino ||
+				st.st_size != ent->st.st_size ||
+				st.st_mtim.tv_sec != ent->st.st_mtim.tv_sec ||
+				st.st_mtim.tv_nsec != ent->st.st_mtim.tv_nsec))
+			return false;
+	}
+#endif
+
+	LIST_FOREACH(old, bucket, hash_next) {
+		if (!strcmp(old->key, ent->key) && old->accepted == ent->accepted) {
+			file_cache_remove(cache, old);
+			break;
 		}
-		evbuffer_add_printf(evb, "</ul>"
-								 "</div>\n"
-								 "</main>\n"
-								 "<footer class=\"p-3\">\n"
-								 "<div class=\"container\">\n"
-								 "</div>\n"
-								 "</footer>\n"
-								 "</body>"
-								 "</html>\n");
-		closedir(d);
+	}
 
-		add_content_length(req, evbuffer_get_length(evb));
-		if (cmd == EVHTTP_REQ_HEAD)
-			evbuffer_drain(evb, evbuffer_get_length(evb));
-		evhttp_add_header(evhttp_request_get_output_headers(req),
-			"Content-Type", "text/html");
-	} else {
-		/* Otherwise it's a file; add it to the buffer to get
-		 * sent via sendfile */
-		if (type == NULL)
-			type = guess_content_type(whole_path);
-		evhttp_add_header(
-			evhttp_request_get_output_headers(req), "Content-Type", type);
-
-		if (st.st_size != 0) {
-			if ((fd = open(whole_path, O_RDONLY)) == -1) {
-				if (errno == ENOENT) {
-					fprintf(stderr, "File '%s' not found\n", whole_path);
-					evhttp_send_error(req, HTTP_NOTFOUND, NULL);
-				} else {
-					evhttp_send_error(req, HTTP_INTERNAL, NULL);
-				}
-				goto done;
+	event_base_gettimeofday_cached(cache->base, &now);
+	ent->validated = now.tv_sec;
+
+	/* Make room by throwing away whatever was used least recently. */
+	if (ent->blob && !ent->blob->mapped)
+		cache->blob_bytes += ent->blob->len;
+	while (!TAILQ_EMPTY(&cache->lru) &&
+		   (cache->n_entries >= FILE_CACHE_MAX_ENTRIES ||
+			   cache->blob_bytes > FILE_CACHE_MEMORY_BUDGET)) {
+		file_cache_remove(cache, TAILQ_LAST(&cache->lru, file_cache_lru));
+		++cache->evictions;
+	}
+	LIST_INSERT_HEAD(bucket, ent, hash_next);
+	TAILQ_INSERT_HEAD(&cache->lru, ent, lru_next);
+	++cache->n_entries;
+	return true;
+}
+
+/* Append "len" bytes of the cached file, starting at "offset", to "evb".
+ * If the contents are in memory and "len" is at most delivery.copy_max,
+ * they are copied; otherwise "evb" gets a reference to the blob or to the
+ * bundle's mapping.  A file we don't keep in memory goes in as a piece of
+ * its file segment, for sendfile(). */
+static int
+add_file_range(struct evbuffer *evb, struct file_cache_entry *cached,
+	ev_off_t offset, ev_off_t len)
+{
+	const char *data = cached->blob ? cached->blob->data : cached->data;
+
+	if (len == 0)
+		return 0;
+	if (data && (size_t)len <= delivery.copy_max)
+		return evbuffer_add(evb, data + offset, len);
+	if (cached->blob) {
+		++cached->blob->reference_count;
+		if (evbuffer_add_reference(evb, cached->blob->data + offset, len,
+				file_blob_cleanup, cached->blob) != 0) {
+			file_blob_unref(cached->blob);
+			return -1;
+		}
+		return 0;
+	}
+	if (cached->data) {
+		/* The bundle stays mapped until we exit: nothing to clean up. */
+		return evbuffer_add_reference(
+			evb, cached->data + offset, len, NULL, NULL);
+	}
+	return evbuffer_add_file_segment(evb, cached->seg, offset, len);
+}
+
+struct byte_range {
+	ev_off_t offset;
+	ev_off_t len;
+};
+
+/* Parse the value of a Range header for a file of "size" bytes into at
+ * most "max" ranges.  Returns the number of ranges found, 0 if the header
+ * is malformed (or asks for too much) and should be ignored, or -1 if
+ * none of the ranges overlap the file. */
+static int
+parse_range_header(
+	const char *value, ev_off_t size, struct byte_range *ranges, int max)
+{
+	const char *p = value;
+	int n = 0;
+	bool any = false;
+
+	while (*p == ' ' || *p == '\t')
+		++p;
+	if (evutil_ascii_strncasecmp(p, "bytes=", 6))
+		return 0;
+	p += 6;
+
+	for (;;) {
+		ev_int64_t first = -1, last = -1;
+		char *end;
+
+		while (*p == ' ' || *p == '\t')
+			++p;
+		if (*p == '-') {
+			/* "-N": the last N bytes */
+			if (!isdigit((unsigned char)p[1]))
+				return 0;
+			last = evutil_strtoll(p + 1, &end, 10);
+			p = end;
+		} else if (isdigit((unsigned char)*p)) {
+			first = evutil_strtoll(p, &end, 10);
+			p = end;
+			if (*p++ != '-')
+				return 0;
+			if (isdigit((unsigned char)*p)) {
+				last = evutil_strtoll(p, &end, 10);
+				p = end;
+				if (last < first)
+					return 0;
 			}
-			if (cmd != EVHTTP_REQ_HEAD) {
-				if (evbuffer_add_file(evb, fd, 0, st.st_size) != 0) {
-					evhttp_send_error(req, HTTP_INTERNAL, NULL);
-					goto cleanup;
-				}
+		} else {
+			return 0;
+		}
+		any = true;
+
+		if (first < 0) {
+			/* suffix range */
+			if (last > 0 && size > 0) {
+				if (last > size)
+					last = size;
+				if (n == max)
+					return 0;
+				ranges[n].offset = size - last;
+				ranges[n++].len = last;
 			}
+		} else if (first < size) {
+			if (last < 0 || last >= size)
+				last = size - 1;
+			if (n == max)
+				return 0;
+			ranges[n].offset = first;
+			ranges[n++].len = last - first + 1;
 		}
-		add_content_length(req, st.st_size);
+
+		while (*p == ' ' || *p == '\t')
+			++p;
+		if (*p == '\0')
+			break;
+		if (*p++ != ',')
+			return 0;
 	}
-	evhttp_send_reply(req, HTTP_OK, "OK", evb);
+	return any && n == 0 ? -1 : n;
+}
 
-	goto done;
+/* If-Range makes the Range header conditional: if the file has changed
+ * since the client got its first piece, it must get the whole thing.  An
+ * entity tag has to match exactly; weak tags never match. */
+static bool
+if_range_matches(const char *if_range, struct file_cache_entry *cached)
+{
+	if (!if_range)
+		return true;
+	if (*if_range == '"')
+		return !strcmp(if_range, cached->etag);
+	return !strcmp(if_range, cached->last_modified);
+}
 
-err:
-	evhttp_send_error(req, HTTP_NOTFOUND, NULL);
-cleanup:
-	if (fd >= 0)
-		close(fd);
+/* Does any tag in the If-None-Match list "list" match "etag"?  This is the
+ * weak comparison, so W/"x" matches "x". */
+static bool
+etag_list_matches(const char *list, const char *etag)
+{
+	size_t len = strlen(etag);
+	const char *p = list;
 
-done:
-	if (decoded)
-		evhttp_uri_free(decoded);
-	if (decoded_path)
-		free(decoded_path);
-	if (evb)
-		evbuffer_free(evb);
+	for (;;) {
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			++p;
+		if (*p == '\0')
+			return false;
+		if (*p == '*')
+			return true;
+		if (!strncmp(p, "W/", 2))
+			p += 2;
+		if (!strncmp(p, etag, len) &&
+			(p[len] == '\0' || p[len] == ',' || p[len] == ' ' ||
+				p[len] == '\t'))
+			return true;
+		while (*p && *p != ',')
+			++p;
+	}
 }
 
-static void
-signal_cb(evutil_socket_t fd, short event, void *arg)
+/* Can we answer this request with "304 Not Modified"?  If-None-Match
+ * wins over If-Modified-Since when the client sends both. */
+static bool
+not_modified(struct evkeyvalq *in_headers, struct file_cache_entry *cached)
 {
-	printf("%s signal received\n", strsignal(fd));
-	event_base_loopbreak(arg);
+	const char *value;
+	struct tm tm;
+
+	if ((value = evhttp_find_header(in_headers, "If-None-Match")) != NULL)
+		return etag_list_matches(value, cached->etag);
+	if ((value = evhttp_find_header(in_headers, "If-Modified-Since")) == NULL)
+		return false;
+	/* Browsers send back exactly what we gave them. */
+	if (!strcmp(value, cached->last_modified))
+		return true;
+	memset(&tm, 0, sizeof(tm));
+	if (!strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+		return false;
+	return cached->st.st_mtime <= timegm(&tm);
 }
 
-int
-main()
+static void
+send_cached_file(struct evhttp_request *req, struct file_cache_entry *cached,
+	struct evbuffer *evb)
 {
-	ev_uint16_t http_port = 8080;
-	char *http_addr = "0.0.0.0";
-	struct event_base *base;
-	struct evhttp *http_server;
-	struct event *sig_int;
+	struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
+	struct evkeyvalq *in_headers = evhttp_request_get_input_headers(req);
+	struct byte_range ranges[MAX_RANGES];
+	ev_off_t size = cached->blob ? (ev_off_t)cached->blob->len
+								 : cached->st.st_size;
+	const char *range;
+	char buf[128];
+	int n_ranges = 0;
+	int i;
 
-	base = event_base_new();
+	evhttp_add_header(headers, "ETag", cached->etag);
+	evhttp_add_header(headers, "Last-Modified", cached->last_modified);
+	/* A 304 has to say which variant it is about, just like the 200. */
+	if (cached->encoding)
+		evhttp_add_header(headers, "Content-Encoding", cached->encoding);
+	if (cached->available)
+		evhttp_add_header(headers, "Vary", "Accept-Encoding");
+	if (not_modified(in_headers, cached)) {
+		/* The client's copy is still good: no body, and no need to touch
+		 * the file at all. */
+		evhttp_send_reply(req, 304, "Not Modified", NULL);
+		return;
+	}
 
-	http_server = evhttp_new(base);
-	evhttp_bind_socket(http_server, http_addr, http_port);
-	evhttp_set_gencb(http_server, send_file_to_user, NULL);
+	evhttp_add_header(headers, "Accept-Ranges", "bytes");
 
-	sig_int = evsignal_new(base, SIGINT, signal_cb, base);
-	event_add(sig_int, NULL);
+	if (evhttp_request_get_command(req) == EVHTTP_REQ_GET &&
+		(range = evhttp_find_header(in_headers, "Range")) != NULL &&
+		if_range_matches(evhttp_find_header(in_headers, "If-Range"), cached))
+		n_ranges = parse_range_header(range, size, ranges, MAX_RANGES);
+
+	if (n_ranges < 0) {
+		snprintf(buf, sizeof(buf), "bytes */%lld", (long long)size);
+		evhttp_add_header(headers, "Content-Range", buf);
+		add_content_length(req, 0);
+		evhttp_send_reply(req, 416, "Range Not Satisfiable", evb);
+		return;
+	}
+
+	if (n_ranges == 0) {
+		/* The whole file. */
+		evhttp_add_header(headers, "Content-Type", cached->content_type);
+		if (evhttp_request_get_command(req) != EVHTTP_REQ_HEAD &&
+			add_file_range(evb, cached, 0, size) != 0) {
+			evhttp_send_error(req, HTTP_INTERNAL, NULL);
+			return;
+		}
+		add_content_length(req, size);
+		evhttp_send_reply(req, HTTP_OK, "OK", evb);
+		return;
+	}
+
+	if (n_ranges == 1) {
+		evhttp_add_header(headers, "Content-Type", cached->content_type);
+		snprintf(buf, sizeof(buf), "bytes %lld-%lld/%lld",
+			(long long)ranges[0].offset,
+			(long long)(ranges[0].offset + ranges[0].len - 1), (long long)size);
+		evhttp_add_header(headers, "Content-Range", buf);
+	} else {
+		/* Several ranges: each one becomes a part of a multipart/byteranges
+		 * body, and goes in the way add_file_range() would add any other
+		 * piece of the file. */
+		unsigned char rnd[8];
+		char boundary[sizeof(rnd) * 2 + 1];
+
+		evutil_secure_rng_get_bytes(rnd, sizeof(rnd));
+		for (i = 0; i < (int)sizeof(rnd); ++i)
+			snprintf(boundary + i * 2, 3, "%02x", rnd[i]);
+		snprintf(buf, sizeof(buf), "multipart/byteranges; boundary=%s",
+			boundary);
+		evhttp_add_header(headers, "Content-Type", buf);
+
+		for (i = 0; i < n_ranges; ++i) {
+			evbuffer_add_printf(evb,
+				"%s--%s\r\n"
+				"Content-Type: %s\r\n"
+				"Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+				i ? "\r\n" : "", boundary, cached->content_type,
+				(long long)ranges[i].offset,
+				(long long)(ranges[i].offset + ranges[i].len - 1),
+				(long long)size);
+			if (add_file_range(evb, cached, ranges[i].offset, ranges[i].len)) {
+				evhttp_send_error(req, HTTP_INTERNAL, NULL);
+				return;
+			}
+		}
+		evbuffer_add_printf(evb, "\r\n--%s--\r\n", boundary);
+		add_content_length(req, evbuffer_get_length(evb));
+		evhttp_send_reply(req, 206, "Partial Content", evb);
+		return;
+	}
+
+	if (add_file_range(evb, cached, ranges[0].offset, ranges[0].len) != 0) {
+		evhttp_send_error(req, HTTP_INTERNAL, NULL);
+		return;
+	}
+	add_content_length(req, ranges[0].len);
+	evhttp_send_reply(req, 206, "Partial Content", evb);
+}
+
+/* Is a file of this type worth compressing?  Images and the like already
+ * are compressed. */
+static bool
+is_compressible(const char *content_type)
+{
+	return !strncmp(content_type, "text/", 5) ||
+		   !strcmp(content_type, "application/postscript") ||
+		   !strcmp(content_type, "application/javascript") ||
+		   !strcmp(content_type, "application/json") ||
+		   !strcmp(content_type, "application/xml") ||
+		   !strcmp(content_type, "image/svg+xml");
+}
+
+/* Returns the index in content_encodings of the suffix that 'path' ends
+ * with, or -1 if it isn't a precompressed variant. */
+static int
+variant_encoding(const char *path)
+{
+	size_t len = strlen(path);
+	int i;
+
+	for (i = 0; i < N_ENCODINGS; ++i) {
+		const char *suffix = content_encodings[i].suffix;
+		size_t slen = strlen(suffix);
+		if (len > slen && !strcmp(path + len - slen, suffix))
+			return i;
+	}
+	return -1;
+}
+
+/* Encodings whose compressor turned out not to be installed. */
+static unsigned precompress_missing_tools;
+
+static int
+precompress_file(const char *path, const struct stat *st, int type,
+	struct FTW *ftw)
+{
+	char variant[PATH_MAX + 8];
+	struct stat vst;
+	int i, status;
+	pid_t pid;
+
+	if (type != FTW_F || !S_ISREG(st->st_mode) || st->st_size < 256)
+		return 0;
+	if (variant_encoding(path) >= 0)
+		return 0; /* this is a variant itself */
+	if (!is_compressible(guess_content_type(path)))
+		return 0;
+
+	for (i = 0; i < N_ENCODINGS; ++i) {
+		const char *const *cmd = content_encodings[i].compress;
+		const char *argv[8];
+		int n;
+
+		if (precompress_missing_tools & (1u << i))
+			continue;
+		snprintf(variant, sizeof(variant), "%s%s", path,
+			content_encodings[i].suffix);
+		if (stat(variant, &vst) == 0 && vst.st_mtime >= st->st_mtime)
+			continue;
+
+		for (n = 0; cmd[n]; ++n)
+			argv[n] = cmd[n];
+		argv[n++] = path;
+		argv[n] = NULL;
+		if ((pid = fork()) < 0)
+			return -1;
+		if (pid == 0) {
+			execvp(argv[0], (char *const *)argv);
+			_exit(127);
+		}
+		if (waitpid(pid, &status, 0) < 0)
+			return -1;
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+			fprintf(stderr, "%s not found; not making %s files\n", argv[0],
+				content_encodings[i].suffix);
+			precompress_missing_tools |= 1u << i;
+		} else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "Couldn't make '%s'\n", variant);
+		}
+	}
+	return 0;
+}
+
+/* Make any precompressed variants that are missing (or older than the
+ * file) under "dir".  This runs once, before we start serving. */
+static void
+precompress_tree(const char *dir)
+{
+	if (nftw(dir, precompress_file, 16, FTW_PHYS) < 0)
+		perror("nftw");
+}
+
+/* A bundle packs a whole docroot into one file that we map at startup, so
+ * serving a request from it never touches the filesystem at all: finding
+ * a file is a binary search over the index.  "--make-bundle" builds one.
+ * The layout, with numbers in host byte order:
+ *
+ *   struct bundle_header
+ *   struct bundle_file[n_files], sorted by name
+ *   the names ("/css/site.css"), each NUL-terminated
+ *   the file contents, each starting on a BUNDLE_ALIGN boundary
+ */
+#define BUNDLE_MAGIC "LEVBNDL1"
+#define BUNDLE_ALIGN 64
+
+struct bundle_header {
+	char magic[8];
+	ev_uint32_t n_files;
+	ev_uint32_t reserved;
+};
+
+struct bundle_file {
+	ev_uint64_t name;	/* offset of the name in the bundle */
+	ev_uint64_t offset; /* offset of the contents */
+	ev_uint64_t size;
+	ev_int64_t mtime;
+};
+
+static struct {
+	int fd;
+	const char *map;
+	size_t map_len;
+	const struct bundle_file *files;
+	ev_uint32_t n_files;
+	/* One entry for each file, made up front and shared by every server
+	 * thread; they never go into the per-thread caches. */
+	struct file_cache_entry *entries;
+} bundle = {-1, NULL, 0, NULL, 0, NULL};
+
+/* What --make-bundle found in the docroot. */
+static struct bundle_source {
+	char *name;
+	ev_uint64_t size;
+	ev_int64_t mtime;
+} *bundle_sources;
+static size_t n_bundle_sources, bundle_sources_alloc, bundle_root_len;
+
+static int
+bundle_add_source(
+	const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	struct bundle_source *src;
+
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+	if (n_bundle_sources == bundle_sources_alloc) {
+		size_t n = bundle_sources_alloc ? bundle_sources_alloc * 2 : 256;
+		if (!(src = realloc(bundle_sources, n * sizeof(*src))))
+			return -1;
+		bundle_sources = src;
+		bundle_sources_alloc = n;
+	}
+	src = &bundle_sources[n_bundle_sources];
+	if (!(src->name = strdup(path + bundle_root_len)))
+		return -1;
+	src->size = st->st_size;
+	src->mtime = st->st_mtime;
+	++n_bundle_sources;
+	return 0;
+}
+
+static int
+bundle_source_cmp(const void *a, const void *b)
+{
+	const struct bundle_source *sa = a, *sb = b;
+	return strcmp(sa->name, sb->name);
+}
+
+/* Copies exactly 'size' bytes of 'path' to 'out'. */
+static int
+bundle_copy_file(FILE *out, const char *path, ev_uint64_t size)
+{
+	char buf[16384];
+	FILE *in;
+	size_t n;
+
+	if (!(in = fopen(path, "rb")))
+		return -1;
+	while (size > 0) {
+		n = fread(buf, 1, size < sizeof(buf) ? size : sizeof(buf), in);
+		if (n == 0 || fwrite(buf, 1, n, out) != n)
+			break;
+		size -= n;
+	}
+	fclose(in);
+	return size == 0 ? 0 : -1;
+}
+
+static int
+make_bundle(const char *docroot, const char *filename)
+{
+	static const char zeros[BUNDLE_ALIGN];
+	struct bundle_header hdr;
+	struct bundle_file *index = NULL;
+	char tmp[PATH_MAX], path[PATH_MAX];
+	ev_uint64_t pos;
+	FILE *out = NULL;
+	size_t i;
+
+	/* Names are what a client asks for, relative to the docroot and with
+	 * a leading slash. */
+	bundle_root_len = strlen(docroot);
+	while (bundle_root_len > 0 && docroot[bundle_root_len - 1] == '/')
+		--bundle_root_len;
+	if (nftw(docroot, bundle_add_source, 16, FTW_PHYS) < 0) {
+		perror(docroot);
+		return -1;
+	}
+	if (n_bundle_sources > 0xffffffffu) {
+		fprintf(stderr, "Too many files in '%s'\n", docroot);
+		return -1;
+	}
+	qsort(bundle_sources, n_bundle_sources, sizeof(*bundle_sources),
+		bundle_source_cmp);
+
+	if (!(index = calloc(n_bundle_sources ? n_bundle_sources : 1,
+			  sizeof(*index))))
+		return -1;
+	pos = sizeof(hdr) + n_bundle_sources * sizeof(*index);
+	for (i = 0; i < n_bundle_sources; ++i) {
+		index[i].name = pos;
+		pos += strlen(bundle_sources[i].name) + 1;
+	}
+	for (i = 0; i < n_bundle_sources; ++i) {
+		pos = (pos + BUNDLE_ALIGN - 1) & ~(ev_uint64_t)(BUNDLE_ALIGN - 1);
+		index[i].offset = pos;
+		index[i].size = bundle_sources[i].size;
+		index[i].mtime = bundle_sources[i].mtime;
+		pos += bundle_sources[i].size;
+	}
+
+	/* Write it next to the real name, and rename it into place when it's
+	 * done, so that a running server never maps half a bundle. */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+	if (!(out = fopen(tmp, "wb")))
+		goto err;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, BUNDLE_MAGIC, sizeof(hdr.magic));
+	hdr.n_files = (ev_uint32_t)n_bundle_sources;
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+		fwrite(index, sizeof(*index), n_bundle_sources, out) !=
+			n_bundle_sources)
+		goto err;
+	pos = sizeof(hdr) + n_bundle_sources * sizeof(*index);
+	for (i = 0; i < n_bundle_sources; ++i) {
+		size_t len = strlen(bundle_sources[i].name) + 1;
+		if (fwrite(bundle_sources[i].name, 1, len, out) != len)
+			goto err;
+		pos += len;
+	}
+	for (i = 0; i < n_bundle_sources; ++i) {
+		size_t pad = index[i].offset - pos;
+		if (fwrite(zeros, 1, pad, out) != pad)
+			goto err;
+		snprintf(path, sizeof(path), "%.*s%s", (int)bundle_root_len, docroot,
+			bundle_sources[i].name);
+		if (bundle_copy_file(out, path, index[i].size) < 0) {
+			fprintf(stderr, "Couldn't copy '%s'\n", path);
+			goto err;
+		}
+		pos = index[i].offset + index[i].size;
+	}
+	if (fclose(out) != 0) {
+		out = NULL;
+		goto err;
+	}
+	out = NULL;
+	if (rename(tmp, filename) < 0)
+		goto err;
+	printf("Packed %zu files (%llu bytes) into %s\n", n_bundle_sources,
+		(unsigned long long)pos, filename);
+	free(index);
+	return 0;
+
+err:
+	perror(filename);
+	if (out)
+		fclose(out);
+	unlink(tmp);
+	free(index);
+	return -1;
+}
+
+/* Returns the index of the file called 'name', or -1. */
+static int
+bundle_find(const char *name)
+{
+	ev_uint32_t lo = 0, hi = bundle.n_files;
+
+	while (lo < hi) {
+		ev_uint32_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(name, bundle.map + bundle.files[mid].name);
+		if (cmp == 0)
+			return (int)mid;
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return -1;
+}
+
+static int
+bundle_entry_init(struct file_cache_entry *ent, const struct bundle_file *f)
+{
+	const char *name = bundle.map + f->name;
+	char base[PATH_MAX], variant[PATH_MAX + 8];
+	int enc = variant_encoding(name);
+	int i;
+
+	/* The content type and the variants we have come from the name
+	 * without the ".gz". */
+	snprintf(base, sizeof(base), "%.*s",
+		(int)(strlen(name) -
+			  (enc >= 0 ? strlen(content_encodings[enc].suffix) : 0)),
+		name);
+	ent->key = (char *)name;
+	ent->content_type = guess_content_type(base);
+	ent->encoding = enc >= 0 ? content_encodings[enc].name : NULL;
+	for (i = 0; i < N_ENCODINGS; ++i) {
+		snprintf(variant, sizeof(variant), "%s%s", base,
+			content_encodings[i].suffix);
+		if (bundle_find(variant) >= 0)
+			ent->available |= 1u << i;
+	}
+	ent->wd = -1;
+	/* There is no inode, but the offset identifies the contents just as
+	 * well. */
+	ent->st.st_mode = S_IFREG | 0444;
+	ent->st.st_ino = f->offset;
+	ent->st.st_size = f->size;
+	ent->st.st_mtime = f->mtime;
+	file_cache_entry_set_validators(ent);
+
+	if (f->size == 0)
+		return 0;
+	if (f->size <= delivery.mmap_max) {
+		ent->data = bundle.map + f->offset;
+		return 0;
+	}
+	/* Big files still go out with sendfile.  Every server thread uses the
+	 * same segment, so this one keeps its lock. */
+	ent->seg = evbuffer_file_segment_new(bundle.fd, f->offset, f->size, 0);
+	return ent->seg ? 0 : -1;
+}
+
+static int
+bundle_open(const char *filename)
+{
+	const struct bundle_header *hdr;
+	struct stat st;
+	void *map;
+	ev_uint32_t i;
+
+	if ((bundle.fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0 ||
+		fstat(bundle.fd, &st) < 0) {
+		perror(filename);
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof(*hdr))
+		goto corrupt;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, bundle.fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	bundle.map = map;
+	bundle.map_len = st.st_size;
+
+	/* Check everything once here, so that serving can trust the index. */
+	hdr = map;
+	if (memcmp(hdr->magic, BUNDLE_MAGIC, sizeof(hdr->magic)) ||
+		hdr->n_files > (bundle.map_len - sizeof(*hdr)) / sizeof(*bundle.files))
+		goto corrupt;
+	bundle.files = (const struct bundle_file *)(hdr + 1);
+	bundle.n_files = hdr->n_files;
+	for (i = 0; i < bundle.n_files; ++i) {
+		const struct bundle_file *f = &bundle.files[i];
+		if (f->name >= bundle.map_len || bundle.map[f->name] != '/' ||
+			!memchr(bundle.map + f->name, '\0', bundle.map_len - f->name) ||
+			f->offset > bundle.map_len ||
+			f->size > bundle.map_len - f->offset)
+			goto corrupt;
+		if (i > 0 && strcmp(bundle.map + bundle.files[i - 1].name,
+						 bundle.map + f->name) >= 0)
+			goto corrupt;
+	}
+
+	if (!(bundle.entries = calloc(
+			  bundle.n_files ? bundle.n_files : 1, sizeof(*bundle.entries))))
+		return -1;
+	for (i = 0; i < bundle.n_files; ++i) {
+		if (bundle_entry_init(&bundle.entries[i], &bundle.files[i]) < 0)
+			return -1;
+	}
+	/* We'll be jumping around in it. */
+	madvise(map, bundle.map_len, MADV_RANDOM);
+	return 0;
+
+corrupt:
+	fprintf(stderr, "'%s' is not a bundle\n", filename);
+	return -1;
+}
+
+static void
+bundle_close(void)
+{
+	ev_uint32_t i;
+
+	if (bundle.entries) {
+		for (i = 0; i < bundle.n_files; ++i) {
+			if (bundle.entries[i].seg)
+				evbuffer_file_segment_free(bundle.entries[i].seg);
+		}
+		free(bundle.entries);
+	}
+	if (bundle.map)
+		munmap((void *)bundle.map, bundle.map_len);
+	if (bundle.fd >= 0)
+		close(bundle.fd);
+}
+
+/* Picks the smallest of 'best' and the variants of 'name' in 'eligible'.
+ * 'name' has room for a suffix after its 'len' bytes. */
+static struct file_cache_entry *
+bundle_pick_variant(char *name, size_t len, unsigned eligible,
+	struct file_cache_entry *best)
+{
+	struct file_cache_entry *ent;
+	int i, idx;
+
+	for (i = 0; i < N_ENCODINGS; ++i) {
+		if (!(eligible & (1u << i)))
+			continue;
+		strcpy(name + len, content_encodings[i].suffix);
+		if ((idx = bundle_find(name)) < 0)
+			continue;
+		ent = &bundle.entries[idx];
+		if (!best || ent->st.st_size < best->st.st_size)
+			best = ent;
+	}
+	name[len] = '\0';
+	return best;
+}
+
+/* The bundle's version of resolve_request(): the same choice between the
+ * file and its variants, with no system calls. */
+static struct file_cache_entry *
+bundle_lookup(const char *path, unsigned encodings)
+{
+	struct file_cache_entry *best = NULL;
+	char name[PATH_MAX + 16];
+	size_t len = strlen(path);
+	int idx;
+
+	if (len + sizeof("/index.html") > PATH_MAX)
+		return NULL;
+	memcpy(name, path, len + 1);
+	if ((idx = bundle_find(name)) >= 0)
+		best = &bundle.entries[idx];
+	best = bundle_pick_variant(name, len, encodings, best);
+
+	/* Directories are there only as the files in them, so "/docs" and
+	 * "/docs/" both mean "/docs/index.html". */
+	if (!best && bundle_pick_variant(name, len, ~0u, NULL) == NULL) {
+		if (len > 0 && name[len - 1] == '/')
+			--len;
+		strcpy(name + len, "/index.html");
+		len += strlen("/index.html");
+		if ((idx = bundle_find(name)) >= 0)
+			best = &bundle.entries[idx];
+		best = bundle_pick_variant(name, len, encodings, best);
+	}
+	if (!best)
+		best = bundle_pick_variant(name, len, ~0u, NULL);
+	return best;
+}
+
+/* One of these per thread: each has its own event_base, its own evhttp
+ * listening on its own SO_REUSEPORT socket, and its own file cache, so the
+ * threads never share anything while serving requests. */
+struct server_thread {
+	int index;
+	pthread_t thread;
+	int cpu; /* CPU to pin to, or -1 */
+	struct event_base *base;
+	struct evhttp *http;
+	struct router *router;
+	struct file_cache *cache;
+	/* Requests the filesystem threads have finished looking up, and the
+	 * event they activate to tell us about them. */
+	pthread_mutex_t done_lock;
+	TAILQ_HEAD(fs_job_list, fs_job) done;
+	struct event *done_event;
+	/* Uploads whose heads have gone on to evhttp, with --uploads. */
+	LIST_HEAD(upload_list, upload) uploads;
+};
+
+/* A request we couldn't answer from the cache.  Everything that might
+ * block on the disk happens in resolve_request(), on one of the filesystem
+ * threads if we have any; the reply is then sent from finish_request(),
+ * back on the thread that owns the request. */
+struct fs_job {
+	TAILQ_ENTRY(fs_job) next;
+	struct server_thread *server;
+	struct evhttp_request *req;
+	enum evhttp_cmd_type cmd;
+	char *path;			/* as requested, for the directory listing */
+	char *decoded_path; /* the cache key */
+	unsigned encodings; /* that the client accepts */
+
+	/* Filled in by resolve_request(). */
+	int status;					  /* HTTP_OK, or the error to send */
+	unsigned available;			  /* precompressed variants we found */
+	struct file_cache_entry *ent; /* the file to send, or... */
+	struct evbuffer *listing;	  /* ...the next part of a directory listing */
+
+	/* While we stream a directory listing. */
+	DIR *dir;					/* NULL once we've read it all */
+	char *dir_path;
+	struct stat dir_st;
+	struct evbuffer *rendered;	/* copy of the page so far, for the cache */
+	bool streaming;				/* the reply has been started */
+	bool waiting;				/* for the output to drain */
+	bool aborted;				/* the connection went away */
+};
+
+/* The filesystem threads, shared by all the server threads. */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct fs_job_list jobs;
+	bool stopping;
+	int n_threads;
+	pthread_t *threads;
+} fs_pool = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	TAILQ_HEAD_INITIALIZER(fs_pool.jobs),
+};
+
+static void
+fs_job_free(struct fs_job *job)
+{
+	if (job->ent)
+		file_cache_entry_free(job->ent);
+	if (job->listing)
+		evbuffer_free(job->listing);
+	if (job->rendered)
+		evbuffer_free(job->rendered);
+	if (job->dir)
+		closedir(job->dir);
+	free(job->path);
+	free(job->decoded_path);
+	free(job->dir_path);
+	free(job);
+}
+
+/* Start listing the directory "whole_path": open it and render the top of
+ * the page.  The entries follow in batches from render_listing_batch(). */
+static int
+open_directory_listing(struct fs_job *job, const char *whole_path)
+{
+	const char *path = job->path, *decoded_path = job->decoded_path;
+	const char *trailing_slash = "";
+
+	if (!strlen(path) || path[strlen(path) - 1] != '/')
+		trailing_slash = "/";
+	if (!(job->dir = opendir(whole_path)))
+		return -1;
+	/* Remember the directory as it was before we read it, so the cached
+	 * listing is thrown away if anything changes while we do. */
+	if (fstat(dirfd(job->dir), &job->dir_st) < 0 ||
+		!(job->dir_path = strdup(whole_path)) ||
+		!(job->listing = evbuffer_new()) ||
+		!(job->rendered = evbuffer_new()))
+		return -1;
+
+	evbuffer_add_printf(job->listing,
+		"<!DOCTYPE html>\n"
+		"<html lang=\"en\">"
+		"<head>\n"
+		"<meta name=\"viewport\" "
+		"content=\"width=device-width,initial-scale=1\">\n"
+		"<title>%s</title>\n"
+		"<link rel=\"shortcut icon\" href=\"/favicon.png\">\n"
+		"<link rel=\"stylesheet\" href=\"" BOOTSTRAP_CSS
+		"/bootstrap.min.css\">\n"
+		"<script src=\"" BOOTSTRAP_JS "/bootstrap.bundle.min.js\"></script>\n"
+		"<base href='%s%s'>\n"
+		"</head>\n"
+		"<body id=\"top\">\n"
+		"<nav class=\"navbar navbar-expand-lg navbar-dark sticky-top\">\n"
+		"<div class=\"container\">\n"
+		"</div>\n"
+		"</nav>\n"
+		"<main>\n"
+		"<div class=\"container p-3\">\n"
+		"<h2>%s</h2>\n"
+		"<ul class=\"list-unstyled my-3\">\n",
+		decoded_path, /* XXX html-escape this. */
+		path,		  /* XXX html-escape this? */
+		trailing_slash, decoded_path /* XXX html-escape this */);
+	return 0;
+}
+
+/* Render the next LISTING_BATCH entries of the directory into
+ * job->listing.  When we run out, add the bottom of the page and close the
+ * directory. */
+static void
+render_listing_batch(struct fs_job *job)
+{
+	struct evbuffer *evb = job->listing;
+	const char *path = job->path;
+	struct dirent *ent;
+	size_t len;
+	int n = 0;
+
+	while (n < LISTING_BATCH && (ent = readdir(job->dir))) {
+		const char *name = ent->d_name;
+		// ignore '.' directory entries
+		if (strcmp(name, ".") == 0)
+			continue;
+		// show '..' only for subdirs
+		if (strcmp(path, "/") == 0 && strcmp(name, "..") == 0)
+			continue;
+		evbuffer_add_printf(evb, "<li><a href=\"%s\">%s</a>\n", name,
+			name); /* XXX escape this */
+		++n;
+	}
+	if (n < LISTING_BATCH) {
+		evbuffer_add_printf(evb, "</ul>"
+								 "</div>\n"
+								 "</main>\n"
+								 "<footer class=\"p-3\">\n"
+								 "<div class=\"container\">\n"
+								 "</div>\n"
+								 "</footer>\n"
+								 "</body>"
+								 "</html>\n");
+		closedir(job->dir);
+		job->dir = NULL;
+	}
+
+	/* Keep a copy of the page for the cache, unless it gets too big. */
+	len = evbuffer_get_length(evb);
+	if (job->rendered &&
+		(evbuffer_get_length(job->rendered) + len > LISTING_CACHE_MAX_SIZE ||
+			evbuffer_add(job->rendered, evbuffer_pullup(evb, -1), len) < 0)) {
+		evbuffer_free(job->rendered);
+		job->rendered = NULL;
+	}
+}
+
+/* Find out what "job" refers to, and open it.  This may block. */
+static void
+resolve_request(struct fs_job *job)
+{
+	const char *static_dir = ".";
+	char whole_path[PATH_MAX] = {0};
+	char variant[PATH_MAX + 8];
+	const char *type;
+	struct stat st, vst[N_ENCODINGS];
+	bool have_identity;
+	unsigned eligible;
+	int best = -1; /* index into content_encodings, or -1 for identity */
+	int i;
+
+	path_join(whole_path, static_dir, job->decoded_path);
+	have_identity = stat(whole_path, &st) == 0;
+
+	if (have_identity && S_ISDIR(st.st_mode)) {
+		/* Check if there is index.html file */
+		char index_file[PATH_MAX + 11];
+		snprintf(index_file, sizeof(index_file), "%s/index.html", whole_path);
+
+		if (stat(index_file, &st) < 0) {
+			char *real_dir = realpath(whole_path, NULL);
+			if (!real_dir || open_directory_listing(job, real_dir) < 0) {
+				free(real_dir);
+				job->status = HTTP_NOTFOUND;
+				return;
+			}
+			free(real_dir);
+			job->status = HTTP_OK;
+			if (job->cmd != EVHTTP_REQ_HEAD)
+				render_listing_batch(job);
+			return;
+		}
+		strcpy(whole_path, index_file);
+	}
+	have_identity = have_identity && S_ISREG(st.st_mode);
+
+	/* Look for precompressed versions next to the file, and pick the
+	 * smallest one that the client will take.  If there is nothing but
+	 * variants the client didn't ask for, send the smallest of those
+	 * anyway, rather than nothing at all. */
+	job->available = 0;
+	for (i = 0; i < N_ENCODINGS; ++i) {
+		snprintf(variant, sizeof(variant), "%s%s", whole_path,
+			content_encodings[i].suffix);
+		if (stat(variant, &vst[i]) == 0 && S_ISREG(vst[i].st_mode))
+			job->available |= 1u << i;
+	}
+	eligible = job->encodings & job->available;
+	if (!eligible && !have_identity)
+		eligible = job->available;
+	for (i = 0; i < N_ENCODINGS; ++i) {
+		if (!(eligible & (1u << i)))
+			continue;
+		if ((best < 0 && !have_identity) || vst[i].st_size < st.st_size) {
+			best = i;
+			st = vst[i];
+		}
+	}
+	if (best < 0 && !have_identity) {
+		access_log_message("File '%s' not found", whole_path);
+		job->status = HTTP_NOTFOUND;
+		return;
+	}
+
+	/* The content type comes from the name without the ".gz". */
+	type = guess_content_type(whole_path);
+	if (best >= 0)
+		strcat(whole_path, content_encodings[best].suffix);
+	char *real_file = realpath(whole_path, NULL);
+	if (!real_file) {
+		job->status = HTTP_NOTFOUND;
+		return;
+	}
+	job->ent = file_cache_entry_new(job->decoded_path, real_file, &st, type,
+		best >= 0 ? content_encodings[best].name : NULL);
+	if (job->ent) {
+		job->ent->available = job->available;
+		job->ent->accepted = job->encodings & job->available;
+		job->status = HTTP_OK;
+	} else if (errno == ENOENT) {
+		access_log_message("File '%s' not found", real_file);
+		job->status = HTTP_NOTFOUND;
+	} else {
+		job->status = HTTP_INTERNAL;
+	}
+	free(real_file);
+}
+
+static void submit_job(struct fs_job *job);
+
+/* Put the cached copy of a finished directory listing into the cache. */
+static void
+cache_listing(struct fs_job *job)
+{
+	size_t len = evbuffer_get_length(job->rendered);
+	struct file_cache_entry *ent;
+	struct file_blob *blob;
+
+	ent = file_cache_entry_alloc(
+		job->decoded_path, job->dir_path, &job->dir_st, "text/html", NULL);
+	if (!ent)
+		return;
+	if (!(blob = file_blob_new(len))) {
+		file_cache_entry_free(ent);
+		return;
+	}
+	evbuffer_remove(job->rendered, blob->data, len);
+	ent->blob = blob;
+	ent->directory = true;
+	if (!file_cache_insert(job->server->cache, ent))
+		file_cache_entry_free(ent);
+}
+
+static void send_listing_chunk(struct fs_job *job);
+
+/* The client has read everything we sent so far. */
+static void
+listing_drained_cb(struct evhttp_connection *evcon, void *arg)
+{
+	struct fs_job *job = arg;
+
+	if (job->waiting) {
+		job->waiting = false;
+		submit_job(job);
+	}
+}
+
+static void
+listing_closed_cb(struct evhttp_connection *evcon, void *arg)
+{
+	struct fs_job *job = arg;
+
+	/* If the connection failed, evhttp has let go of the request and it is
+	 * up to us to free it.  If the connection is just being freed (say, at
+	 * shutdown), the request goes with it. */
+	if (evhttp_request_get_connection(job->req) != NULL)
+		job->req = NULL;
+	job->aborted = true;
+	/* If a filesystem thread has the job, we'll clean up when it's back. */
+	if (job->waiting) {
+		job->waiting = false;
+		send_listing_chunk(job);
+	}
+}
+
+/* Send the part of a directory listing that has been rendered so far,
+ * starting the reply first if this is the first part. */
+static void
+send_listing_chunk(struct fs_job *job)
+{
+	struct evhttp_request *req = job->req;
+	struct evhttp_connection *evcon;
+	struct bufferevent *bev;
+
+	if (!req) {
+		fs_job_free(job);
+		return;
+	}
+	if (job->aborted) {
+		/* The client went away; this just frees the request. */
+		evhttp_send_reply_end(req);
+		fs_job_free(job);
+		return;
+	}
+
+	evcon = evhttp_request_get_connection(req);
+	if (!job->streaming) {
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+			"Content-Type", "text/html");
+		if (job->cmd == EVHTTP_REQ_HEAD) {
+			evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+			fs_job_free(job);
+			return;
+		}
+		/* We don't know how long the page will be, so it goes out in
+		 * chunks, one per batch of directory entries. */
+		evhttp_send_reply_start(req, HTTP_OK, "OK");
+		evhttp_connection_set_closecb(evcon, listing_closed_cb, job);
+		job->streaming = true;
+	}
+	evhttp_send_reply_chunk_with_cb(
+		req, job->listing, listing_drained_cb, job);
+
+	if (!job->dir) {
+		/* That was the last batch. */
+		evhttp_connection_set_closecb(evcon, NULL, NULL);
+		evhttp_send_reply_end(req);
+		if (job->rendered)
+			cache_listing(job);
+		fs_job_free(job);
+		return;
+	}
+
+	/* Keep going while the client keeps up.  Once too much is waiting to
+	 * be written, stop reading the directory until it has drained. */
+	bev = evhttp_connection_get_bufferevent(evcon);
+	if (evbuffer_get_length(bufferevent_get_output(bev)) < LISTING_WATERMARK)
+		submit_job(job);
+	else
+		job->waiting = true;
+}
+
+/* Send the reply for a job that resolve_request() is done with. */
+static void
+finish_request(struct fs_job *job)
+{
+	struct evhttp_request *req = job->req;
+	struct evbuffer *evb;
+
+	if (job->status != HTTP_OK) {
+		evhttp_send_error(req, job->status, NULL);
+	} else if (job->listing) {
+		send_listing_chunk(job);
+		return;
+	} else if ((evb = evbuffer_new()) == NULL) {
+		evhttp_send_error(req, HTTP_INTERNAL, NULL);
+	} else {
+		bool cached = file_cache_insert(job->server->cache, job->ent);
+		send_cached_file(req, job->ent, evb);
+		if (cached)
+			job->ent = NULL; /* the cache owns it now */
+		evbuffer_free(evb);
+	}
+	fs_job_free(job);
+}
+
+/* Do the part of "job" that may block: look the request up, or read the
+ * next batch of a directory listing. */
+static void
+run_job(struct fs_job *job)
+{
+	if (job->streaming)
+		render_listing_batch(job);
+	else
+		resolve_request(job);
+}
+
+/* Hand a job back to the server thread that owns it.  Only the first job
+ * in an empty queue needs to wake the thread up; it takes them all at
+ * once. */
+static void
+post_done(struct fs_job *job)
+{
+	struct server_thread *server = job->server;
+	bool was_empty;
+
+	pthread_mutex_lock(&server->done_lock);
+	was_empty = TAILQ_EMPTY(&server->done);
+	TAILQ_INSERT_TAIL(&server->done, job, next);
+	pthread_mutex_unlock(&server->done_lock);
+	if (was_empty)
+		event_active(server->done_event, EV_READ, 0);
+}
+
+static void
+submit_job(struct fs_job *job)
+{
+	if (fs_pool.n_threads == 0) {
+		/* No filesystem threads: do the work here, but still reply from
+		 * the next loop iteration, so that a huge directory listing only
+		 * reads one batch per iteration. */
+		run_job(job);
+		post_done(job);
+		return;
+	}
+	pthread_mutex_lock(&fs_pool.lock);
+	TAILQ_INSERT_TAIL(&fs_pool.jobs, job, next);
+	pthread_cond_signal(&fs_pool.cond);
+	pthread_mutex_unlock(&fs_pool.lock);
+}
+
+static void *
+fs_thread_run(void *arg)
+{
+	for (;;) {
+		struct fs_job *job;
+
+		pthread_mutex_lock(&fs_pool.lock);
+		while (TAILQ_EMPTY(&fs_pool.jobs) && !fs_pool.stopping)
+			pthread_cond_wait(&fs_pool.cond, &fs_pool.lock);
+		if (fs_pool.stopping) {
+			pthread_mutex_unlock(&fs_pool.lock);
+			return NULL;
+		}
+		job = TAILQ_FIRST(&fs_pool.jobs);
+		TAILQ_REMOVE(&fs_pool.jobs, job, next);
+		pthread_mutex_unlock(&fs_pool.lock);
+
+		run_job(job);
+		post_done(job);
+	}
+}
+
+/* Runs on a server thread when the filesystem threads have finished some
+ * of its jobs. */
+static void
+fs_done_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct server_thread *server = arg;
+	struct fs_job_list done;
+	struct fs_job *job;
+
+	TAILQ_INIT(&done);
+	pthread_mutex_lock(&server->done_lock);
+	TAILQ_CONCAT(&done, &server->done, next);
+	pthread_mutex_unlock(&server->done_lock);
+
+	while ((job = TAILQ_FIRST(&done)) != NULL) {
+		TAILQ_REMOVE(&done, job, next);
+		finish_request(job);
+	}
+}
+
+static int
+fs_pool_start(int n_threads)
+{
+	int i;
+
+	if (!(fs_pool.threads = calloc(n_threads, sizeof(pthread_t))))
+		return -1;
+	for (i = 0; i < n_threads; ++i) {
+		if (pthread_create(&fs_pool.threads[i], NULL, fs_thread_run, NULL))
+			return -1;
+		++fs_pool.n_threads;
+	}
+	return 0;
+}
+
+/* Stop the filesystem threads.  The jobs they didn't get to go back to
+ * their server threads, to be thrown away along with the connections. */
+static void
+fs_pool_stop(void)
+{
+	struct fs_job *job;
+	int i;
+
+	pthread_mutex_lock(&fs_pool.lock);
+	fs_pool.stopping = true;
+	pthread_cond_broadcast(&fs_pool.cond);
+	pthread_mutex_unlock(&fs_pool.lock);
+	for (i = 0; i < fs_pool.n_threads; ++i)
+		pthread_join(fs_pool.threads[i], NULL);
+	free(fs_pool.threads);
+
+	while ((job = TAILQ_FIRST(&fs_pool.jobs)) != NULL) {
+		TAILQ_REMOVE(&fs_pool.jobs, job, next);
+		post_done(job);
+	}
+}
+
+/* With --uploads, PUT and POST go to upload_request(). */
+static bool take_uploads;
+static void upload_request(
+	struct evhttp_request *req, struct server_thread *server);
+
+static void
+send_file_to_user(struct evhttp_request *req, void *arg)
+{
+	struct server_thread *server = arg;
+	struct file_cache_entry *cached;
+	struct evbuffer *evb = NULL;
+	struct evhttp_uri *decoded = NULL;
+	struct fs_job *job;
+	unsigned encodings;
+
+	enum evhttp_cmd_type cmd = evhttp_request_get_command(req);
+	if (take_uploads && (cmd == EVHTTP_REQ_PUT || cmd == EVHTTP_REQ_POST)) {
+		upload_request(req, server);
+		return;
+	}
+	if (cmd != EVHTTP_REQ_GET && cmd != EVHTTP_REQ_HEAD) {
+		evhttp_add_header(evhttp_request_get_output_headers(req), "Allow",
+			take_uploads ? "GET, HEAD, PUT, POST" : "GET, HEAD");
+		evhttp_send_reply(req, 405, "Method Not Allowed", NULL);
+		return;
+	}
+
+	/* Decode the URI */
+	decoded = evhttp_uri_parse(evhttp_request_get_uri(req));
+	if (!decoded) {
+		evhttp_send_error(req, HTTP_BADREQUEST, 0);
+		return;
+	}
+
+	/* Let's see what path the user asked for. */
+	const char *path = evhttp_uri_get_path(decoded);
+	if (!path)
+		path = "/";
+
+	/* We need to decode it, to see what path the user really wanted. */
+	char *decoded_path = evhttp_uridecode(path, 0, NULL);
+	if (decoded_path == NULL)
+		goto err;
+
+	/* Don't allow any ".."s in the path, to avoid exposing stuff outside
+	 * of the docroot.  This test is both overzealous and underzealous:
+	 * it forbids aceptable paths like "/this/one..here", but it doesn't
+	 * do anything to prevent symlink following." */
+	if (strstr(decoded_path, ".."))
+		goto err;
+
+	/* If we've served this path before, we already know everything we
+	 * need, and the file is already open.  With a bundle, we know
+	 * everything up front. */
+	encodings = parse_accept_encoding(evhttp_find_header(
+		evhttp_request_get_input_headers(req), "Accept-Encoding"));
+	if (bundle.map) {
+		cached = bundle_lookup(decoded_path, encodings);
+		if (!cached)
+			goto err;
+	} else {
+		cached = file_cache_lookup(server->cache, decoded_path, encodings);
+	}
+	if (cached) {
+		if ((evb = evbuffer_new()) == NULL) {
+			evhttp_send_error(req, HTTP_INTERNAL, 0);
+			goto done;
+		}
+		send_cached_file(req, cached, evb);
+		goto done;
+	}
+
+	/* Otherwise we have to go to the disk, which might take a while. */
+	if (!(job = calloc(1, sizeof(*job)))) {
+		evhttp_send_error(req, HTTP_INTERNAL, 0);
+		goto done;
+	}
+	job->server = server;
+	job->req = req;
+	job->cmd = cmd;
+	job->encodings = encodings;
+	job->decoded_path = decoded_path;
+	decoded_path = NULL;
+	if (!(job->path = strdup(path))) {
+		fs_job_free(job);
+		evhttp_send_error(req, HTTP_INTERNAL, 0);
+		goto done;
+	}
+
+	submit_job(job);
+	goto done;
+
+err:
+	evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+
+done:
+	if (decoded)
+		evhttp_uri_free(decoded);
+	if (decoded_path)
+		free(decoded_path);
+	if (evb)
+		evbuffer_free(evb);
+}
+
+/* Uploads.  evhttp reads the whole body of a request into memory before
+ * it calls us, which is no good for a file of a few gigabytes.  So with
+ * --uploads, evhttp reads every connection through a filter bufferevent
+ * that keeps an eye on the requests going by (upload_input_filter()).
+ * The head of a PUT or POST goes on to evhttp with "Content-Length: 0",
+ * and its body stays behind, in the socket's own bufferevent underneath.
+ * When evhttp gets to the request and calls upload_request(), we move the
+ * body from the socket to a file with splice(), through a pipe, so that
+ * it never gets copied into our memory, and reply once it is all there.
+ * The file is written in UPLOAD_DIR (writing it next to its final name
+ * would make inotify flush the cache for that directory on every write)
+ * and renamed into place once it is complete, so nobody ever sees half of
+ * it. */
+#define UPLOAD_DIR ".uploads"
+#define UPLOAD_MAX_HEAD 16384
+#define UPLOAD_CHUNK (1024 * 1024)
+#define UPLOAD_SPLICES_PER_CALLBACK 8
+#define UPLOAD_TIMEOUT 60
+
+/* Where the filter is in the stream of requests on a connection. */
+enum upload_state {
+	UPLOAD_HEAD,	/* waiting for the next request head */
+	UPLOAD_SKIP,	/* passing on the body of some other request */
+	UPLOAD_WAIT,	/* an upload's head has gone on; its body waits */
+	UPLOAD_BODY,	/* moving an upload's body to its file */
+	UPLOAD_PASS,	/* lost track of the requests; evhttp gets it all */
+	UPLOAD_DISCARD, /* an upload failed, and the connection is closing */
+};
+
+/* One per connection, while there is an --uploads flag. */
+struct upload {
+	LIST_ENTRY(upload) next; /* on the server's list while UPLOAD_WAIT */
+	struct server_thread *server;
+	struct bufferevent *bev;  /* the filter, which evhttp reads */
+	struct bufferevent *sock; /* the socket's, underneath */
+	enum upload_state state;
+	ev_uint64_t remaining; /* of the body we are passing on or moving */
+	bool expect_continue;
+	int error; /* what is wrong with the upload's head, or 0 */
+	const char *error_reason;
+	struct evhttp_request *req;
+	evutil_socket_t fd;
+	struct event *ev;		/* for the body */
+	struct event *write_ev; /* for the replies */
+	int pipe[2];			/* for splice(), or -1 if we can't */
+	int file_fd;
+	char tmp_path[PATH_MAX];
+	char path[PATH_MAX]; /* where it goes when it is done */
+};
+
+/* Stops moving the body, and gets rid of the file unless it has been
+ * renamed already. */
+static void
+upload_stop(struct upload *u)
+{
+	if (u->ev)
+		event_del(u->ev);
+	if (u->file_fd >= 0) {
+		close(u->file_fd);
+		u->file_fd = -1;
+		unlink(u->tmp_path);
+	}
+}
+
+/* The filter's free_context: evhttp is done with the connection. */
+static void
+upload_free(void *arg)
+{
+	struct upload *u = arg;
+
+	if (u->state == UPLOAD_WAIT)
+		LIST_REMOVE(u, next);
+	upload_stop(u);
+	if (u->pipe[0] >= 0) {
+		close(u->pipe[0]);
+		close(u->pipe[1]);
+	}
+	if (u->ev)
+		event_free(u->ev);
+	if (u->write_ev)
+		event_free(u->write_ev);
+	free(u);
+}
+
+/* If 'line' is the header 'name', returns its value. */
+static const char *
+upload_header(const char *line, const char *name)
+{
+	size_t len = strlen(name);
+
+	if (evutil_ascii_strncasecmp(line, name, len) || line[len] != ':')
+		return NULL;
+	return line + len + 1 + strspn(line + len + 1, " \t");
+}
+
+/* Hands the request head at the start of 'src' on to evhttp, in 'dst'.
+ * An upload's head loses its Content-Length, Expect and Transfer-Encoding
+ * headers and gets "Content-Length: 0" instead, so that evhttp calls us
+ * without waiting for the body.  Returns false if the head isn't all here
+ * yet. */
+static bool
+upload_pass_head(struct upload *u, struct evbuffer *src, struct evbuffer *dst)
+{
+	char head[UPLOAD_MAX_HEAD + 1], *line, *next, *end;
+	const char *value;
+	struct evbuffer_ptr eoh;
+	bool upload, have_length = false, bad_length = false, chunked = false;
+	unsigned char *p;
+	size_t len;
+
+	/* Some clients send a CRLF after a body; it doesn't start a request. */
+	while ((p = evbuffer_pullup(src, 1)) && (*p == '\r' || *p == '\n'))
+		evbuffer_drain(src, 1);
+	eoh = evbuffer_search(src, "\r\n\r\n", 4, NULL);
+	if (eoh.pos < 0 || eoh.pos + 4 > UPLOAD_MAX_HEAD) {
+		if (eoh.pos < 0 && evbuffer_get_length(src) <= UPLOAD_MAX_HEAD)
+			return false;
+		/* Too big for us; evhttp will turn it down. */
+		u->state = UPLOAD_PASS;
+		return true;
+	}
+	len = eoh.pos + 4;
+	evbuffer_copyout(src, head, len);
+	head[len] = '\0';
+	upload = !strncmp(head, "PUT ", 4) || !strncmp(head, "POST ", 5);
+	u->remaining = 0;
+	u->expect_continue = false;
+	u->error = 0;
+
+	line = strstr(head, "\r\n") + 2;
+	if (upload)
+		evbuffer_add(dst, head, line - head);
+	for (; *line != '\r'; line = next) {
+		next = strstr(line, "\r\n") + 2;
+		if ((value = upload_header(line, "Content-Length"))) {
+			u->remaining = strtoull(value, &end, 10);
+			if (!isdigit((unsigned char)*value) ||
+				end[strspn(end, " \t")] != '\r')
+				bad_length = true;
+			have_length = true;
+		} else if (upload_header(line, "Transfer-Encoding")) {
+			chunked = true;
+		} else if ((value = upload_header(line, "Expect"))) {
+			u->expect_continue =
+				!evutil_ascii_strncasecmp(value, "100-continue", 12);
+		} else if (upload) {
+			evbuffer_add(dst, line, next - line);
+		}
+	}
+
+	if (!upload) {
+		evbuffer_remove_buffer(src, dst, len);
+		if (chunked || bad_length)
+			u->state = UPLOAD_PASS;
+		else if (u->remaining > 0)
+			u->state = UPLOAD_SKIP;
+		return true;
+	}
+	evbuffer_add(dst, "Content-Length: 0\r\n\r\n", 21);
+	evbuffer_drain(src, len);
+	if (chunked) {
+		/* To keep the example short, we don't take chunked bodies. */
+		u->error = 501;
+		u->error_reason = "Not Implemented";
+	} else if (bad_length) {
+		u->error = HTTP_BADREQUEST;
+		u->error_reason = "Bad Request";
+	} else if (!have_length) {
+		u->error = 411;
+		u->error_reason = "Length Required";
+	}
+	u->state = UPLOAD_WAIT;
+	LIST_INSERT_HEAD(&u->server->uploads, u, next);
+	/* The body stays in the socket until upload_request() wants it. */
+	bufferevent_disable(u->sock, EV_READ);
+	return true;
+}
+
+/* The filter between the socket and evhttp. */
+static enum bufferevent_filter_result
+upload_input_filter(struct evbuffer *src, struct evbuffer *dst,
+	ev_ssize_t limit, enum bufferevent_flush_mode mode, void *arg)
+{
+	struct upload *u = arg;
+	size_t before = evbuffer_get_length(dst), n;
+
+	while (evbuffer_get_length(src) > 0) {
+		if (u->state == UPLOAD_HEAD) {
+			if (!upload_pass_head(u, src, dst))
+				break;
+		} else if (u->state == UPLOAD_SKIP) {
+			n = evbuffer_get_length(src);
+			if (n > u->remaining)
+				n = u->remaining;
+			evbuffer_remove_buffer(src, dst, n);
+			if ((u->remaining -= n) == 0)
+				u->state = UPLOAD_HEAD;
+		} else if (u->state == UPLOAD_PASS) {
+			evbuffer_add_buffer(dst, src);
+		} else if (u->state == UPLOAD_DISCARD) {
+			evbuffer_drain(src, evbuffer_get_length(src));
+		} else {
+			/* The body is upload_request()'s. */
+			break;
+		}
+	}
+	/* Libevent calls us again as long as we say BEV_OK and there is
+	 * something left in 'src'. */
+	return evbuffer_get_length(dst) > before ? BEV_OK : BEV_NEED_MORE;
+}
+
+static void
+upload_output_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct upload *u = arg;
+
+	bufferevent_flush(u->bev, EV_WRITE, BEV_NORMAL);
+}
+
+/* The other way, the filter writes to the socket itself, rather than
+ * passing the replies on to the socket's bufferevent: once its output is
+ * empty, evhttp takes the reply to be out, and it may close the socket
+ * right away. */
+static enum bufferevent_filter_result
+upload_output_filter(struct evbuffer *src, struct evbuffer *dst,
+	ev_ssize_t limit, enum bufferevent_flush_mode mode, void *arg)
+{
+	struct upload *u = arg;
+	evutil_socket_t fd = bufferevent_getfd(u->sock);
+	int n;
+
+	if ((n = evbuffer_write(src, fd)) < 0 && errno != EAGAIN &&
+		errno != EINTR) {
+		evbuffer_drain(src, evbuffer_get_length(src));
+		bufferevent_trigger_event(
+			u->bev, BEV_EVENT_WRITING | BEV_EVENT_ERROR, 0);
+		return BEV_ERROR;
+	}
+	if (evbuffer_get_length(src) > 0) {
+		if (!u->write_ev && !(u->write_ev = event_new(u->server->base, fd,
+								  EV_WRITE, upload_output_cb, u)))
+			return BEV_ERROR;
+		event_add(u->write_ev, NULL);
+	}
+	return n > 0 ? BEV_OK : BEV_NEED_MORE;
+}
+
+/* Puts the filter in front of 'sock', the socket's bufferevent. */
+static struct bufferevent *
+upload_bufferevent(struct bufferevent *sock, struct server_thread *server)
+{
+	struct upload *u;
+
+	if (!(u = calloc(1, sizeof(*u)))) {
+		bufferevent_free(sock);
+		return NULL;
+	}
+	u->server = server;
+	u->sock = sock;
+	u->state = UPLOAD_HEAD;
+	u->pipe[0] = u->pipe[1] = -1;
+	u->file_fd = -1;
+	/* evhttp may free the connection from its callbacks, which mustn't
+	 * happen while the filter is still busy. */
+	if (!(u->bev = bufferevent_filter_new(sock, upload_input_filter,
+			  upload_output_filter,
+			  BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS, upload_free,
+			  u))) {
+		free(u);
+		bufferevent_free(sock);
+		return NULL;
+	}
+	/* evhttp adds a reply to the output before it enables writing, and
+	 * a filter only looks at its output as it is added; deferring that to
+	 * the event loop lets it see writing enabled. */
+	evbuffer_defer_callbacks(bufferevent_get_output(u->bev), server->base);
+	return u->bev;
+}
+
+/* Replies to the upload.  After an error the connection closes, since we
+ * don't know where the next request starts; otherwise the filter goes on
+ * with whatever the client sent after the body. */
+static void
+upload_reply(struct upload *u, int code, const char *reason)
+{
+	struct evhttp_request *req = u->req;
+
+	upload_stop(u);
+	u->req = NULL;
+	if (code >= 400) {
+		u->state = UPLOAD_DISCARD;
+		/* This may free the connection, and 'u' with it. */
+		evhttp_send_error(req, code, reason);
+		return;
+	}
+	u->state = UPLOAD_HEAD;
+	bufferevent_enable(u->sock, EV_READ);
+	upload_input_filter(bufferevent_get_input(u->sock),
+		bufferevent_get_input(u->bev), -1, BEV_NORMAL, u);
+	evhttp_send_reply(req, code, reason, NULL);
+}
+
+/* Moves as much of the body as we can to the file.  Returns -1 if the
+ * upload failed. */
+static int
+upload_body(struct upload *u)
+{
+	char buf[65536];
+	ssize_t n, m, w;
+	int i;
+
+	for (i = 0; i < UPLOAD_SPLICES_PER_CALLBACK && u->remaining > 0; ++i) {
+		size_t want =
+			u->remaining < UPLOAD_CHUNK ? u->remaining : UPLOAD_CHUNK;
+
+		if (u->pipe[0] >= 0) {
+			n = splice(u->fd, NULL, u->pipe[1], NULL, want,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n < 0 && errno == EINVAL) {
+				/* This socket can't be spliced; copy it instead. */
+				close(u->pipe[0]);
+				close(u->pipe[1]);
+				u->pipe[0] = u->pipe[1] = -1;
+				continue;
+			}
+			/* Empty the pipe into the file before the next read. */
+			for (m = 0; m < n; m += w) {
+				if ((w = splice(u->pipe[0], NULL, u->file_fd, NULL, n - m,
+						 SPLICE_F_MOVE)) <= 0)
+					return -1;
+			}
+		} else {
+			n = read(u->fd, buf, want < sizeof(buf) ? want : sizeof(buf));
+			for (m = 0; m < n; m += w) {
+				if ((w = write(u->file_fd, buf + m, n - m)) <= 0)
+					return -1;
+			}
+		}
+		if (n == 0)
+			return -1; /* the client went away */
+		if (n < 0)
+			return errno == EAGAIN || errno == EINTR ? 0 : -1;
+		u->remaining -= n;
+	}
+	return 0;
+}
+
+static void
+upload_finish(struct upload *u)
+{
+	struct stat st;
+	bool existed = stat(u->path, &st) == 0;
+	int rc = close(u->file_fd);
+
+	u->file_fd = -1;
+	if (rc < 0 || rename(u->tmp_path, u->path) < 0) {
+		perror(u->path);
+		unlink(u->tmp_path);
+		upload_reply(u, HTTP_INTERNAL, "Internal Server Error");
+	} else if (existed) {
+		upload_reply(u, HTTP_NOCONTENT, "No Content");
+	} else {
+		upload_reply(u, 201, "Created");
+	}
+}
+
+static void
+upload_read_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct upload *u = arg;
+
+	if ((what & EV_TIMEOUT) || upload_body(u) < 0) {
+		/* Nobody is waiting for a reply, so just drop the connection,
+		 * which takes 'u' with it. */
+		evhttp_connection_free(evhttp_request_get_connection(u->req));
+		return;
+	}
+	if (u->remaining == 0)
+		upload_finish(u);
+}
+
+/* A PUT or POST, with its body still in the socket. */
+static void
+upload_request(struct evhttp_request *req, struct server_thread *server)
+{
+	struct bufferevent *bev =
+		evhttp_connection_get_bufferevent(evhttp_request_get_connection(req));
+	const char *path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
+	struct timeval timeout = {UPLOAD_TIMEOUT, 0};
+	int code = HTTP_BADREQUEST;
+	const char *reason = "Bad Request";
+	char *decoded_path = NULL, *slash;
+	struct evbuffer *input;
+	struct upload *u;
+	struct stat st;
+	int n;
+
+	LIST_FOREACH(u, &server->uploads, next) {
+		if (u->bev == bev)
+			break;
+	}
+	if (!u) {
+		/* The filter lost track of this connection's requests, and
+		 * evhttp has read the body itself. */
+		evhttp_send_error(req, 501, "Not Implemented");
+		return;
+	}
+	LIST_REMOVE(u, next);
+	u->req = req;
+	u->state = UPLOAD_BODY;
+	if (u->error) {
+		upload_reply(u, u->error, u->error_reason);
+		return;
+	}
+
+	/* The same checks as send_file_to_user(), and the file has to go
+	 * into a directory that is already there. */
+	if (!path || !(decoded_path = evhttp_uridecode(path, 0, NULL)) ||
+		decoded_path[0] != '/' || strstr(decoded_path, "..") ||
+		!strncmp(decoded_path, "/" UPLOAD_DIR, strlen("/" UPLOAD_DIR)) ||
+		strlen(decoded_path) + 2 > sizeof(u->path))
+		goto fail;
+	path_join(u->path, ".", decoded_path);
+	slash = strrchr(u->path, '/');
+	code = 409;
+	reason = "Conflict";
+	if (!slash[1])
+		goto fail;
+	*slash = '\0';
+	if (stat(u->path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		code = HTTP_NOTFOUND;
+		reason = "Not Found";
+		goto fail;
+	}
+	*slash = '/';
+	if (stat(u->path, &st) == 0 && S_ISDIR(st.st_mode))
+		goto fail;
+
+	code = HTTP_INTERNAL;
+	reason = "Internal Server Error";
+	snprintf(u->tmp_path, sizeof(u->tmp_path), UPLOAD_DIR "/upload-XXXXXX");
+	if ((u->file_fd = mkostemp(u->tmp_path, O_CLOEXEC)) < 0) {
+		perror(u->tmp_path);
+		goto fail;
+	}
+	fchmod(u->file_fd, 0644);
+	/* Find out now, not a few gigabytes later, if it won't fit. */
+	if (u->remaining > 0 && fallocate(u->file_fd, 0, 0, u->remaining) < 0 &&
+		errno == ENOSPC) {
+		code = 507;
+		reason = "Insufficient Storage";
+		goto fail;
+	}
+	free(decoded_path);
+	decoded_path = NULL;
+
+	/* evhttp has nothing else to send on this connection until we
+	 * reply, so this is a single write() on an idle socket. */
+	if (u->expect_continue) {
+		static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+		if (write(bufferevent_getfd(u->sock), cont, sizeof(cont) - 1) !=
+			sizeof(cont) - 1)
+			goto fail;
+	}
+
+	/* Whatever came in along with the head is already in the socket's
+	 * buffer. */
+	input = bufferevent_get_input(u->sock);
+	while (u->remaining > 0 && evbuffer_get_length(input) > 0) {
+		if ((n = evbuffer_write_atmost(input, u->file_fd, u->remaining)) <= 0)
+			goto fail;
+		u->remaining -= n;
+	}
+	if (u->remaining == 0) {
+		upload_finish(u);
+		return;
+	}
+
+	/* The rest comes straight from the socket. */
+	if (u->pipe[0] < 0 && pipe2(u->pipe, O_CLOEXEC) == 0) {
+		/* A bigger pipe means fewer trips for each chunk. */
+		fcntl(u->pipe[1], F_SETPIPE_SZ, UPLOAD_CHUNK);
+	}
+	u->fd = bufferevent_getfd(u->sock);
+	if ((!u->ev && !(u->ev = event_new(server->base, u->fd,
+						 EV_READ | EV_PERSIST, upload_read_cb, u))) ||
+		event_add(u->ev, &timeout) < 0)
+		goto fail;
+	return;
+
+fail:
+	free(decoded_path);
+	upload_reply(u, code, reason);
+}
+
+static struct server_thread *servers;
+static int n_servers = 1;
+
+/* Open a listening socket that other threads can bind to the same port,
+ * letting the kernel spread new connections among them. */
+static evutil_socket_t
+bind_reuseport_socket(const char *addr, ev_uint16_t port)
+{
+	struct sockaddr_in sin;
+	evutil_socket_t fd;
+	int one = 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1)
+		return -1;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0 ||
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0 ||
+		evutil_make_socket_nonblocking(fd) < 0 ||
+		evutil_make_socket_closeonexec(fd) < 0 ||
+		bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+		listen(fd, 1024) < 0) {
+		evutil_closesocket(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* With --access-log, every request gets a line when its reply has gone
+ * out.  Its start time travels in the callback's argument, and the ring
+ * to use is the thread's own. */
+static bool log_requests;
+static __thread struct server_thread *this_server;
+
+static void
+log_request_cb(struct evhttp_request *req, void *arg)
+{
+	struct server_thread *s = this_server;
+	const char *length;
+	struct timeval now;
+	ev_int64_t bytes = -1;
+	ev_uintptr_t start = (ev_uintptr_t)arg;
+
+	event_base_gettimeofday_cached(s->base, &now);
+	if (evhttp_request_get_command(req) == EVHTTP_REQ_HEAD)
+		bytes = 0;
+	else if ((length = evhttp_find_header(
+				  evhttp_request_get_output_headers(req), "Content-Length")))
+		bytes = strtoll(length, NULL, 10);
+	access_log_request(s->index, &now,
+		router_method_name(evhttp_request_get_command(req)),
+		evhttp_request_get_uri(req), evhttp_request_get_response_code(req),
+		bytes,
+		(ev_uint32_t)((ev_uintptr_t)now.tv_sec * 1000000 + now.tv_usec - start));
+}
+
+static void
+handle_request(struct evhttp_request *req, void *arg)
+{
+	struct server_thread *s = arg;
+	struct timeval now;
+
+	if (log_requests) {
+		event_base_gettimeofday_cached(s->base, &now);
+		evhttp_request_set_on_complete_cb(req, log_request_cb,
+			(void *)((ev_uintptr_t)now.tv_sec * 1000000 + now.tv_usec));
+	}
+	router_dispatch(req, s->router);
+}
+
+/* GET /_stats: this thread's cache counters. */
+static void
+send_stats(
+	struct evhttp_request *req, const struct router_params *params, void *arg)
+{
+	struct server_thread *server = arg;
+	struct evbuffer *evb;
+
+	if (!(evb = evbuffer_new())) {
+		evhttp_send_error(req, HTTP_INTERNAL, NULL);
+		return;
+	}
+	file_cache_format_stats(server->cache, evb);
+	evhttp_add_header(
+		evhttp_request_get_output_headers(req), "Content-Type", "text/plain");
+	evhttp_add_header(
+		evhttp_request_get_output_headers(req), "Cache-Control", "no-store");
+	evhttp_send_reply(req, HTTP_OK, "OK", evb);
+	evbuffer_free(evb);
+}
+
+/* A bufferevent writes at most 16k per write() by default, which splits
+ * most replies in two.  With --uploads, evhttp gets the upload filter in
+ * front of it. */
+static struct bufferevent *
+make_bufferevent(struct event_base *base, void *arg)
+{
+	struct bufferevent *bev;
+
+	if (!(bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE)))
+		return NULL;
+	bufferevent_set_max_single_write(bev, 1024 * 1024);
+	return take_uploads ? upload_bufferevent(bev, arg) : bev;
+}
+
+static int
+server_thread_init(
+	struct server_thread *s, const char *http_addr, ev_uint16_t http_port)
+{
+	evutil_socket_t fd;
+
+	if (!(s->base = event_base_new()) ||
+		!(s->cache = file_cache_new(s->base)) ||
+		!(s->http = evhttp_new(s->base)) ||
+		!(s->done_event =
+				event_new(s->base, -1, 0, fs_done_cb, s)))
+		return -1;
+	pthread_mutex_init(&s->done_lock, NULL);
+	TAILQ_INIT(&s->done);
+	if ((fd = bind_reuseport_socket(http_addr, http_port)) < 0) {
+		perror("bind");
+		return -1;
+	}
+	if (!evhttp_accept_socket_with_handle(s->http, fd)) {
+		evutil_closesocket(fd);
+		return -1;
+	}
+	/* Anything that isn't one of our own pages is a file. */
+	if (!(s->router = router_new()) ||
+		router_add(s->router, EVHTTP_REQ_GET, "/_stats", send_stats, s) < 0)
+		return -1;
+	router_set_fallback(s->router, send_file_to_user, s);
+	evhttp_set_gencb(s->http, handle_request, s);
+	evhttp_set_bevcb(s->http, make_bufferevent, s);
+	LIST_INIT(&s->uploads);
+	if (take_uploads) {
+		/* Requests the filter loses track of go to evhttp whole, so they
+		 * had better be small. */
+		evhttp_set_max_headers_size(s->http, UPLOAD_MAX_HEAD);
+		evhttp_set_max_body_size(s->http, UPLOAD_MAX_HEAD);
+	}
+	return 0;
+}
+
+static void
+server_thread_free(struct server_thread *s)
+{
+	struct fs_job *job;
+
+	/* This frees the requests of any jobs still in progress, and tells
+	 * the directory listings that their connections are gone. */
+	if (s->http)
+		evhttp_free(s->http);
+	/* Jobs that came back after the loop stopped will never be answered. */
+	while ((job = TAILQ_FIRST(&s->done)) != NULL) {
+		TAILQ_REMOVE(&s->done, job, next);
+		fs_job_free(job);
+	}
+	if (s->router)
+		router_free(s->router);
+	if (s->done_event)
+		event_free(s->done_event);
+	pthread_mutex_destroy(&s->done_lock);
+	if (s->cache) {
+		file_cache_print_stats(s->cache);
+		file_cache_free(s->cache);
+	}
+	if (s->base)
+		event_base_free(s->base);
+}
+
+static void
+pin_to_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	if (cpu < 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		fprintf(stderr, "Couldn't pin thread to CPU %d\n", cpu);
+}
+
+static void *
+server_thread_run(void *arg)
+{
+	struct server_thread *s = arg;
+
+	this_server = s;
+	pin_to_cpu(s->cpu);
+	event_base_dispatch(s->base);
+	return NULL;
+}
+
+static void
+signal_cb(evutil_socket_t fd, short event, void *arg)
+{
+	int i;
+
+	printf("%s signal received\n", strsignal(fd));
+	/* Only the main thread gets signals; tell every loop to stop. */
+	for (i = 0; i < n_servers; ++i)
+		event_base_loopbreak(servers[i].base);
+}
+
+static void
+print_stats_cb(evutil_socket_t fd, short event, void *arg)
+{
+	file_cache_print_stats(arg);
+}
+
+static void
+stats_cb(evutil_socket_t fd, short event, void *arg)
+{
+	int i;
+
+	/* Each cache belongs to its own thread, so let that thread print it. */
+	for (i = 0; i < n_servers; ++i)
+		event_base_once(servers[i].base, -1, EV_TIMEOUT, print_stats_cb,
+			servers[i].cache, NULL);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [--threads N] [--pin] [--fs-threads N] [--precompress]\n"
+		"       [--mime-types FILE] [--bundle FILE] [--uploads]\n"
+		"       [--copy-max BYTES] [--mmap-max BYTES] [--access-log FILE]\n"
+		"       %s --make-bundle DOCROOT FILE\n",
+		prog, prog);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	ev_uint16_t http_port = 8080;
+	char *http_addr = "0.0.0.0";
+	struct event *sig_int, *sig_usr1;
+	struct event_base *base;
+	const char *mime_types_file = NULL, *bundle_file = NULL;
+	const char *access_log_file = NULL;
+	bool pin = false, precompress = false;
+	int fs_threads = 4;
+	int i;
+
+	for (i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			n_servers = atoi(argv[++i]);
+			if (n_servers < 1)
+				usage(argv[0]);
+		} else if (!strcmp(argv[i], "--pin")) {
+			pin = true;
+		} else if (!strcmp(argv[i], "--fs-threads") && i + 1 < argc) {
+			/* 0 means doing all the file I/O on the server threads. */
+			fs_threads = atoi(argv[++i]);
+			if (fs_threads < 0)
+				usage(argv[0]);
+		} else if (!strcmp(argv[i], "--precompress")) {
+			precompress = true;
+		} else if (!strcmp(argv[i], "--mime-types") && i + 1 < argc) {
+			mime_types_file = argv[++i];
+		} else if (!strcmp(argv[i], "--bundle") && i + 1 < argc) {
+			bundle_file = argv[++i];
+		} else if (!strcmp(argv[i], "--copy-max") && i + 1 < argc) {
+			delivery.copy_max = strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "--mmap-max") && i + 1 < argc) {
+			/* 0 means never mmap(); only copies and sendfile. */
+			delivery.mmap_max = strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "--access-log") && i + 1 < argc) {
+			access_log_file = argv[++i];
+		} else if (!strcmp(argv[i], "--uploads")) {
+			take_uploads = true;
+		} else if (!strcmp(argv[i], "--make-bundle") && i + 2 < argc) {
+			return make_bundle(argv[i + 1], argv[i + 2]) < 0;
+		} else {
+			usage(argv[0]);
+		}
+	}
+
+	if (mime_types_init(mime_types_file) < 0) {
+		fprintf(stderr, "Couldn't build the content type table\n");
+		return 1;
+	}
+	if (precompress)
+		precompress_tree(".");
+	if (take_uploads && mkdir(UPLOAD_DIR, 0700) < 0 && errno != EEXIST) {
+		perror(UPLOAD_DIR);
+		return 1;
+	}
+
+	/* Other threads will break out of our loops on SIGINT, and the
+	 * filesystem threads will activate events on them. */
+	if ((n_servers > 1 || fs_threads > 0) && evthread_use_pthreads() < 0) {
+		fprintf(stderr, "Couldn't enable threading support\n");
+		return 1;
+	}
+
+	/* After threading is on: the bundle's segments are shared. */
+	if (bundle_file && bundle_open(bundle_file) < 0)
+		return 1;
+
+	if (access_log_file) {
+		if (access_log_start(access_log_file, n_servers) < 0) {
+			perror(access_log_file);
+			return 1;
+		}
+		log_requests = true;
+	}
+
+	servers = calloc(n_servers, sizeof(*servers));
+	for (i = 0; i < n_servers; ++i) {
+		servers[i].index = i;
+		servers[i].cpu = pin ? i % (int)sysconf(_SC_NPROCESSORS_ONLN) : -1;
+		if (server_thread_init(&servers[i], http_addr, http_port) < 0) {
+			fprintf(stderr, "Couldn't set up server %d\n", i);
+			return 1;
+		}
+	}
+
+	if (fs_threads > 0 && fs_pool_start(fs_threads) < 0) {
+		fprintf(stderr, "Couldn't start the filesystem threads\n");
+		return 1;
+	}
+
+	/* The main thread runs the first server itself, and handles signals. */
+	base = servers[0].base;
+	sig_int = evsignal_new(base, SIGINT, signal_cb, NULL);
+	event_add(sig_int, NULL);
+	/* "kill -USR1" prints the cache counters, to help size the budget. */
+	sig_usr1 = evsignal_new(base, SIGUSR1, stats_cb, NULL);
+	event_add(sig_usr1, NULL);
+
+	for (i = 1; i < n_servers; ++i) {
+		if (pthread_create(&servers[i].thread, NULL, server_thread_run,
+				&servers[i]) != 0) {
+			fprintf(stderr, "Couldn't start thread %d\n", i);
+			return 1;
+		}
+	}
+
+	printf("Listening requests on http://%s:%d with %d thread%s\n", http_addr,
+		http_port, n_servers, n_servers > 1 ? "s" : "");
+	if (take_uploads)
+		printf("Taking uploads in PUT and POST requests\n");
 
-	printf("Listening requests on http://%s:%d\n", http_addr, http_port);
+	server_thread_run(&servers[0]);
 
-	event_base_dispatch(base);
+	for (i = 1; i < n_servers; ++i)
+		pthread_join(servers[i].thread, NULL);
+	fs_pool_stop();
 
-	evhttp_free(http_server);
 	event_free(sig_int);
-	event_base_free(base);
+	event_free(sig_usr1);
+	for (i = 0; i < n_servers; ++i)
+		server_thread_free(&servers[i]);
+	free(servers);
+	bundle_close();
+	access_log_stop();
+	return 0;
 }
@@ -1,13 +1,149 @@
+#define _GNU_SOURCE /* for splice() */
 #include <event2/listener.h>
 #include <event2/bufferevent.h>
 #include <event2/buffer.h>
 
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
+#include <fcntl.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
+
+#include "R8_mem_pool.h"
+
+/* With --workers N, the listener's thread only accepts connections, and
+ * hands each one to one of N worker threads, each with an event_base of
+ * its own.  A bufferevent lives and dies on its worker, so nothing is
+ * shared between threads except the queue of new connections, and we
+ * don't need evthread_use_pthreads() or any locks on the buffers.
+ *
+ * The queue is Dmitry Vyukov's intrusive multi-producer, single-consumer
+ * queue: pushing is one atomic exchange, and only the worker pops.  The
+ * acceptor wakes a worker through a pipe, but only if it isn't already
+ * awake, so a burst of connections costs one wakeup. */
+struct handoff {
+	_Atomic(struct handoff *) next;
+	evutil_socket_t fd;
+};
+
+struct handoff_queue {
+	_Atomic(struct handoff *) head; /* where producers push */
+	struct handoff *tail;			/* where the consumer pops */
+	struct handoff stub;
+};
+
+struct worker {
+	pthread_t thread;
+	struct event_base *base;
+	struct handoff_queue queue;
+	int wakeup_pipe[2];
+	struct event *wakeup_event;
+	atomic_bool wakeup_pending;
+	atomic_int n_conns;
+};
+
+static struct worker *workers;
+static int n_workers;
+static bool least_loaded;
+static bool use_splice;
+static bool use_pool;
+
+/* Running out of file descriptors is the one listener error we can live
+ * through, if we're careful: the connection we couldn't accept keeps the
+ * listener readable, so if we just returned, we'd be called again at once,
+ * forever.  So we keep a spare descriptor, and when the time comes, give
+ * it up to accept whatever is waiting and close it at once.  Then we stop
+ * listening for a while, longer each time it happens again.  With
+ * --max-conns, we also stop listening while we have that many
+ * connections, and look again every ACCEPT_CAP_CHECK_MSEC; meanwhile, new
+ * ones wait in the kernel's backlog. */
+#define ACCEPT_BACKOFF_MIN_MSEC 10
+#define ACCEPT_BACKOFF_MAX_MSEC 1000
+#define ACCEPT_CAP_CHECK_MSEC 10
+
+static struct {
+	struct evconnlistener *listener;
+	struct event *resume_event;
+	int spare_fd;
+	int max_conns; /* 0 for no limit */
+	atomic_int live; /* open connections, on every thread */
+	int backoff_msec;
+	/* Only the listener's thread touches these. */
+	unsigned long accepted, shed, fd_errors, pauses, cap_pauses;
+} accepting;
+
+static void
+handoff_queue_init(struct handoff_queue *q)
+{
+	atomic_init(&q->stub.next, NULL);
+	atomic_init(&q->head, &q->stub);
+	q->tail = &q->stub;
+}
+
+static void
+handoff_queue_push(struct handoff_queue *q, struct handoff *h)
+{
+	struct handoff *prev;
+
+	atomic_store_explicit(&h->next, NULL, memory_order_relaxed);
+	prev = atomic_exchange_explicit(&q->head, h, memory_order_acq_rel);
+	/* Until this store, the consumer can't see 'h', or anything pushed
+	 * after it. */
+	atomic_store_explicit(&prev->next, h, memory_order_release);
+}
+
+/* Returns NULL if the queue is empty, or if a push is half done; the
+ * producer will wake us up again when it's finished. */
+static struct handoff *
+handoff_queue_pop(struct handoff_queue *q)
+{
+	struct handoff *tail = q->tail;
+	struct handoff *next =
+		atomic_load_explicit(&tail->next, memory_order_acquire);
+
+	if (tail == &q->stub) {
+		if (!next)
+			return NULL;
+		q->tail = tail = next;
+		next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	}
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+		return NULL;
+	/* 'tail' is the last one: put the stub behind it, so that we can take
+	 * it without leaving the queue with nothing in it. */
+	handoff_queue_push(q, &q->stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+/* Every connection that closes, on whatever thread, comes through here. */
+static void
+conn_done(struct worker *w)
+{
+	if (w)
+		atomic_fetch_sub_explicit(&w->n_conns, 1, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&accepting.live, 1, memory_order_relaxed);
+}
 
 static void
 echo_read_cb(struct bufferevent *bev, void *ctx)
@@ -23,11 +159,327 @@ echo_read_cb(struct bufferevent *bev, void *ctx)
 static void
 echo_event_cb(struct bufferevent *bev, short events, void *ctx)
 {
+	struct worker *w = ctx;
+
 	if (events & BEV_EVENT_ERROR)
 		perror("Error from bufferevent");
 	if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
 		bufferevent_free(bev);
+		conn_done(w);
+	}
+}
+
+static void
+start_bufferevent(struct event_base *base, evutil_socket_t fd, struct worker *w)
+{
+	struct bufferevent *bev;
+
+	bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (!bev) {
+		evutil_closesocket(fd);
+		conn_done(w);
+		return;
+	}
+	bufferevent_setcb(bev, echo_read_cb, NULL, echo_event_cb, w);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+}
+
+#ifdef SPLICE_F_MOVE
+/* With --splice, the data never comes up to us at all: splice() moves it
+ * from the socket into a pipe, and from the pipe back out to the socket,
+ * inside the kernel.  There are no bufferevents here, just one event for
+ * reading and one for writing.  The pipe is our buffer: when it's full,
+ * we stop reading until the client has taken some of it. */
+#define SPLICE_PIPE_SIZE (256 * 1024)
+
+struct splice_conn {
+	evutil_socket_t fd;
+	int pipe[2];
+	size_t pipe_size;
+	size_t in_pipe; /* bytes read but not yet written back */
+	bool moved_any;
+	bool eof;
+	struct event *read_event;
+	struct event *write_event;
+	struct worker *worker;
+};
+
+static void
+splice_conn_free(struct splice_conn *c, bool close_fd)
+{
+	if (c->read_event)
+		event_free(c->read_event);
+	if (c->write_event)
+		event_free(c->write_event);
+	if (c->pipe[0] >= 0) {
+		close(c->pipe[0]);
+		close(c->pipe[1]);
+	}
+	if (close_fd) {
+		evutil_closesocket(c->fd);
+		conn_done(c->worker);
+	}
+	free(c);
+}
+
+/* Writes back as much of the pipe as the socket takes.  Returns -1 on
+ * error. */
+static int
+splice_flush(struct splice_conn *c)
+{
+	while (c->in_pipe > 0) {
+		ssize_t n = splice(c->pipe[0], NULL, c->fd, NULL, c->in_pipe,
+		    SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (n < 0) {
+			if (errno != EAGAIN)
+				return -1;
+			/* The client isn't reading; wait until it does. */
+			event_add(c->write_event, NULL);
+			return 0;
+		}
+		c->in_pipe -= n;
+	}
+	event_del(c->write_event);
+	return 0;
+}
+
+static void
+splice_read_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct splice_conn *c = arg;
+	ssize_t n;
+
+	n = splice(fd, NULL, c->pipe[1], NULL, c->pipe_size - c->in_pipe,
+	    SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	if (n < 0 && errno == EINVAL && !c->moved_any) {
+		/* This socket can't be spliced; do it the usual way. */
+		struct event_base *base = event_get_base(c->read_event);
+		struct worker *w = c->worker;
+		splice_conn_free(c, false);
+		start_bufferevent(base, fd, w);
+		return;
+	}
+	if (n < 0) {
+		if (errno == EAGAIN)
+			return;
+		perror("splice");
+		splice_conn_free(c, true);
+		return;
+	}
+	if (n == 0) {
+		c->eof = true;
+		event_del(c->read_event);
+		if (c->in_pipe == 0)
+			splice_conn_free(c, true);
+		return;
+	}
+	c->moved_any = true;
+	c->in_pipe += n;
+	if (splice_flush(c) < 0) {
+		splice_conn_free(c, true);
+		return;
+	}
+	if (c->in_pipe == c->pipe_size)
+		event_del(c->read_event);
+}
+
+static void
+splice_write_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct splice_conn *c = arg;
+
+	if (splice_flush(c) < 0 || (c->eof && c->in_pipe == 0)) {
+		splice_conn_free(c, true);
+		return;
+	}
+	if (!c->eof && c->in_pipe < c->pipe_size)
+		event_add(c->read_event, NULL);
+}
+
+static void
+start_splice(struct event_base *base, evutil_socket_t fd, struct worker *w)
+{
+	struct splice_conn *c;
+	int size;
+
+	if (!(c = calloc(1, sizeof(*c)))) {
+		start_bufferevent(base, fd, w);
+		return;
+	}
+	c->fd = fd;
+	c->worker = w;
+	if (pipe2(c->pipe, O_NONBLOCK|O_CLOEXEC) < 0) {
+		/* Out of file descriptors, most likely. */
+		c->pipe[0] = c->pipe[1] = -1;
+		splice_conn_free(c, false);
+		start_bufferevent(base, fd, w);
+		return;
+	}
+	/* A bigger pipe means fewer trips through the loop; we get what the
+	 * system allows. */
+	fcntl(c->pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+	size = fcntl(c->pipe[1], F_GETPIPE_SZ);
+	c->pipe_size = size > 0 ? size : 65536;
+	evutil_make_socket_nonblocking(fd);
+	c->read_event = event_new(base, fd, EV_READ|EV_PERSIST,
+	    splice_read_cb, c);
+	c->write_event = event_new(base, fd, EV_WRITE|EV_PERSIST,
+	    splice_write_cb, c);
+	if (!c->read_event || !c->write_event ||
+	    event_add(c->read_event, NULL) < 0)
+		splice_conn_free(c, true);
+}
+#endif
+
+static void
+start_connection(struct event_base *base, evutil_socket_t fd, struct worker *w)
+{
+#ifdef SPLICE_F_MOVE
+	if (use_splice) {
+		start_splice(base, fd, w);
+		return;
+	}
+#endif
+	start_bufferevent(base, fd, w);
+}
+
+static void
+worker_wakeup_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct worker *w = arg;
+	struct handoff *h;
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	/* Clear this before looking at the queue: anything pushed after we
+	 * stop looking will wake us up again. */
+	atomic_store(&w->wakeup_pending, false);
+	while ((h = handoff_queue_pop(&w->queue)) != NULL) {
+		start_connection(w->base, h->fd, w);
+		free(h);
+	}
+}
+
+static void *
+worker_run(void *arg)
+{
+	struct worker *w = arg;
+
+	event_base_dispatch(w->base);
+	return NULL;
+}
+
+static int
+start_workers(void)
+{
+	int i;
+
+	if (!(workers = calloc(n_workers, sizeof(*workers))))
+		return -1;
+	for (i = 0; i < n_workers; ++i) {
+		struct worker *w = &workers[i];
+
+		handoff_queue_init(&w->queue);
+		atomic_init(&w->wakeup_pending, false);
+		atomic_init(&w->n_conns, 0);
+		if (!(w->base = event_base_new()) || pipe(w->wakeup_pipe) < 0 ||
+		    evutil_make_socket_nonblocking(w->wakeup_pipe[0]) < 0 ||
+		    evutil_make_socket_nonblocking(w->wakeup_pipe[1]) < 0)
+			return -1;
+		w->wakeup_event = event_new(w->base, w->wakeup_pipe[0],
+		    EV_READ|EV_PERSIST, worker_wakeup_cb, w);
+		if (!w->wakeup_event || event_add(w->wakeup_event, NULL) < 0 ||
+		    pthread_create(&w->thread, NULL, worker_run, w) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static struct worker *
+pick_worker(void)
+{
+	static int next;
+	int i, best = 0;
+
+	if (!least_loaded) {
+		next = (next + 1) % n_workers;
+		return &workers[next];
+	}
+	for (i = 1; i < n_workers; ++i) {
+		if (atomic_load_explicit(&workers[i].n_conns, memory_order_relaxed) <
+		    atomic_load_explicit(&workers[best].n_conns, memory_order_relaxed))
+			best = i;
+	}
+	return &workers[best];
+}
+
+static void
+hand_off(evutil_socket_t fd)
+{
+	struct worker *w = pick_worker();
+	struct handoff *h;
+
+	if (!(h = malloc(sizeof(*h)))) {
+		evutil_closesocket(fd);
+		conn_done(NULL);
+		return;
+	}
+	h->fd = fd;
+	atomic_fetch_add_explicit(&w->n_conns, 1, memory_order_relaxed);
+	handoff_queue_push(&w->queue, h);
+	if (!atomic_exchange(&w->wakeup_pending, true)) {
+		char c = 0;
+		/* If the pipe is full, the worker has a wakeup coming anyway. */
+		if (write(w->wakeup_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+			perror("write");
+	}
+}
+
+static bool
+at_capacity(void)
+{
+	return accepting.max_conns > 0 &&
+	    atomic_load_explicit(&accepting.live, memory_order_relaxed) >=
+	    accepting.max_conns;
+}
+
+static void
+pause_accepting(int msec)
+{
+	struct timeval tv = {msec / 1000, (msec % 1000) * 1000};
+
+	evconnlistener_disable(accepting.listener);
+	event_add(accepting.resume_event, &tv);
+}
+
+static void
+resume_accepting_cb(evutil_socket_t fd, short what, void *arg)
+{
+	if (at_capacity())
+		pause_accepting(ACCEPT_CAP_CHECK_MSEC);
+	else
+		evconnlistener_enable(accepting.listener);
+}
+
+/* Accepts and closes everything that's waiting, using the spare fd's
+ * slot.  The clients see their connections closed, rather than hanging
+ * until we get around to them. */
+static void
+shed_connections(void)
+{
+	evutil_socket_t listener_fd = evconnlistener_get_fd(accepting.listener);
+	evutil_socket_t fd;
+
+	if (accepting.spare_fd < 0)
+		return;
+	close(accepting.spare_fd);
+	while ((fd = accept(listener_fd, NULL, NULL)) >= 0) {
+		evutil_closesocket(fd);
+		++accepting.shed;
 	}
+	/* If somebody else got the slot first, we'll try again next time. */
+	accepting.spare_fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
 }
 
 static void
@@ -37,12 +489,20 @@ accept_conn_cb(struct evconnlistener *listener,
 {
 	/* We got a new connection! Set up a bufferevent for it. */
 	struct event_base *base = evconnlistener_get_base(listener);
-	struct bufferevent *bev = bufferevent_socket_new(
-		base, fd, BEV_OPT_CLOSE_ON_FREE);
-
-	bufferevent_setcb(bev, echo_read_cb, NULL, echo_event_cb, NULL);
 
-	bufferevent_enable(bev, EV_READ|EV_WRITE);
+	++accepting.accepted;
+	accepting.backoff_msec = ACCEPT_BACKOFF_MIN_MSEC;
+	atomic_fetch_add_explicit(&accepting.live, 1, memory_order_relaxed);
+	if (n_workers > 0) {
+		/* Or let a worker do it. */
+		hand_off(fd);
+	} else {
+		start_connection(base, fd, NULL);
+	}
+	if (at_capacity()) {
+		++accepting.cap_pauses;
+		pause_accepting(ACCEPT_CAP_CHECK_MSEC);
+	}
 }
 
 static void
@@ -50,28 +510,107 @@ accept_error_cb(struct evconnlistener *listener, void *ctx)
 {
 	struct event_base *base = evconnlistener_get_base(listener);
 	int err = EVUTIL_SOCKET_ERROR();
+
+	if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM) {
+		++accepting.fd_errors;
+		if (err == EMFILE || err == ENFILE)
+			shed_connections();
+		++accepting.pauses;
+		pause_accepting(accepting.backoff_msec);
+		if (accepting.backoff_msec < ACCEPT_BACKOFF_MAX_MSEC)
+			accepting.backoff_msec *= 2;
+		return;
+	}
 	fprintf(stderr, "Got an error %d (%s) on the listener. "
 		"Shutting down.\n", err, evutil_socket_error_to_string(err));
 
 	event_base_loopexit(base, NULL);
 }
 
+/* On SIGUSR1, says how many connections we've taken and turned away, and
+ * how much memory we're holding, as one line of JSON. */
+static void
+stats_cb(evutil_socket_t sig, short events, void *arg)
+{
+	long pages = 0;
+	FILE *f;
+
+	if ((f = fopen("/proc/self/statm", "r")) != NULL) {
+		if (fscanf(f, "%*d %ld", &pages) != 1)
+			pages = 0;
+		fclose(f);
+	}
+	printf("{\"accept\":{\"accepted\":%lu,\"live\":%d,\"shed\":%lu,"
+	    "\"fd_errors\":%lu,\"pauses\":%lu,\"cap_pauses\":%lu},",
+	    accepting.accepted, atomic_load(&accepting.live), accepting.shed,
+	    accepting.fd_errors, accepting.pauses, accepting.cap_pauses);
+	printf("\"allocator\":\"%s\",\"rss_kb\":%ld",
+	    use_pool ? "pool" : "libc", pages * (sysconf(_SC_PAGESIZE) / 1024));
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	{
+		/* The pool's slabs come from malloc() too, so this counts
+		 * them as in use. */
+		struct mallinfo2 mi = mallinfo2();
+		printf(",\"malloc_held_bytes\":%zu,\"malloc_in_use_bytes\":%zu",
+		    mi.arena + mi.hblkhd, mi.uordblks + mi.hblkhd);
+	}
+#endif
+	if (use_pool) {
+		printf(",\"pool\":");
+		mem_pool_print_stats(stdout);
+	}
+	printf("}\n");
+	fflush(stdout);
+}
+
 int
 main(int argc, char **argv)
 {
 	struct event_base *base;
 	struct evconnlistener *listener;
+	struct event *sig_usr1;
 	struct sockaddr_in sin;
 
 	int port = 9876;
+	int defer_accept = 0;
+	int i;
 
-	if (argc > 1) {
-		port = atoi(argv[1]);
+	for (i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--workers") && i + 1 < argc) {
+			n_workers = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--least-loaded")) {
+			least_loaded = true;
+		} else if (!strcmp(argv[i], "--splice")) {
+#ifdef SPLICE_F_MOVE
+			use_splice = true;
+#else
+			puts("splice() isn't available here");
+			return 1;
+#endif
+		} else if (!strcmp(argv[i], "--pool")) {
+			use_pool = true;
+		} else if (!strcmp(argv[i], "--max-conns") && i + 1 < argc) {
+			accepting.max_conns = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--defer-accept") && i + 1 < argc) {
+			defer_accept = atoi(argv[++i]);
+		} else {
+			port = atoi(argv[i]);
+		}
 	}
 	if (port<=0 || port>65535) {
 		puts("Invalid port");
 		return 1;
 	}
+	/* Before anything else in Libevent allocates memory. */
+	if (use_pool)
+		mem_pool_install();
+	/* splice() into a socket the client has reset raises SIGPIPE, which
+	 * would take the whole server down with that one connection. */
+	signal(SIGPIPE, SIG_IGN);
+	if (n_workers > 0 && start_workers() < 0) {
+		puts("Couldn't start the worker threads");
+		return 1;
+	}
 
 	base = event_base_new();
 	if (!base) {
@@ -98,6 +637,32 @@ main(int argc, char **argv)
 	}
         evconnlistener_set_error_cb(listener, accept_error_cb);
 
+	accepting.listener = listener;
+	accepting.backoff_msec = ACCEPT_BACKOFF_MIN_MSEC;
+	accepting.spare_fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+	accepting.resume_event = evtimer_new(base, resume_accepting_cb, NULL);
+	if (!accepting.resume_event) {
+		puts("Couldn't make a timer");
+		return 1;
+	}
+	if (defer_accept > 0) {
+#ifdef TCP_DEFER_ACCEPT
+		/* Don't wake us up for a connection until it has sent us
+		 * something to echo, or 'defer_accept' seconds have passed. */
+		if (setsockopt(evconnlistener_get_fd(listener), IPPROTO_TCP,
+			TCP_DEFER_ACCEPT, &defer_accept, sizeof(defer_accept)) < 0)
+			perror("setsockopt(TCP_DEFER_ACCEPT)");
+#else
+		puts("--defer-accept isn't available here");
+#endif
+	}
+
+	sig_usr1 = evsignal_new(base, SIGUSR1, stats_cb, NULL);
+	if (!sig_usr1 || event_add(sig_usr1, NULL) < 0) {
+		puts("Couldn't catch SIGUSR1");
+		return 1;
+	}
+
 	event_base_dispatch(base);
 	return 0;
 }
@@ -0,0 +1,261 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/event.h>
+
+#include "R8_mem_pool.h"
+
+/* Sizes go up by 16 bytes to 128, and then by quarters of a power of two,
+ * up to 64K: 16, 32, ... 128, 160, 192, 224, 256, 320, ... 65536.  No
+ * request wastes more than a fifth of its block. */
+#define POOL_N_SMALL 8
+#define POOL_N_CLASSES (POOL_N_SMALL + 4 * 9)
+#define POOL_MAX_SIZE 65536
+#define POOL_LARGE POOL_N_CLASSES
+/* Each slab is at least this big, and holds at least this many blocks. */
+#define POOL_SLAB_SIZE (64 * 1024)
+#define POOL_SLAB_MIN_BLOCKS 4
+
+/* In front of every block; 16 bytes keeps what follows as aligned as
+ * what malloc() returns. */
+struct block_header {
+	size_t size; /* for blocks from malloc() */
+	unsigned cls;
+};
+#define POOL_HEADER 16
+
+struct free_block {
+	struct free_block *next;
+};
+
+/* Only the thread that owns them writes these; mem_pool_print_stats()
+ * reads them from wherever it is. */
+struct class_stats {
+	atomic_ulong allocs;
+	atomic_ulong frees;
+	atomic_ulong carved; /* blocks we've made of this size */
+	atomic_ulong slab_bytes;
+};
+
+struct thread_cache {
+	struct free_block *free[POOL_N_CLASSES];
+	/* What's left of the newest slab for each size.  We carve blocks
+	 * from it only as we need them, so that a slab we've barely used
+	 * doesn't cost us a slab's worth of memory. */
+	char *slab_next[POOL_N_CLASSES];
+	size_t slab_left[POOL_N_CLASSES];
+	struct class_stats stats[POOL_N_CLASSES + 1]; /* the last is large */
+	struct thread_cache *next;
+};
+
+#define STAT_ADD(counter, n)                                         \
+	atomic_store_explicit(&(counter),                                \
+	    atomic_load_explicit(&(counter), memory_order_relaxed) + (n), \
+	    memory_order_relaxed)
+
+/* A block freed on another thread than the one that allocated it just
+ * joins the other thread's free list.  A thread's cache outlives the
+ * thread, but our threads live as long as the program does. */
+static __thread struct thread_cache *this_cache;
+static struct thread_cache *all_caches;
+static pthread_mutex_t all_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t
+class_size(unsigned cls)
+{
+	unsigned group, step;
+
+	if (cls < POOL_N_SMALL)
+		return (cls + 1) * 16;
+	group = (cls - POOL_N_SMALL) / 4;
+	step = (cls - POOL_N_SMALL) % 4;
+	return (size_t)(5 + step) << (group + 5);
+}
+
+static unsigned
+size_class(size_t size)
+{
+	size_t x;
+	int msb;
+
+	if (size <= 16 * POOL_N_SMALL)
+		return size ? (size - 1) / 16 : 0;
+	x = size - 1;
+	msb = 63 - __builtin_clzll(x);
+	return POOL_N_SMALL + (msb - 7) * 4 + ((x >> (msb - 2)) & 3);
+}
+
+static struct thread_cache *
+get_cache(void)
+{
+	struct thread_cache *cache;
+
+	if ((cache = this_cache) != NULL)
+		return cache;
+	if (!(cache = calloc(1, sizeof(*cache))))
+		return NULL;
+	pthread_mutex_lock(&all_caches_lock);
+	cache->next = all_caches;
+	all_caches = cache;
+	pthread_mutex_unlock(&all_caches_lock);
+	return this_cache = cache;
+}
+
+/* Makes a new block of class 'cls', from a new slab if we need one. */
+static void *
+carve(struct thread_cache *cache, unsigned cls)
+{
+	size_t stride = POOL_HEADER + class_size(cls);
+	struct block_header *h;
+
+	if (!cache->slab_left[cls]) {
+		size_t n = POOL_SLAB_SIZE / stride;
+		if (n < POOL_SLAB_MIN_BLOCKS)
+			n = POOL_SLAB_MIN_BLOCKS;
+		if (!(cache->slab_next[cls] = malloc(n * stride)))
+			return NULL;
+		cache->slab_left[cls] = n;
+		STAT_ADD(cache->stats[cls].slab_bytes, n * stride);
+	}
+	h = (struct block_header *)cache->slab_next[cls];
+	h->cls = cls;
+	cache->slab_next[cls] += stride;
+	--cache->slab_left[cls];
+	STAT_ADD(cache->stats[cls].carved, 1);
+	return (char *)h + POOL_HEADER;
+}
+
+static void *
+pool_malloc(size_t size)
+{
+	struct thread_cache *cache = get_cache();
+	struct block_header *h;
+	struct free_block *fb;
+	unsigned cls;
+
+	if (!cache)
+		return NULL;
+	if (size > POOL_MAX_SIZE) {
+		if (!(h = malloc(POOL_HEADER + size)))
+			return NULL;
+		h->cls = POOL_LARGE;
+		h->size = size;
+		STAT_ADD(cache->stats[POOL_LARGE].allocs, 1);
+		return (char *)h + POOL_HEADER;
+	}
+	cls = size_class(size);
+	if ((fb = cache->free[cls]) != NULL)
+		cache->free[cls] = fb->next;
+	else if (!(fb = carve(cache, cls)))
+		return NULL;
+	STAT_ADD(cache->stats[cls].allocs, 1);
+	return fb;
+}
+
+static struct block_header *
+header_of(void *ptr)
+{
+	return (struct block_header *)((char *)ptr - POOL_HEADER);
+}
+
+static void
+pool_free(void *ptr)
+{
+	struct thread_cache *cache;
+	struct block_header *h;
+	struct free_block *fb = ptr;
+
+	if (!ptr || !(cache = get_cache()))
+		return;
+	h = header_of(ptr);
+	STAT_ADD(cache->stats[h->cls].frees, 1);
+	if (h->cls == POOL_LARGE) {
+		free(h);
+		return;
+	}
+	fb->next = cache->free[h->cls];
+	cache->free[h->cls] = fb;
+}
+
+static void *
+pool_realloc(void *ptr, size_t size)
+{
+	struct block_header *h;
+	size_t have;
+	void *p;
+
+	if (!ptr)
+		return pool_malloc(size);
+	if (size == 0) {
+		pool_free(ptr);
+		return NULL;
+	}
+	h = header_of(ptr);
+	have = h->cls == POOL_LARGE ? h->size : class_size(h->cls);
+	if (size <= have)
+		return ptr;
+	if (!(p = pool_malloc(size)))
+		return NULL;
+	memcpy(p, ptr, have);
+	pool_free(ptr);
+	return p;
+}
+
+void
+mem_pool_install(void)
+{
+#ifdef EVENT_SET_MEM_FUNCTIONS_IMPLEMENTED
+	event_set_mem_functions(pool_malloc, pool_realloc, pool_free);
+#endif
+}
+
+void
+mem_pool_print_stats(FILE *out)
+{
+	unsigned long allocs[POOL_N_CLASSES + 1] = {0};
+	unsigned long frees[POOL_N_CLASSES + 1] = {0};
+	unsigned long carved[POOL_N_CLASSES + 1] = {0};
+	unsigned long long slab_bytes[POOL_N_CLASSES + 1] = {0};
+	unsigned long long held = 0, in_use = 0;
+	struct thread_cache *cache;
+	const char *sep = "";
+	unsigned cls;
+
+	pthread_mutex_lock(&all_caches_lock);
+	for (cache = all_caches; cache; cache = cache->next) {
+		for (cls = 0; cls <= POOL_N_CLASSES; ++cls) {
+			struct class_stats *s = &cache->stats[cls];
+			allocs[cls] += atomic_load_explicit(
+			    &s->allocs, memory_order_relaxed);
+			frees[cls] += atomic_load_explicit(
+			    &s->frees, memory_order_relaxed);
+			carved[cls] += atomic_load_explicit(
+			    &s->carved, memory_order_relaxed);
+			slab_bytes[cls] += atomic_load_explicit(
+			    &s->slab_bytes, memory_order_relaxed);
+		}
+	}
+	pthread_mutex_unlock(&all_caches_lock);
+
+	for (cls = 0; cls < POOL_N_CLASSES; ++cls) {
+		unsigned long live =
+		    allocs[cls] > frees[cls] ? allocs[cls] - frees[cls] : 0;
+		held += slab_bytes[cls];
+		in_use += (unsigned long long)live * class_size(cls);
+	}
+	fprintf(out, "{\"held_bytes\":%llu,\"in_use_bytes\":%llu,"
+	    "\"large_allocs\":%lu,\"large_frees\":%lu,\"classes\":[",
+	    held, in_use, allocs[POOL_LARGE], frees[POOL_LARGE]);
+	for (cls = 0; cls < POOL_N_CLASSES; ++cls) {
+		if (!carved[cls])
+			continue;
+		fprintf(out, "%s{\"size\":%zu,\"allocs\":%lu,\"frees\":%lu,"
+		    "\"blocks\":%lu}", sep, class_size(cls), allocs[cls],
+		    frees[cls], carved[cls]);
+		sep = ",";
+	}
+	fprintf(out, "]}");
+}
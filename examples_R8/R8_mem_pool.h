@@ -0,0 +1,21 @@
+#ifndef R8_MEM_POOL_H_INCLUDED_
+#define R8_MEM_POOL_H_INCLUDED_
+
+#include <stdio.h>
+
+/* A size-class allocator for Libevent to use in place of malloc().  Every
+ * request is rounded up to one of a few dozen sizes, and each thread
+ * keeps a free list for each size, so allocating and freeing take no
+ * locks and no trips into the C library.  Blocks are carved out of
+ * bigger slabs, and are never given back: the point is to have them
+ * ready for the next connection.  Anything over 64K goes to malloc(). */
+
+/* Hands the pool to event_set_mem_functions().  As with any allocator,
+ * this has to happen before anything else in Libevent. */
+void mem_pool_install(void);
+
+/* Writes how many blocks of each size have been handed out and freed,
+ * summed over all threads, as a JSON object. */
+void mem_pool_print_stats(FILE *out);
+
+#endif